@@ -9,6 +9,7 @@
 #include <capypdf.h>
 #include <memory>
 #include <stdexcept>
+#include <string>
 
 #define CAPY_CPP_CHECK(funccall)                                                                   \
     {                                                                                              \
@@ -276,7 +277,7 @@ public:
 
     CapyPDF_FontId load_font(const char *fname) {
         CapyPDF_FontId fid;
-        CAPY_CPP_CHECK(capy_generator_load_font(*this, fname, &fid));
+        CAPY_CPP_CHECK(capy_generator_load_font(*this, fname, nullptr, &fid));
         return fid;
     }
 
@@ -305,6 +306,24 @@ public:
     }
 
     void write() { CAPY_CPP_CHECK(capy_generator_write(*this)); }
+
+    void write_to_callback(CapyPDF_Write_Callback cb, void *user_data) {
+        CAPY_CPP_CHECK(capy_generator_write_to_callback(*this, cb, user_data));
+    }
+
+    std::string write_to_memory() {
+        std::string output;
+        auto appender = [](const char *buf, int64_t bufsize, void *user_data) -> int32_t {
+            try {
+                static_cast<std::string *>(user_data)->append(buf, bufsize);
+            } catch(...) {
+                return 1;
+            }
+            return 0;
+        };
+        write_to_callback(appender, &output);
+        return output;
+    }
 };
 
 } // namespace capypdf
@@ -5,6 +5,7 @@
 import ctypes
 import os, sys
 import math
+import struct
 from enum import Enum, IntFlag, auto
 
 class LineCapStyle(Enum):
@@ -17,6 +18,61 @@ class LineJoinStyle(Enum):
     Round = 1
     Bevel = 2
 
+class PathOp(Enum):
+    MoveTo = 0
+    LineTo = 1
+    CurveTo = 2
+    CurveToV = 3
+    CurveToY = 4
+    Rectangle = 5
+    ClosePath = 6
+
+class Command(Enum):
+    b = 0
+    B = 1
+    bstar = 2
+    Bstar = 3
+    BDC_builtin = 4
+    BDC_ocg = 5
+    BMC = 6
+    c = 7
+    cm = 8
+    d = 9
+    Do = 10
+    EMC = 11
+    f = 12
+    fstar = 13
+    G = 14
+    g = 15
+    gs = 16
+    h = 17
+    i = 18
+    j = 19
+    J = 20
+    K = 21
+    k = 22
+    l = 23
+    m = 24
+    M = 25
+    n = 26
+    q = 27
+    Q = 28
+    re = 29
+    RG = 30
+    rg = 31
+    ri = 32
+    s = 33
+    S = 34
+    sh = 35
+    Tr = 36
+    v = 37
+    w = 38
+    W = 39
+    Wstar = 40
+    y = 41
+    DrawImage = 42
+    RenderText = 43
+
 class BlendMode(Enum):
     Normal = 0
     Multiply = 1
@@ -120,10 +176,61 @@ class ImageInterpolation(Enum):
     Pixelated = 1
     Smooth = 2
 
+class FontEncoding(Enum):
+    Subsets = 0
+    IdentityH = 1
+
 class Compression(Enum):
     Not = 0
     Deflate = 1
 
+class StreamClass(Enum):
+    Content = 0
+    Image = 1
+    Font = 2
+    EmbeddedFile = 3
+    Other = 4
+
+class DeflateStrategy(Enum):
+    Default = 0
+    Filtered = 1
+    HuffmanOnly = 2
+    RLE = 3
+
+class CompressionPreset(Enum):
+    Default = 0
+    Fast = 1
+    Max = 2
+
+class StreamEncoding(Enum):
+    Raw = 0
+    Deflate = 1
+    PngPredictor = 2
+
+class WritePhase(Enum):
+    Catalog = 0
+    PadFonts = 1
+    SubsetFonts = 2
+    Compress = 3
+    Objects = 4
+    Xref = 5
+    Output = 6
+
+class ObjectKind(Enum):
+    Dummy = 0
+    Full = 1
+    Deflate = 2
+    SubsetFontData = 3
+    SubsetFontDescriptor = 4
+    SubsetCMap = 5
+    SubsetFont = 6
+    Pages = 7
+    Page = 8
+    CheckboxWidget = 9
+    Annotation = 10
+    StructItem = 11
+    Written = 12
+
 class AnnotationFlag(IntFlag):
     Invisible = auto()
     Hidden = auto()
@@ -217,6 +324,7 @@ class CapyPDFException(Exception):
 
 ec_type = ctypes.c_int32
 enum_type = ctypes.c_int32
+write_callback_type = ctypes.CFUNCTYPE(ctypes.c_int32, ctypes.POINTER(ctypes.c_char), ctypes.c_int64, ctypes.c_void_p)
 
 class AnnotationId(ctypes.Structure):
     _fields_ = [('id', ctypes.c_int32)]
@@ -285,6 +393,21 @@ cfunc_types = (
 ('capy_doc_md_set_pdfa', [ctypes.c_void_p, enum_type]),
 ('capy_doc_md_set_default_page_properties', [ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_doc_md_set_tagged', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_doc_md_set_stream_pages', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_doc_md_set_object_streams', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_doc_md_set_num_threads', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_doc_md_set_write_stats', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_doc_md_set_number_precision', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_doc_md_set_compact_content_streams', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_doc_md_set_display_lists', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_doc_md_set_optimize_content', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_doc_md_set_merge_resources', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_doc_md_set_content_chunk_size', [ctypes.c_void_p, ctypes.c_int64]),
+('capy_doc_md_set_preload_kerning', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_doc_md_set_write_queue', [ctypes.c_void_p, ctypes.c_int32, ctypes.c_int64]),
+('capy_doc_md_set_compression', [ctypes.c_void_p, enum_type, ctypes.c_int32, enum_type]),
+('capy_doc_md_set_compression_preset', [ctypes.c_void_p, enum_type]),
+('capy_doc_md_set_compression_probe', [ctypes.c_void_p, ctypes.c_int32]),
 
 ('capy_page_properties_new', [ctypes.c_void_p]),
 ('capy_page_properties_destroy', [ctypes.c_void_p]),
@@ -302,7 +425,7 @@ cfunc_types = (
 ('capy_generator_convert_image', [ctypes.c_void_p, ctypes.c_void_p, enum_type, enum_type, ctypes.c_void_p]),
 ('capy_generator_load_icc_profile', [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p]),
 ('capy_generator_add_lab_colorspace', [ctypes.c_void_p, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_void_p]),
-('capy_generator_load_font', [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p]),
+('capy_generator_load_font', [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_generator_add_image', [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_generator_add_type2_function', [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_generator_add_type2_shading', [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
@@ -312,15 +435,19 @@ cfunc_types = (
 ('capy_generator_add_structure_item', [ctypes.c_void_p, enum_type, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_generator_add_custom_structure_item', [ctypes.c_void_p, RoleId, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_generator_write', [ctypes.c_void_p]),
+('capy_generator_write_to_callback', [ctypes.c_void_p, write_callback_type, ctypes.c_void_p]),
+('capy_generator_get_stats', [ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_generator_add_graphics_state', [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_generator_add_optional_content_group', [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_generator_add_outline', [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_generator_create_separation_simple', [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_generator_text_width', [ctypes.c_void_p, ctypes.c_char_p, FontId, ctypes.c_double, ctypes.POINTER(ctypes.c_double)]),
+('capy_generator_text_widths', [ctypes.c_void_p, ctypes.POINTER(ctypes.c_char_p), ctypes.c_int32, FontId, ctypes.c_double, ctypes.POINTER(ctypes.c_double)]),
 ('capy_generator_add_rolemap_entry', [ctypes.c_void_p, ctypes.c_char_p, enum_type, ctypes.c_void_p]),
 ('capy_generator_destroy', [ctypes.c_void_p]),
 
 ('capy_page_draw_context_new', [ctypes.c_void_p, ctypes.c_void_p]),
+('capy_generator_recycle_draw_context', [ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_dc_add_simple_navigation', [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int32, ctypes.c_void_p]),
 ('capy_dc_cmd_b', [ctypes.c_void_p]),
 ('capy_dc_cmd_B', [ctypes.c_void_p]),
@@ -350,6 +477,8 @@ cfunc_types = (
 ('capy_dc_cmd_m', [ctypes.c_void_p, ctypes.c_double, ctypes.c_double]),
 ('capy_dc_cmd_M', [ctypes.c_void_p, ctypes.c_double]),
 ('capy_dc_cmd_n', [ctypes.c_void_p]),
+('capy_dc_execute', [ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint8), ctypes.c_int32, ctypes.POINTER(ctypes.c_int32)]),
+('capy_dc_cmd_path', [ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint8), ctypes.c_int32, ctypes.POINTER(ctypes.c_double), ctypes.c_int32]),
 ('capy_dc_cmd_q', [ctypes.c_void_p]),
 ('capy_dc_cmd_Q', [ctypes.c_void_p]),
 ('capy_dc_cmd_RG', [ctypes.c_void_p, ctypes.c_double, ctypes.c_double, ctypes.c_double]),
@@ -509,6 +638,10 @@ cfunc_types = (
 ('capy_image_pdf_properties_set_interpolate', [ctypes.c_void_p, enum_type]),
 ('capy_image_pdf_properties_destroy', [ctypes.c_void_p]),
 
+('capy_font_properties_new', [ctypes.c_void_p]),
+('capy_font_properties_set_encoding', [ctypes.c_void_p, enum_type]),
+('capy_font_properties_destroy', [ctypes.c_void_p]),
+
 ('capy_destination_new', [ctypes.c_void_p]),
 ('capy_destination_set_page_fit', [ctypes.c_void_p, ctypes.c_int32]),
 ('capy_destination_set_page_xyz', [ctypes.c_void_p, ctypes.c_int32, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
@@ -522,6 +655,14 @@ cfunc_types = (
 ('capy_outline_set_parent', [ctypes.c_void_p, OutlineId]),
 ('capy_outline_destroy', [ctypes.c_void_p]),
 
+('capy_write_stats_get_stream_count', [ctypes.c_void_p, enum_type, enum_type, ctypes.POINTER(ctypes.c_int32)]),
+('capy_write_stats_get_stream_bytes', [ctypes.c_void_p, enum_type, ctypes.POINTER(ctypes.c_int64), ctypes.POINTER(ctypes.c_int64)]),
+('capy_write_stats_get_phase_time', [ctypes.c_void_p, enum_type, ctypes.POINTER(ctypes.c_int64), ctypes.POINTER(ctypes.c_int64)]),
+('capy_write_stats_get_object_count', [ctypes.c_void_p, enum_type, ctypes.POINTER(ctypes.c_int32), ctypes.POINTER(ctypes.c_int64)]),
+('capy_write_stats_get_peak_buffered_bytes', [ctypes.c_void_p, ctypes.POINTER(ctypes.c_int64)]),
+('capy_write_stats_get_removed_operators', [ctypes.c_void_p, ctypes.POINTER(ctypes.c_int64)]),
+('capy_write_stats_destroy', [ctypes.c_void_p]),
+
 )
 
 def locate_shared_lib():
@@ -597,6 +738,22 @@ def to_array(ctype, array):
         raise CapyPDFException('Array value argument must be an list or tuple.')
     return (ctype * len(array))(*array), len(array)
 
+def buffer_array(ctype, fmt, data):
+    '''Returns the contents of data as a ctypes array and its length.
+
+    Writable contiguous buffers whose item format is fmt, such as
+    array.array and numpy arrays, are used without copying.'''
+    try:
+        view = memoryview(data)
+    except TypeError:
+        return to_array(ctype, data)
+    if view.format != fmt or not view.c_contiguous:
+        return to_array(ctype, view.tolist())
+    count = view.nbytes // ctypes.sizeof(ctype)
+    if view.readonly:
+        return (ctype * count).from_buffer_copy(view), count
+    return (ctype * count).from_buffer(view), count
+
 class DocumentMetadata:
     def __init__(self):
         opt = ctypes.c_void_p()
@@ -656,6 +813,66 @@ class DocumentMetadata:
         tagint = 1 if is_tagged else 0
         check_error(libfile.capy_doc_md_set_tagged(self, tagint))
 
+    def set_stream_pages(self, stream_pages):
+        streamint = 1 if stream_pages else 0
+        check_error(libfile.capy_doc_md_set_stream_pages(self, streamint))
+
+    def set_object_streams(self, object_streams):
+        objstmint = 1 if object_streams else 0
+        check_error(libfile.capy_doc_md_set_object_streams(self, objstmint))
+
+    def set_num_threads(self, num_threads):
+        check_error(libfile.capy_doc_md_set_num_threads(self, num_threads))
+
+    def set_write_stats(self, write_stats):
+        statsint = 1 if write_stats else 0
+        check_error(libfile.capy_doc_md_set_write_stats(self, statsint))
+
+    def set_write_queue(self, max_depth, max_bytes=0):
+        check_error(libfile.capy_doc_md_set_write_queue(self, max_depth, max_bytes))
+
+    def set_compression(self, sclass, level, strategy=DeflateStrategy.Default):
+        if not isinstance(sclass, StreamClass):
+            raise CapyPDFException('Argument must be a stream class.')
+        if not isinstance(strategy, DeflateStrategy):
+            raise CapyPDFException('Argument must be a deflate strategy.')
+        check_error(libfile.capy_doc_md_set_compression(self, sclass.value, level, strategy.value))
+
+    def set_compression_preset(self, preset):
+        if not isinstance(preset, CompressionPreset):
+            raise CapyPDFException('Argument must be a compression preset.')
+        check_error(libfile.capy_doc_md_set_compression_preset(self, preset.value))
+
+    def set_compression_probe(self, probe):
+        probeint = 1 if probe else 0
+        check_error(libfile.capy_doc_md_set_compression_probe(self, probeint))
+
+    def set_number_precision(self, precision):
+        check_error(libfile.capy_doc_md_set_number_precision(self, precision))
+
+    def set_compact_content_streams(self, compact):
+        compactint = 1 if compact else 0
+        check_error(libfile.capy_doc_md_set_compact_content_streams(self, compactint))
+
+    def set_display_lists(self, record):
+        recordint = 1 if record else 0
+        check_error(libfile.capy_doc_md_set_display_lists(self, recordint))
+
+    def set_optimize_content(self, optimize):
+        optimizeint = 1 if optimize else 0
+        check_error(libfile.capy_doc_md_set_optimize_content(self, optimizeint))
+
+    def set_merge_resources(self, merge):
+        mergeint = 1 if merge else 0
+        check_error(libfile.capy_doc_md_set_merge_resources(self, mergeint))
+
+    def set_content_chunk_size(self, num_bytes):
+        check_error(libfile.capy_doc_md_set_content_chunk_size(self, num_bytes))
+
+    def set_preload_kerning(self, preload):
+        preloadint = 1 if preload else 0
+        check_error(libfile.capy_doc_md_set_preload_kerning(self, preloadint))
+
 
 class PageProperties:
     def __init__(self):
@@ -674,6 +891,177 @@ class PageProperties:
             raise CapyPDFException('Argument must be transparency group proprerty object.')
         check_error(libfile.capy_page_properties_set_transparency_group_properties(self, trgroup))
 
+class CommandBuffer:
+    '''Drawing commands that are run with a single call to DrawContext.execute.'''
+
+    def __init__(self):
+        self.data = bytearray()
+
+    def _add(self, command, fmt, *args):
+        self.data += struct.pack('=B' + fmt, command.value, *args)
+
+    def clear(self):
+        self.data.clear()
+
+    def cmd_b(self):
+        self._add(Command.b, '')
+
+    def cmd_B(self):
+        self._add(Command.B, '')
+
+    def cmd_bstar(self):
+        self._add(Command.bstar, '')
+
+    def cmd_Bstar(self):
+        self._add(Command.Bstar, '')
+
+    def cmd_BDC(self, ocg):
+        if not isinstance(ocg, OptionalContentGroupId):
+            raise CapyPDFException('Argument must be an optional content group ID.')
+        self._add(Command.BDC_ocg, 'i', ocg.id)
+
+    def cmd_BDC_builtin(self, structid):
+        if not isinstance(structid, StructureItemId):
+            raise CapyPDFException('Argument must be a structure item ID.')
+        self._add(Command.BDC_builtin, 'i', structid.id)
+
+    def cmd_BMC(self, tag):
+        tag_bytes = tag.encode('UTF-8')
+        self._add(Command.BMC, f'i{len(tag_bytes)}s', len(tag_bytes), tag_bytes)
+
+    def cmd_c(self, x1, y1, x2, y2, x3, y3):
+        self._add(Command.c, 'dddddd', x1, y1, x2, y2, x3, y3)
+
+    def cmd_cm(self, m1, m2, m3, m4, m5, m6):
+        self._add(Command.cm, 'dddddd', m1, m2, m3, m4, m5, m6)
+
+    def cmd_d(self, array, phase):
+        self._add(Command.d, f'i{len(array)}dd', len(array), *array, phase)
+
+    def cmd_Do(self, tgid):
+        if not isinstance(tgid, TransparencyGroupId):
+            raise CapyPDFException('Argument must be a transparency group id.')
+        self._add(Command.Do, 'i', tgid.id)
+
+    def cmd_EMC(self):
+        self._add(Command.EMC, '')
+
+    def cmd_f(self):
+        self._add(Command.f, '')
+
+    def cmd_fstar(self):
+        self._add(Command.fstar, '')
+
+    def cmd_G(self, gray):
+        self._add(Command.G, 'd', gray)
+
+    def cmd_g(self, gray):
+        self._add(Command.g, 'd', gray)
+
+    def cmd_h(self):
+        self._add(Command.h, '')
+
+    def cmd_i(self, flatness):
+        self._add(Command.i, 'd', flatness)
+
+    def cmd_K(self, c, m, y, k):
+        self._add(Command.K, 'dddd', c, m, y, k)
+
+    def cmd_k(self, c, m, y, k):
+        self._add(Command.k, 'dddd', c, m, y, k)
+
+    def cmd_l(self, x, y):
+        self._add(Command.l, 'dd', x, y)
+
+    def cmd_m(self, x, y):
+        self._add(Command.m, 'dd', x, y)
+
+    def cmd_M(self, miterlimit):
+        self._add(Command.M, 'd', miterlimit)
+
+    def cmd_n(self):
+        self._add(Command.n, '')
+
+    def cmd_q(self):
+        self._add(Command.q, '')
+
+    def cmd_Q(self):
+        self._add(Command.Q, '')
+
+    def cmd_re(self, x, y, w, h):
+        self._add(Command.re, 'dddd', x, y, w, h)
+
+    def cmd_RG(self, r, g, b):
+        self._add(Command.RG, 'ddd', r, g, b)
+
+    def cmd_rg(self, r, g, b):
+        self._add(Command.rg, 'ddd', r, g, b)
+
+    def cmd_s(self):
+        self._add(Command.s, '')
+
+    def cmd_S(self):
+        self._add(Command.S, '')
+
+    def cmd_v(self, x2, y2, x3, y3):
+        self._add(Command.v, 'dddd', x2, y2, x3, y3)
+
+    def cmd_w(self, line_width):
+        self._add(Command.w, 'd', line_width)
+
+    def cmd_W(self):
+        self._add(Command.W, '')
+
+    def cmd_Wstar(self):
+        self._add(Command.Wstar, '')
+
+    def cmd_y(self, x1, y1, x3, y3):
+        self._add(Command.y, 'dddd', x1, y1, x3, y3)
+
+    def cmd_gs(self, gsid):
+        if not isinstance(gsid, GraphicsStateId):
+            raise CapyPDFException('Argument must be a graphics state id.')
+        self._add(Command.gs, 'i', gsid.id)
+
+    def cmd_j(self, join_style):
+        if not isinstance(join_style, LineJoinStyle):
+            raise CapyPDFException('Argument must be a line join style.')
+        self._add(Command.j, 'i', join_style.value)
+
+    def cmd_J(self, cap_style):
+        if not isinstance(cap_style, LineCapStyle):
+            raise CapyPDFException('Argument must be a line cap style.')
+        self._add(Command.J, 'i', cap_style.value)
+
+    def cmd_ri(self, ri):
+        if not isinstance(ri, RenderingIntent):
+            raise CapyPDFException('Argument must be a rendering intent.')
+        self._add(Command.ri, 'i', ri.value)
+
+    def cmd_sh(self, shid):
+        if not isinstance(shid, ShadingId):
+            raise CapyPDFException('Argument must be a shading id.')
+        self._add(Command.sh, 'i', shid.id)
+
+    def cmd_Tr(self, mode):
+        if not isinstance(mode, TextMode):
+            raise CapyPDFException('Argument must be a text mode.')
+        self._add(Command.Tr, 'i', mode.value)
+
+    def draw_image(self, iid):
+        if not isinstance(iid, ImageId):
+            raise CapyPDFException('Image id argument is not an image id object.')
+        self._add(Command.DrawImage, 'i', iid.id)
+
+    def render_text(self, text, fid, point_size, x, y):
+        if not isinstance(text, str):
+            raise CapyPDFException('Text to render is not a string.')
+        if not isinstance(fid, FontId):
+            raise CapyPDFException('Font id argument is not a font id object.')
+        text_bytes = text.encode('UTF-8')
+        self._add(Command.RenderText, f'i{len(text_bytes)}siddd',
+                  len(text_bytes), text_bytes, fid.id, point_size, x, y)
+
 class DrawContextBase:
 
     def __init__(self, generator):
@@ -774,9 +1162,28 @@ class DrawContextBase:
     def cmd_n(self):
         check_error(libfile.capy_dc_cmd_n(self))
 
+    def cmd_path(self, ops, coords):
+        if isinstance(ops, (list, tuple)):
+            ops = [op.value if isinstance(op, PathOp) else op for op in ops]
+        opbuf, num_ops = buffer_array(ctypes.c_uint8, 'B', ops)
+        coordbuf, num_coords = buffer_array(ctypes.c_double, 'd', coords)
+        check_error(libfile.capy_dc_cmd_path(self, opbuf, num_ops, coordbuf, num_coords))
+
     def cmd_q(self):
         check_error(libfile.capy_dc_cmd_q(self))
 
+    def execute(self, commands):
+        if not isinstance(commands, CommandBuffer):
+            raise CapyPDFException('Argument must be a command buffer.')
+        size = len(commands.data)
+        buf = (ctypes.c_uint8 * size).from_buffer(commands.data)
+        failed = ctypes.c_int32()
+        rc = libfile.capy_dc_execute(self, buf, size, ctypes.pointer(failed))
+        # Release the buffer export so that the command buffer can be changed again.
+        del buf
+        if rc != 0:
+            raise CapyPDFException(f'Command {failed.value} failed: {get_error_message(rc)}')
+
     def cmd_Q(self):
         check_error(libfile.capy_dc_cmd_Q(self))
 
@@ -982,6 +1389,7 @@ class MarkedContextManager:
 
 class Generator:
     def __init__(self, filename, options=None):
+        self._as_parameter_ = None
         file_name_bytes = to_bytepath(filename)
         if options is None:
             options = DocumentMetadata()
@@ -1011,6 +1419,11 @@ class Generator:
     def add_page(self, page_ctx):
         check_error(libfile.capy_generator_add_page(self, page_ctx))
 
+    def recycle_draw_context(self, page_ctx):
+        check_error(libfile.capy_generator_recycle_draw_context(self, page_ctx))
+        # The generator owns the context now.
+        page_ctx._as_parameter_ = None
+
     def add_form_xobject(self, fxo_ctx):
         fxid = FormXObjectId()
         check_error(libfile.capy_generator_add_form_xobject(self, fxo_ctx, ctypes.pointer(fxid)))
@@ -1038,9 +1451,11 @@ class Generator:
         check_error(libfile.capy_generator_embed_file(self, to_bytepath(fname), ctypes.pointer(fid)))
         return fid
 
-    def load_font(self, fname):
+    def load_font(self, fname, props=None):
+        if props is not None and not isinstance(props, FontProperties):
+            raise CapyPDFException('Argument must be font properties.')
         fid = FontId()
-        check_error(libfile.capy_generator_load_font(self, to_bytepath(fname), ctypes.pointer(fid)))
+        check_error(libfile.capy_generator_load_font(self, to_bytepath(fname), props, ctypes.pointer(fid)))
         return fid
 
     def load_icc_profile(self, fname):
@@ -1143,6 +1558,19 @@ class Generator:
     def write(self):
         check_error(libfile.capy_generator_write(self))
 
+    def write_to_bytes(self):
+        chunks = []
+        def collect(buf, bufsize, user_data):
+            chunks.append(ctypes.string_at(buf, bufsize))
+            return 0
+        check_error(libfile.capy_generator_write_to_callback(self, write_callback_type(collect), None))
+        return b''.join(chunks)
+
+    def get_stats(self):
+        sptr = ctypes.c_void_p()
+        check_error(libfile.capy_generator_get_stats(self, ctypes.pointer(sptr)))
+        return WriteStats(sptr)
+
     def text_width(self, text, font, pointsize):
         if not isinstance(text, str):
             raise CapyPDFException('Text must be a Unicode string.')
@@ -1153,6 +1581,19 @@ class Generator:
         check_error(libfile.capy_generator_text_width(self, bytes, font, pointsize, ctypes.pointer(w)))
         return w.value
 
+    def text_widths(self, texts, font, pointsize):
+        if not isinstance(font, FontId):
+            raise CapyPDFException('Font argument is not a font id.')
+        encoded = []
+        for text in texts:
+            if not isinstance(text, str):
+                raise CapyPDFException('Text must be a Unicode string.')
+            encoded.append(text.encode('UTF-8'))
+        text_array = (ctypes.c_char_p * len(encoded))(*encoded)
+        widths = (ctypes.c_double * len(encoded))()
+        check_error(libfile.capy_generator_text_widths(self, text_array, len(encoded), font, pointsize, widths))
+        return list(widths)
+
     def add_graphics_state(self, gs):
         if not isinstance(gs, GraphicsState):
             raise CapyPDFException('Argument must be a graphics state object.')
@@ -1646,6 +2087,20 @@ class ImagePdfProperties:
             raise CapyPDFException('Argument must be image interpolation enum.')
         check_error(libfile.capy_image_lpdf_properties_set_interpolate(self, ival.value))
 
+class FontProperties:
+    def __init__(self):
+        fp = ctypes.c_void_p()
+        check_error(libfile.capy_font_properties_new(ctypes.pointer(fp)))
+        self._as_parameter_ = fp
+
+    def __del__(self):
+        check_error(libfile.capy_font_properties_destroy(self))
+
+    def set_encoding(self, encoding):
+        if not isinstance(encoding, FontEncoding):
+            raise CapyPDFException('Argument must be a font encoding enum.')
+        check_error(libfile.capy_font_properties_set_encoding(self, encoding.value))
+
 class Destination:
     def __init__(self):
         d = ctypes.c_void_p()
@@ -1699,3 +2154,53 @@ class Outline:
         if not isinstance(parent, OutlineId):
             raise CapyPDFException('Argument must be a parent id.')
         check_error(libfile.capy_outline_set_parent(self, parent))
+
+class WriteStats:
+    def __init__(self, sptr):
+        self._as_parameter_ = sptr
+
+    def __del__(self):
+        check_error(libfile.capy_write_stats_destroy(self))
+
+    def get_stream_count(self, sclass, encoding):
+        if not isinstance(sclass, StreamClass):
+            raise CapyPDFException('Argument must be a stream class.')
+        if not isinstance(encoding, StreamEncoding):
+            raise CapyPDFException('Argument must be a stream encoding.')
+        count = ctypes.c_int32()
+        check_error(libfile.capy_write_stats_get_stream_count(self, sclass.value, encoding.value, ctypes.pointer(count)))
+        return count.value
+
+    def get_stream_bytes(self, sclass):
+        if not isinstance(sclass, StreamClass):
+            raise CapyPDFException('Argument must be a stream class.')
+        raw = ctypes.c_int64()
+        encoded = ctypes.c_int64()
+        check_error(libfile.capy_write_stats_get_stream_bytes(self, sclass.value, ctypes.pointer(raw), ctypes.pointer(encoded)))
+        return (raw.value, encoded.value)
+
+    def get_phase_time(self, phase):
+        if not isinstance(phase, WritePhase):
+            raise CapyPDFException('Argument must be a write phase.')
+        wall = ctypes.c_int64()
+        cpu = ctypes.c_int64()
+        check_error(libfile.capy_write_stats_get_phase_time(self, phase.value, ctypes.pointer(wall), ctypes.pointer(cpu)))
+        return (wall.value, cpu.value)
+
+    def get_object_count(self, kind):
+        if not isinstance(kind, ObjectKind):
+            raise CapyPDFException('Argument must be an object kind.')
+        count = ctypes.c_int32()
+        size = ctypes.c_int64()
+        check_error(libfile.capy_write_stats_get_object_count(self, kind.value, ctypes.pointer(count), ctypes.pointer(size)))
+        return (count.value, size.value)
+
+    def get_peak_buffered_bytes(self):
+        peak = ctypes.c_int64()
+        check_error(libfile.capy_write_stats_get_peak_buffered_bytes(self, ctypes.pointer(peak)))
+        return peak.value
+
+    def get_removed_operators(self):
+        removed = ctypes.c_int64()
+        check_error(libfile.capy_write_stats_get_removed_operators(self, ctypes.pointer(removed)))
+        return removed.value
@@ -189,6 +189,150 @@ CAPYPDF_PUBLIC CapyPDF_EC capy_doc_md_set_tagged(CapyPDF_DocumentMetadata *md,
     RETNOERR;
 }
 
+CAPYPDF_PUBLIC CapyPDF_EC capy_doc_md_set_stream_pages(CapyPDF_DocumentMetadata *md,
+                                                       int32_t stream_pages) CAPYPDF_NOEXCEPT {
+    CHECK_BOOLEAN(stream_pages);
+    auto metadata = reinterpret_cast<DocumentMetadata *>(md);
+    metadata->stream_pages = stream_pages;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_doc_md_set_write_queue(CapyPDF_DocumentMetadata *md,
+                                                      int32_t max_depth,
+                                                      int64_t max_bytes) CAPYPDF_NOEXCEPT {
+    if(max_depth < 0 || max_bytes < 0) {
+        return conv_err(ErrorCode::InvalidWriteQueueSize);
+    }
+    auto metadata = reinterpret_cast<DocumentMetadata *>(md);
+    metadata->write_queue_depth = max_depth;
+    metadata->write_queue_max_bytes = max_bytes;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_doc_md_set_object_streams(CapyPDF_DocumentMetadata *md,
+                                                         int32_t object_streams) CAPYPDF_NOEXCEPT {
+    CHECK_BOOLEAN(object_streams);
+    auto metadata = reinterpret_cast<DocumentMetadata *>(md);
+    metadata->object_streams = object_streams;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_doc_md_set_num_threads(CapyPDF_DocumentMetadata *md,
+                                                      int32_t num_threads) CAPYPDF_NOEXCEPT {
+    if(num_threads < 0) {
+        return conv_err(ErrorCode::NegativeThreadCount);
+    }
+    auto metadata = reinterpret_cast<DocumentMetadata *>(md);
+    metadata->num_threads = num_threads;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_doc_md_set_write_stats(CapyPDF_DocumentMetadata *md,
+                                                      int32_t write_stats) CAPYPDF_NOEXCEPT {
+    CHECK_BOOLEAN(write_stats);
+    auto metadata = reinterpret_cast<DocumentMetadata *>(md);
+    metadata->write_stats = write_stats;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_doc_md_set_compression(CapyPDF_DocumentMetadata *md,
+                                                      CapyPDF_Stream_Class sclass,
+                                                      int32_t level,
+                                                      CapyPDF_Deflate_Strategy strategy)
+    CAPYPDF_NOEXCEPT {
+    if((int)sclass < 0 || (int)sclass > (int)CAPY_STREAM_CLASS_OTHER) {
+        return conv_err(ErrorCode::BadEnum);
+    }
+    if((int)strategy < 0 || (int)strategy > (int)CAPY_DEFLATE_RLE) {
+        return conv_err(ErrorCode::BadEnum);
+    }
+    if(level < 0 || level > 9) {
+        return conv_err(ErrorCode::InvalidCompressionLevel);
+    }
+    auto metadata = reinterpret_cast<DocumentMetadata *>(md);
+    metadata->compression.get(sclass) = DeflateSettings{level, strategy};
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_doc_md_set_compression_preset(
+    CapyPDF_DocumentMetadata *md, CapyPDF_Compression_Preset preset) CAPYPDF_NOEXCEPT {
+    auto metadata = reinterpret_cast<DocumentMetadata *>(md);
+    auto rc = CompressionPolicy::from_preset(preset);
+    if(rc) {
+        metadata->compression = rc.value();
+    }
+    return conv_err(rc);
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_doc_md_set_compression_probe(CapyPDF_DocumentMetadata *md,
+                                                            int32_t probe) CAPYPDF_NOEXCEPT {
+    CHECK_BOOLEAN(probe);
+    auto metadata = reinterpret_cast<DocumentMetadata *>(md);
+    metadata->compression.probe = probe;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_doc_md_set_number_precision(CapyPDF_DocumentMetadata *md,
+                                                           int32_t precision) CAPYPDF_NOEXCEPT {
+    if(precision < 0 || precision > max_number_precision) {
+        return conv_err(ErrorCode::InvalidNumberPrecision);
+    }
+    auto metadata = reinterpret_cast<DocumentMetadata *>(md);
+    metadata->number_precision = precision;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_doc_md_set_compact_content_streams(CapyPDF_DocumentMetadata *md,
+                                                                  int32_t compact)
+    CAPYPDF_NOEXCEPT {
+    CHECK_BOOLEAN(compact);
+    auto metadata = reinterpret_cast<DocumentMetadata *>(md);
+    metadata->compact_content = compact;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_doc_md_set_display_lists(CapyPDF_DocumentMetadata *md,
+                                                        int32_t record) CAPYPDF_NOEXCEPT {
+    CHECK_BOOLEAN(record);
+    auto metadata = reinterpret_cast<DocumentMetadata *>(md);
+    metadata->record_display_lists = record;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_doc_md_set_optimize_content(CapyPDF_DocumentMetadata *md,
+                                                           int32_t optimize) CAPYPDF_NOEXCEPT {
+    CHECK_BOOLEAN(optimize);
+    auto metadata = reinterpret_cast<DocumentMetadata *>(md);
+    metadata->optimize_content = optimize;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_doc_md_set_merge_resources(CapyPDF_DocumentMetadata *md,
+                                                          int32_t merge) CAPYPDF_NOEXCEPT {
+    CHECK_BOOLEAN(merge);
+    auto metadata = reinterpret_cast<DocumentMetadata *>(md);
+    metadata->merge_resources = merge;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_doc_md_set_preload_kerning(CapyPDF_DocumentMetadata *md,
+                                                          int32_t preload) CAPYPDF_NOEXCEPT {
+    CHECK_BOOLEAN(preload);
+    auto metadata = reinterpret_cast<DocumentMetadata *>(md);
+    metadata->preload_kerning = preload;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_doc_md_set_content_chunk_size(CapyPDF_DocumentMetadata *md,
+                                                             int64_t bytes) CAPYPDF_NOEXCEPT {
+    if(bytes < 0) {
+        return conv_err(ErrorCode::InvalidContentChunkSize);
+    }
+    auto metadata = reinterpret_cast<DocumentMetadata *>(md);
+    metadata->content_chunk_size = bytes;
+    RETNOERR;
+}
+
 CapyPDF_EC capy_generator_new(const char *filename,
                               const CapyPDF_DocumentMetadata *md,
                               CapyPDF_Generator **out_ptr) CAPYPDF_NOEXCEPT {
@@ -276,9 +420,11 @@ CAPYPDF_PUBLIC CapyPDF_EC capy_generator_embed_file(
 
 CAPYPDF_PUBLIC CapyPDF_EC capy_generator_load_font(CapyPDF_Generator *gen,
                                                    const char *fname,
+                                                   const CapyPDF_FontProperties *fprops,
                                                    CapyPDF_FontId *out_ptr) CAPYPDF_NOEXCEPT {
     auto *g = reinterpret_cast<PdfGen *>(gen);
-    auto rc = g->load_font(fname);
+    auto *props = reinterpret_cast<const FontProperties *>(fprops);
+    auto rc = g->load_font(fname, props ? *props : FontProperties{});
     if(rc) {
         *out_ptr = rc.value();
     }
@@ -511,6 +657,22 @@ CapyPDF_EC capy_generator_write(CapyPDF_Generator *gen) CAPYPDF_NOEXCEPT {
     return conv_err(rc);
 }
 
+CAPYPDF_PUBLIC CapyPDF_EC capy_generator_write_to_callback(CapyPDF_Generator *gen,
+                                                           CapyPDF_Write_Callback cb,
+                                                           void *user_data) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(cb);
+    auto *g = reinterpret_cast<PdfGen *>(gen);
+    auto rc = g->write_to_callback(cb, user_data);
+    return conv_err(rc);
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_generator_get_stats(CapyPDF_Generator *gen,
+                                                   CapyPDF_WriteStats **out_ptr) CAPYPDF_NOEXCEPT {
+    auto *g = reinterpret_cast<PdfGen *>(gen);
+    *out_ptr = reinterpret_cast<CapyPDF_WriteStats *>(new WriteStats{g->write_stats()});
+    RETNOERR;
+}
+
 CAPYPDF_PUBLIC CapyPDF_EC capy_generator_add_optional_content_group(
     CapyPDF_Generator *gen,
     const CapyPDF_OptionalContentGroup *ocg,
@@ -586,6 +748,35 @@ CAPYPDF_PUBLIC CapyPDF_EC capy_generator_text_width(CapyPDF_Generator *gen,
     return conv_err(rc);
 }
 
+CAPYPDF_PUBLIC CapyPDF_EC capy_generator_text_widths(CapyPDF_Generator *gen,
+                                                     const char *const *utf8_texts,
+                                                     int32_t num_texts,
+                                                     CapyPDF_FontId font,
+                                                     double pointsize,
+                                                     double *widths) CAPYPDF_NOEXCEPT {
+    if(num_texts < 0) {
+        return conv_err(ErrorCode::IndexIsNegative);
+    }
+    if(num_texts > 0) {
+        CHECK_NULL(utf8_texts);
+        CHECK_NULL(widths);
+    }
+    auto *g = reinterpret_cast<PdfGen *>(gen);
+    for(int32_t i = 0; i < num_texts; ++i) {
+        CHECK_NULL(utf8_texts[i]);
+        auto u8t = u8string::from_cstr(utf8_texts[i]);
+        if(!u8t) {
+            return conv_err(u8t);
+        }
+        auto rc = g->utf8_text_width(u8t.value(), font, pointsize);
+        if(!rc) {
+            return conv_err(rc);
+        }
+        widths[i] = rc.value();
+    }
+    RETNOERR;
+}
+
 // Draw Context
 
 CapyPDF_EC capy_page_draw_context_new(CapyPDF_Generator *gen,
@@ -595,6 +786,13 @@ CapyPDF_EC capy_page_draw_context_new(CapyPDF_Generator *gen,
     RETNOERR;
 }
 
+CAPYPDF_PUBLIC CapyPDF_EC capy_generator_recycle_draw_context(
+    CapyPDF_Generator *gen, CapyPDF_DrawContext *ctx) CAPYPDF_NOEXCEPT {
+    auto *g = reinterpret_cast<PdfGen *>(gen);
+    auto *dc = reinterpret_cast<PdfDrawContext *>(ctx);
+    return conv_err(g->recycle_draw_context(dc));
+}
+
 CAPYPDF_PUBLIC CapyPDF_EC capy_dc_cmd_b(CapyPDF_DrawContext *ctx) CAPYPDF_NOEXCEPT {
     auto dc = reinterpret_cast<PdfDrawContext *>(ctx);
     return conv_err(dc->cmd_b());
@@ -760,6 +958,41 @@ CAPYPDF_PUBLIC CapyPDF_EC capy_dc_cmd_n(CapyPDF_DrawContext *ctx) CAPYPDF_NOEXCE
     return conv_err(c->cmd_n());
 }
 
+CAPYPDF_PUBLIC CapyPDF_EC capy_dc_cmd_path(CapyPDF_DrawContext *ctx,
+                                           const uint8_t *ops,
+                                           int32_t num_ops,
+                                           const double *coords,
+                                           int32_t num_coords) CAPYPDF_NOEXCEPT {
+    if(num_ops < 0 || num_coords < 0) {
+        return conv_err(ErrorCode::IndexIsNegative);
+    }
+    if(num_ops > 0) {
+        CHECK_NULL(ops);
+    }
+    if(num_coords > 0) {
+        CHECK_NULL(coords);
+    }
+    auto c = reinterpret_cast<PdfDrawContext *>(ctx);
+    return conv_err(c->cmd_path(std::span<const uint8_t>(ops, num_ops),
+                                std::span<const double>(coords, num_coords)));
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_dc_execute(CapyPDF_DrawContext *ctx,
+                                          const uint8_t *commands,
+                                          int32_t size,
+                                          int32_t *failed_command) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(failed_command);
+    *failed_command = -1;
+    if(size < 0) {
+        return conv_err(ErrorCode::IndexIsNegative);
+    }
+    if(size > 0) {
+        CHECK_NULL(commands);
+    }
+    auto c = reinterpret_cast<PdfDrawContext *>(ctx);
+    return conv_err(c->execute(std::span<const uint8_t>(commands, size), *failed_command));
+}
+
 CAPYPDF_PUBLIC CapyPDF_EC capy_dc_cmd_q(CapyPDF_DrawContext *ctx) CAPYPDF_NOEXCEPT {
     auto c = reinterpret_cast<PdfDrawContext *>(ctx);
     return conv_err(c->cmd_q());
@@ -1770,6 +2003,28 @@ CAPYPDF_PUBLIC CapyPDF_EC capy_image_pdf_properties_destroy(CapyPDF_ImagePdfProp
     RETNOERR;
 }
 
+CAPYPDF_PUBLIC CapyPDF_EC capy_font_properties_new(CapyPDF_FontProperties **out_ptr)
+    CAPYPDF_NOEXCEPT {
+    *out_ptr = reinterpret_cast<CapyPDF_FontProperties *>(new FontProperties());
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_font_properties_set_encoding(
+    CapyPDF_FontProperties *fprops, CapyPDF_Font_Encoding encoding) CAPYPDF_NOEXCEPT {
+    if((int)encoding < 0 || (int)encoding > (int)CAPY_FONT_ENCODING_IDENTITY_H) {
+        return conv_err(ErrorCode::BadEnum);
+    }
+    auto p = reinterpret_cast<FontProperties *>(fprops);
+    p->encoding = encoding;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_font_properties_destroy(CapyPDF_FontProperties *fprops)
+    CAPYPDF_NOEXCEPT {
+    delete reinterpret_cast<FontProperties *>(fprops);
+    RETNOERR;
+}
+
 // Destination
 
 CAPYPDF_PUBLIC CapyPDF_EC capy_destination_new(CapyPDF_Destination **out_ptr) CAPYPDF_NOEXCEPT {
@@ -1869,6 +2124,82 @@ CAPYPDF_PUBLIC CapyPDF_EC capy_outline_destroy(CapyPDF_Outline *outline) CAPYPDF
     RETNOERR;
 }
 
+// Write statistics
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_write_stats_get_stream_count(const CapyPDF_WriteStats *stats,
+                                                            CapyPDF_Stream_Class sclass,
+                                                            CapyPDF_Stream_Encoding encoding,
+                                                            int32_t *out_ptr) CAPYPDF_NOEXCEPT {
+    if((int)sclass < 0 || (int)sclass > (int)CAPY_STREAM_CLASS_OTHER) {
+        return conv_err(ErrorCode::BadEnum);
+    }
+    if((int)encoding < 0 || (int)encoding > (int)CAPY_STREAM_ENCODING_PNG_PREDICTOR) {
+        return conv_err(ErrorCode::BadEnum);
+    }
+    auto *s = reinterpret_cast<const WriteStats *>(stats);
+    *out_ptr = s->stream_counts[sclass][encoding];
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_write_stats_get_stream_bytes(const CapyPDF_WriteStats *stats,
+                                                            CapyPDF_Stream_Class sclass,
+                                                            int64_t *raw_bytes,
+                                                            int64_t *encoded_bytes)
+    CAPYPDF_NOEXCEPT {
+    if((int)sclass < 0 || (int)sclass > (int)CAPY_STREAM_CLASS_OTHER) {
+        return conv_err(ErrorCode::BadEnum);
+    }
+    auto *s = reinterpret_cast<const WriteStats *>(stats);
+    *raw_bytes = s->raw_bytes[sclass];
+    *encoded_bytes = s->encoded_bytes[sclass];
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_write_stats_get_phase_time(const CapyPDF_WriteStats *stats,
+                                                          CapyPDF_Write_Phase phase,
+                                                          int64_t *wall_ns,
+                                                          int64_t *cpu_ns) CAPYPDF_NOEXCEPT {
+    if((int)phase < 0 || (int)phase > (int)CAPY_WRITE_PHASE_OUTPUT) {
+        return conv_err(ErrorCode::BadEnum);
+    }
+    auto *s = reinterpret_cast<const WriteStats *>(stats);
+    *wall_ns = s->phases[phase].wall_ns;
+    *cpu_ns = s->phases[phase].cpu_ns;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_write_stats_get_object_count(const CapyPDF_WriteStats *stats,
+                                                            CapyPDF_Object_Kind kind,
+                                                            int32_t *count,
+                                                            int64_t *bytes) CAPYPDF_NOEXCEPT {
+    if((int)kind < 0 || (int)kind > (int)CAPY_OBJECT_KIND_WRITTEN) {
+        return conv_err(ErrorCode::BadEnum);
+    }
+    auto *s = reinterpret_cast<const WriteStats *>(stats);
+    *count = s->object_counts[kind];
+    *bytes = s->object_bytes[kind];
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_write_stats_get_peak_buffered_bytes(
+    const CapyPDF_WriteStats *stats, int64_t *out_ptr) CAPYPDF_NOEXCEPT {
+    auto *s = reinterpret_cast<const WriteStats *>(stats);
+    *out_ptr = s->peak_buffered_bytes;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_write_stats_get_removed_operators(
+    const CapyPDF_WriteStats *stats, int64_t *out_ptr) CAPYPDF_NOEXCEPT {
+    auto *s = reinterpret_cast<const WriteStats *>(stats);
+    *out_ptr = s->removed_operators;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CapyPDF_EC capy_write_stats_destroy(CapyPDF_WriteStats *stats) CAPYPDF_NOEXCEPT {
+    delete reinterpret_cast<WriteStats *>(stats);
+    RETNOERR;
+}
+
 // Error handling.
 
 const char *capy_error_message(CapyPDF_EC error_code) CAPYPDF_NOEXCEPT {
@@ -0,0 +1,416 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Jussi Pakkanen
+
+#include <displaylist.hpp>
+#include <utils.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstring>
+#include <format>
+#include <optional>
+
+namespace capypdf::internal {
+
+namespace {
+
+struct DLOpInfo {
+    const char *name;
+    uint8_t num_operands;
+};
+
+// Must be in the same order as DLOp.
+const std::array<DLOpInfo, (size_t)DLOp::Raw> op_infos{{
+    {"b", 0},
+    {"B", 0},
+    {"b*", 0},
+    {"B*", 0},
+    {"c", 6},
+    {"cm", 6},
+    {"f", 0},
+    {"f*", 0},
+    {"G", 1},
+    {"g", 1},
+    {"gs", 1},
+    {"h", 0},
+    {"i", 1},
+    {"j", 1},
+    {"J", 1},
+    {"K", 4},
+    {"k", 4},
+    {"l", 2},
+    {"m", 2},
+    {"M", 1},
+    {"n", 0},
+    {"q", 0},
+    {"Q", 0},
+    {"re", 4},
+    {"RG", 3},
+    {"rg", 3},
+    {"s", 0},
+    {"S", 0},
+    {"SCN", 1},
+    {"scn", 1},
+    {"v", 4},
+    {"w", 1},
+    {"W", 0},
+    {"W*", 0},
+    {"y", 4},
+}};
+
+const size_t max_operands = 6;
+
+// Graphics state parameters that operators in a display list can set.
+// An empty value means unknown.
+struct TrackedState {
+    std::optional<std::pair<DLOp, std::array<double, max_operands>>> stroke_color;
+    std::optional<std::pair<DLOp, std::array<double, max_operands>>> nonstroke_color;
+    std::array<std::optional<double>, 5> params; // w, M, j, J, i
+    // The graphics state dictionary set last. It is only known while
+    // none of the parameters it may contain have been set after it.
+    std::optional<double> gstate;
+};
+
+bool is_color_op(DLOp op, bool &stroke) {
+    switch(op) {
+    case DLOp::G:
+    case DLOp::K:
+    case DLOp::RG:
+    case DLOp::SCN:
+        stroke = true;
+        return true;
+    case DLOp::g:
+    case DLOp::k:
+    case DLOp::rg:
+    case DLOp::scn:
+        stroke = false;
+        return true;
+    default:
+        return false;
+    }
+}
+
+int param_index(DLOp op) {
+    switch(op) {
+    case DLOp::w:
+        return 0;
+    case DLOp::M:
+        return 1;
+    case DLOp::j:
+        return 2;
+    case DLOp::J:
+        return 3;
+    case DLOp::i:
+        return 4;
+    default:
+        return -1;
+    }
+}
+
+bool is_path_construction(DLOp op) {
+    switch(op) {
+    case DLOp::m:
+    case DLOp::l:
+    case DLOp::c:
+    case DLOp::v:
+    case DLOp::y:
+    case DLOp::re:
+    case DLOp::h:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool is_path_painting(DLOp op) {
+    switch(op) {
+    case DLOp::b:
+    case DLOp::B:
+    case DLOp::bstar:
+    case DLOp::Bstar:
+    case DLOp::f:
+    case DLOp::fstar:
+    case DLOp::n:
+    case DLOp::s:
+    case DLOp::S:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Painting a path that has only move operators draws nothing, unless the
+// operator closes it, which turns it into a single point closed path.
+bool paints_lone_points(DLOp op) {
+    return op == DLOp::b || op == DLOp::bstar || op == DLOp::s;
+}
+
+bool is_identity(const std::array<double, max_operands> &m) {
+    return m[0] == 1 && m[1] == 0 && m[2] == 0 && m[3] == 1 && m[4] == 0 && m[5] == 0;
+}
+
+// The matrix equal to applying first and then second with cm.
+std::array<double, max_operands> concatenate(const std::array<double, max_operands> &first,
+                                             const std::array<double, max_operands> &second) {
+    const auto &a = second;
+    const auto &b = first;
+    return {a[0] * b[0] + a[1] * b[2],
+            a[0] * b[1] + a[1] * b[3],
+            a[2] * b[0] + a[3] * b[2],
+            a[2] * b[1] + a[3] * b[3],
+            a[4] * b[0] + a[5] * b[2] + b[4],
+            a[4] * b[1] + a[5] * b[3] + b[5]};
+}
+
+template<typename T> void append_value(std::string &data, T value) {
+    data.append((const char *)&value, sizeof(T));
+}
+
+template<typename T> T read_value(const char *&p) {
+    T value;
+    memcpy(&value, p, sizeof(T));
+    p += sizeof(T);
+    return value;
+}
+
+} // namespace
+
+void serialize_op(std::string &out,
+                  std::string_view indent,
+                  DLOp op,
+                  std::span<const double> operands,
+                  int32_t precision) {
+    const auto &info = op_infos.at((size_t)op);
+    assert(operands.size() == info.num_operands);
+    auto app = std::back_inserter(out);
+    out += indent;
+    if(op == DLOp::gs) {
+        std::format_to(app, "/GS{} gs\n", (int32_t)operands[0]);
+        return;
+    }
+    for(const auto &operand : operands) {
+        std::format_to(app, "{} ", PdfNumber{operand, precision});
+    }
+    out += info.name;
+    out += '\n';
+}
+
+void DisplayList::add(DLOp op, uint16_t indent, std::span<const double> operands) {
+    assert(operands.size() == op_infos.at((size_t)op).num_operands);
+    append_value(data, op);
+    append_value(data, indent);
+    for(const auto &operand : operands) {
+        append_value(data, operand);
+    }
+    ++record_count;
+}
+
+void DisplayList::add_raw(std::string_view text) {
+    append_value(data, DLOp::Raw);
+    append_value(data, (uint32_t)text.size());
+    data += text;
+    ++record_count;
+}
+
+void DisplayList::clear() {
+    data.clear();
+    record_count = 0;
+}
+
+std::vector<DisplayList::Record> DisplayList::decode() const {
+    std::vector<Record> records;
+    records.reserve(record_count);
+    const char *p = data.data();
+    const char *end = data.data() + data.size();
+    while(p < end) {
+        Record r{};
+        r.op = read_value<DLOp>(p);
+        if(r.op == DLOp::Raw) {
+            r.raw_size = read_value<uint32_t>(p);
+            r.raw_offset = (uint32_t)(p - data.data());
+            p += r.raw_size;
+        } else {
+            r.indent = read_value<uint16_t>(p);
+            for(size_t i = 0; i < op_infos.at((size_t)r.op).num_operands; ++i) {
+                r.operands[i] = read_value<double>(p);
+            }
+        }
+        records.push_back(r);
+    }
+    return records;
+}
+
+void DisplayList::encode(const std::vector<Record> &records) {
+    std::string encoded;
+    encoded.reserve(data.size());
+    for(const auto &r : records) {
+        append_value(encoded, r.op);
+        if(r.op == DLOp::Raw) {
+            append_value(encoded, r.raw_size);
+            encoded.append(data, r.raw_offset, r.raw_size);
+        } else {
+            append_value(encoded, r.indent);
+            for(size_t i = 0; i < op_infos.at((size_t)r.op).num_operands; ++i) {
+                append_value(encoded, r.operands[i]);
+            }
+        }
+    }
+    data = std::move(encoded);
+    record_count = (int32_t)records.size();
+}
+
+int32_t DisplayList::optimize() {
+    const auto records = decode();
+    std::vector<Record> out;
+    out.reserve(records.size());
+    TrackedState state;
+    std::vector<TrackedState> saved_states;
+    // Indexes of the unclosed q operators in out.
+    std::vector<size_t> open_saves;
+    // The path being constructed, if there is one.
+    std::optional<size_t> path_start;
+    bool path_has_segments = false;
+    bool path_clips = false;
+    int32_t removed = 0;
+
+    for(const auto &r : records) {
+        bool stroke;
+        if(r.op == DLOp::Raw) {
+            // Raw text may change any of the state, but it always
+            // has as many Q operators as q operators.
+            state = TrackedState{};
+            path_start.reset();
+            out.push_back(r);
+        } else if(r.op == DLOp::q) {
+            path_start.reset();
+            saved_states.push_back(state);
+            open_saves.push_back(out.size());
+            out.push_back(r);
+        } else if(r.op == DLOp::Q) {
+            path_start.reset();
+            if(saved_states.empty()) {
+                state = TrackedState{};
+                out.push_back(r);
+                continue;
+            }
+            state = std::move(saved_states.back());
+            saved_states.pop_back();
+            const size_t save_index = open_saves.back();
+            open_saves.pop_back();
+            const bool only_state =
+                std::all_of(out.begin() + save_index + 1, out.end(), [](const Record &inner) {
+                    bool unused;
+                    return inner.op == DLOp::cm || inner.op == DLOp::gs ||
+                           is_color_op(inner.op, unused) || param_index(inner.op) >= 0;
+                });
+            if(only_state) {
+                // The pair and everything in it have no effect.
+                removed += (int32_t)(out.size() - save_index) + 1;
+                out.resize(save_index);
+            } else {
+                out.push_back(r);
+            }
+        } else if(is_color_op(r.op, stroke)) {
+            auto &current = stroke ? state.stroke_color : state.nonstroke_color;
+            if(current && current->first == r.op && current->second == r.operands) {
+                ++removed;
+            } else {
+                current.emplace(r.op, r.operands);
+                out.push_back(r);
+            }
+        } else if(const int index = param_index(r.op); index >= 0) {
+            auto &current = state.params[index];
+            if(current && *current == r.operands[0]) {
+                ++removed;
+            } else {
+                current = r.operands[0];
+                state.gstate.reset();
+                out.push_back(r);
+            }
+        } else if(r.op == DLOp::gs) {
+            if(state.gstate == r.operands[0]) {
+                ++removed;
+            } else {
+                // The dictionary may set any of the parameters.
+                state.params = {};
+                state.gstate = r.operands[0];
+                out.push_back(r);
+            }
+        } else if(r.op == DLOp::cm) {
+            if(is_identity(r.operands)) {
+                ++removed;
+            } else if(!out.empty() && out.back().op == DLOp::cm) {
+                out.back().operands = concatenate(out.back().operands, r.operands);
+                ++removed;
+                if(is_identity(out.back().operands)) {
+                    out.pop_back();
+                    ++removed;
+                }
+            } else {
+                out.push_back(r);
+            }
+        } else if(is_path_construction(r.op)) {
+            if(!path_start) {
+                path_start = out.size();
+                path_has_segments = false;
+                path_clips = false;
+            }
+            if(r.op != DLOp::m) {
+                path_has_segments = true;
+            }
+            out.push_back(r);
+        } else if(r.op == DLOp::W || r.op == DLOp::Wstar) {
+            path_clips = true;
+            out.push_back(r);
+        } else if(is_path_painting(r.op)) {
+            const bool invisible =
+                path_start && !path_clips &&
+                (r.op == DLOp::n || (!path_has_segments && !paints_lone_points(r.op)));
+            if(invisible) {
+                removed += (int32_t)(out.size() - *path_start) + 1;
+                out.resize(*path_start);
+            } else {
+                out.push_back(r);
+            }
+            path_start.reset();
+        } else {
+            out.push_back(r);
+        }
+    }
+    if(removed > 0) {
+        encode(out);
+    }
+    return removed;
+}
+
+void DisplayList::serialize(std::string &out, int32_t precision) const {
+    std::string spaces;
+    std::array<double, max_operands> operands;
+    const char *p = data.data();
+    const char *end = data.data() + data.size();
+    while(p < end) {
+        const auto op = read_value<DLOp>(p);
+        if(op == DLOp::Raw) {
+            const auto size = read_value<uint32_t>(p);
+            out.append(p, size);
+            p += size;
+            continue;
+        }
+        const auto indent = read_value<uint16_t>(p);
+        if(spaces.size() < indent) {
+            spaces.resize(indent, ' ');
+        }
+        const auto num_operands = op_infos.at((size_t)op).num_operands;
+        for(size_t i = 0; i < num_operands; ++i) {
+            operands[i] = read_value<double>(p);
+        }
+        serialize_op(out,
+                     std::string_view{spaces}.substr(0, indent),
+                     op,
+                     std::span<const double>{operands.data(), num_operands},
+                     precision);
+    }
+}
+
+} // namespace capypdf::internal
@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Jussi Pakkanen
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace capypdf::internal {
+
+// Content stream operators that can be stored in a display list.
+// All of their operands are numbers. The operand of gs is the number
+// of the graphics state, which is written as its resource name.
+enum class DLOp : uint8_t {
+    b,
+    B,
+    bstar,
+    Bstar,
+    c,
+    cm,
+    f,
+    fstar,
+    G,
+    g,
+    gs,
+    h,
+    i,
+    j,
+    J,
+    K,
+    k,
+    l,
+    m,
+    M,
+    n,
+    q,
+    Q,
+    re,
+    RG,
+    rg,
+    s,
+    S,
+    SCN,
+    scn,
+    v,
+    w,
+    W,
+    Wstar,
+    y,
+    // Content stream text that was formatted when it was added.
+    Raw,
+};
+
+// Writes one operator with its operands as PDF syntax.
+void serialize_op(std::string &out,
+                  std::string_view indent,
+                  DLOp op,
+                  std::span<const double> operands,
+                  int32_t precision);
+
+// A recorded content stream. Records are stored back to back in one
+// buffer. Each one has the operator, the indentation width and either
+// the operands or, for raw text, its length followed by the text.
+class DisplayList {
+public:
+    void add(DLOp op, uint16_t indent, std::span<const double> operands);
+    void add_raw(std::string_view text);
+
+    bool empty() const { return data.empty(); }
+    int32_t num_records() const { return record_count; }
+    size_t byte_size() const { return data.size(); }
+    // Keeps the allocated buffer.
+    void clear();
+
+    // Appends the list as PDF syntax.
+    void serialize(std::string &out, int32_t precision) const;
+
+    // Removes operators that do not change the rendered output: state
+    // changes to the current value, repeated graphics state dictionaries,
+    // identity and consecutive matrices, save/restore pairs with only
+    // state changes inside them and paths that are never painted.
+    // Returns the number of removed operators.
+    int32_t optimize();
+
+private:
+    struct Record {
+        DLOp op;
+        uint16_t indent;
+        std::array<double, 6> operands;
+        // Location of the text of raw records in data.
+        uint32_t raw_offset;
+        uint32_t raw_size;
+    };
+
+    std::vector<Record> decode() const;
+    void encode(const std::vector<Record> &records);
+
+    std::string data;
+    int32_t record_count = 0;
+};
+
+} // namespace capypdf::internal
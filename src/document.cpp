@@ -16,6 +16,8 @@
 #include FT_FREETYPE_H
 #include FT_FONT_FORMATS_H
 #include FT_OPENTYPE_VALIDATE_H
+#include FT_TRUETYPE_TABLES_H
+#include FT_TRUETYPE_TAGS_H
 
 namespace capypdf::internal {
 
@@ -68,6 +70,51 @@ FT_Error guarded_face_close(FT_Face face) {
     return 0;
 }
 
+// Reads the pairs of a version 0 kern table, combining subtables the same way as FreeType.
+void preload_kerning(FontThingy &font) {
+    FT_Face face = font.fontdata.face.get();
+    FT_ULong length = 0;
+    if(FT_Load_Sfnt_Table(face, TTAG_kern, 0, nullptr, &length) != 0) {
+        return;
+    }
+    std::string table(length, '\0');
+    if(FT_Load_Sfnt_Table(face, TTAG_kern, 0, (FT_Byte *)table.data(), &length) != 0) {
+        return;
+    }
+    auto u16 = [&table](size_t offset) -> uint32_t {
+        return (uint32_t((uint8_t)table[offset]) << 8) | uint8_t(table[offset + 1]);
+    };
+    // Apple's version 1 tables are looked up lazily.
+    if(length < 4 || u16(0) != 0) {
+        return;
+    }
+    const uint32_t num_tables = u16(2);
+    size_t offset = 4;
+    for(uint32_t i = 0; i < num_tables && offset + 14 <= length; ++i) {
+        const uint32_t subtable_length = u16(offset + 2);
+        const uint32_t coverage = u16(offset + 4);
+        // Format 0 with horizontal kerning. Bit 3 means override instead of add.
+        if((coverage & ~8u) == 0x0001) {
+            const uint32_t num_pairs = u16(offset + 6);
+            size_t p = offset + 14;
+            for(uint32_t j = 0; j < num_pairs && p + 6 <= length; ++j, p += 6) {
+                const auto key = kerning_key(u16(p), u16(p + 2));
+                const int32_t value = (int16_t)u16(p + 4);
+                if(coverage & 8) {
+                    font.kerning_cache[key] = value;
+                } else {
+                    font.kerning_cache[key] += value;
+                }
+            }
+        }
+        if(subtable_length == 0) {
+            return;
+        }
+        offset += subtable_length;
+    }
+    font.kerning_complete = true;
+}
+
 const std::array<const char *, 14> font_names{
     "Times-Roman",
     "Helvetica",
@@ -235,6 +282,31 @@ void color2numbers(std::back_insert_iterator<std::string> &app, const Color &c)
     }
 }
 
+std::string filespec_dict(std::string_view quoted_name, int32_t fileobj_id) {
+    return std::format(R"(<<
+  /Type /Filespec
+  /F {}
+  /EF << /F {} 0 R >>
+>>
+)",
+                       quoted_name,
+                       fileobj_id);
+}
+
+// Object streams were added in PDF 1.5, these are based on older versions.
+bool permits_object_streams(
+    const std::variant<std::monostate, CapyPDF_PDFX_Type, CapyPDF_PDFA_Type> &subtype) {
+    if(auto xptr = std::get_if<CapyPDF_PDFX_Type>(&subtype)) {
+        return *xptr != CAPY_PDFX_1_2001 && *xptr != CAPY_PDFX_1A_2001 &&
+               *xptr != CAPY_PDFX_1A_2003 && *xptr != CAPY_PDFX_3_2002 &&
+               *xptr != CAPY_PDFX_3_2003;
+    }
+    if(auto aptr = std::get_if<CapyPDF_PDFA_Type>(&subtype)) {
+        return *aptr != CAPY_PDFA_1a && *aptr != CAPY_PDFA_1b;
+    }
+    return true;
+}
+
 } // namespace
 
 const std::array<const char *, 4> rendering_intent_names{
@@ -254,6 +326,9 @@ PdfDocument::PdfDocument(const DocumentMetadata &d, PdfColorConverter cm)
     : opts{d}, cm{std::move(cm)} {}
 
 rvoe<NoReturnValue> PdfDocument::init() {
+    if(opts.object_streams && !permits_object_streams(opts.subtype)) {
+        RETERR(BadOperationForIntent);
+    }
     // PDF uses 1-based indexing so add a dummy thing in this vector
     // to make PDF and vector indices are the same.
     document_objects.emplace_back(DummyIndexZero{});
@@ -297,12 +372,13 @@ rvoe<NoReturnValue> PdfDocument::init() {
     return NoReturnValue{};
 }
 
-rvoe<NoReturnValue> PdfDocument::add_page(std::string resource_dict,
+rvoe<NoReturnValue> PdfDocument::add_page(const ResourceUsage &resources,
                                           std::string unclosed_object_dict,
+                                          std::vector<ContentChunk> content_chunks,
                                           std::string command_stream,
                                           const PageProperties &custom_props,
-                                          const std::unordered_set<CapyPDF_FormWidgetId> &fws,
-                                          const std::unordered_set<CapyPDF_AnnotationId> &annots,
+                                          const FlatSet<CapyPDF_FormWidgetId> &fws,
+                                          const FlatSet<CapyPDF_AnnotationId> &annots,
                                           const std::vector<CapyPDF_StructureItemId> &structs,
                                           const std::optional<Transition> &transition,
                                           const std::vector<SubPageNavigation> &subnav) {
@@ -321,17 +397,43 @@ rvoe<NoReturnValue> PdfDocument::add_page(std::string resource_dict,
             RETERR(StructureReuse);
         }
     }
-    const auto resource_num = add_object(FullPDFObject{std::move(resource_dict), {}});
-    int32_t commands_num{-1};
-    if(opts.compress_streams) {
-        commands_num = add_object(
-            DeflatePDFObject{std::move(unclosed_object_dict), std::move(command_stream)});
+    if(opts.merge_resources && !merged_resources_object) {
+        // Filled in when all pages are known, so it does not belong to any page.
+        merged_resources_object = add_object(FullPDFObject{});
+    }
+    const auto first_num = (int32_t)document_objects.size();
+    int32_t resource_num;
+    if(opts.merge_resources) {
+        merged_resources.merge(resources);
+        resource_num = *merged_resources_object;
     } else {
-        std::format_to(std::back_inserter(unclosed_object_dict),
-                       "  /Length {}\n>>\n",
-                       command_stream.length());
-        commands_num =
-            add_object(FullPDFObject{std::move(unclosed_object_dict), std::move(command_stream)});
+        auto resource_dict = build_resource_dict(resources);
+        if(auto it = resource_dicts.find(resource_dict); it != resource_dicts.end()) {
+            resource_num = it->second;
+        } else {
+            resource_num = add_object(FullPDFObject{resource_dict, {}});
+            resource_dicts.emplace(std::move(resource_dict), resource_num);
+        }
+    }
+    for(auto &chunk : content_chunks) {
+        add_object(DeflatePDFObject{"<<\n",
+                                    std::move(chunk.data),
+                                    CAPY_STREAM_CLASS_CONTENT,
+                                    {},
+                                    chunk.uncompressed_size});
+    }
+    int32_t commands_num;
+    if(content_chunks.empty()) {
+        commands_num = add_object(DeflatePDFObject{
+            std::move(unclosed_object_dict), std::move(command_stream), CAPY_STREAM_CLASS_CONTENT});
+    } else {
+        // The last part is encoded like the chunks before it.
+        ERC(compressed, flate_compress(command_stream, opts.compression.content_chunk_settings()));
+        commands_num = add_object(DeflatePDFObject{std::move(unclosed_object_dict),
+                                                   std::move(compressed),
+                                                   CAPY_STREAM_CLASS_CONTENT,
+                                                   {},
+                                                   command_stream.size()});
     }
     DelayedPage p;
     p.page_num = (int32_t)pages.size();
@@ -361,14 +463,111 @@ rvoe<NoReturnValue> PdfDocument::add_page(std::string resource_dict,
     for(const auto &s : structs) {
         structure_use[s] = StructureUsage{(int32_t)pages.size(), mcid_num++};
     }
-    pages.emplace_back(PageOffsets{resource_num, commands_num, page_object_num});
+    pages.emplace_back(PageOffsets{first_num,
+                                   resource_num,
+                                   commands_num,
+                                   page_object_num,
+                                   (int32_t)content_chunks.size()});
     return NoReturnValue{};
 }
 
-void PdfDocument::add_form_xobject(std::string xobj_dict, std::string xobj_stream) {
+std::string PdfDocument::build_resource_dict(const ResourceUsage &used) {
+    std::string resources;
+    auto resource_appender = std::back_inserter(resources);
+    resources = "<<\n";
+    if(!used.images.empty() || !used.form_xobjects.empty() || !used.trgroups.empty()) {
+        resources += "  /XObject <<\n";
+        if(!used.images.empty()) {
+            for(const auto &i : used.images) {
+                std::format_to(resource_appender, "    /Image{} {} 0 R\n", i, i);
+            }
+        }
+        if(!used.form_xobjects.empty()) {
+            for(const auto &fx : used.form_xobjects) {
+                std::format_to(resource_appender, "    /FXO{} {} 0 R\n", fx, fx);
+            }
+        }
+        if(!used.trgroups.empty()) {
+            for(const auto &tg : used.trgroups) {
+                auto objnum = transparency_groups.at(tg.id);
+                std::format_to(resource_appender, "    /TG{} {} 0 R\n", objnum, objnum);
+            }
+        }
+        resources += "  >>\n";
+    }
+    if(!used.fonts.empty() || !used.subset_fonts.empty()) {
+        resources += "  /Font <<\n";
+        for(const auto &i : used.fonts) {
+            std::format_to(resource_appender, "    /Font{} {} 0 R\n", i, i);
+        }
+        for(const auto &i : used.subset_fonts) {
+            const auto &bob = get(i.fid);
+            std::format_to(resource_appender,
+                           "    /SFont{}-{} {} 0 R\n",
+                           bob.font_obj,
+                           i.subset_id,
+                           bob.font_obj);
+        }
+        resources += "  >>\n";
+    }
+    if(!used.colorspaces.empty() || used.all_colorspace) {
+        resources += "  /ColorSpace <<\n";
+        if(used.all_colorspace) {
+            std::format_to(resource_appender, "    /All {} 0 R\n", separation_objects.at(0));
+        }
+        for(const auto &i : used.colorspaces) {
+            std::format_to(resource_appender, "    /CSpace{} {} 0 R\n", i, i);
+        }
+        resources += "  >>\n";
+    }
+    if(!used.gstates.empty()) {
+        resources += "  /ExtGState <<\n";
+        for(const auto &s : used.gstates) {
+            std::format_to(resource_appender, "    /GS{} {} 0 R \n", s, s);
+        }
+        resources += "  >>\n";
+    }
+    if(!used.shadings.empty()) {
+        resources += "  /Shading <<\n";
+        for(const auto &s : used.shadings) {
+            std::format_to(resource_appender, "    /SH{} {} 0 R\n", s, s);
+        }
+        resources += "  >>\n";
+    }
+    if(!used.patterns.empty()) {
+        resources += "  /Pattern <<\n";
+        for(const auto &s : used.patterns) {
+            std::format_to(resource_appender, "    /Pattern-{} {} 0 R\n", s, s);
+        }
+        resources += "  >>\n";
+    }
+    if(!used.ocgs.empty()) {
+        resources += "  /Properties <<\n";
+        for(const auto &ocg : used.ocgs) {
+            auto objnum = ocg_object_number(ocg);
+            std::format_to(resource_appender, "    /oc{} {} 0 R\n", objnum, objnum);
+        }
+        resources += "  >>\n";
+    }
+    resources += ">>\n";
+    return resources;
+}
+
+CapyPDF_FormXObjectId PdfDocument::add_form_xobject(std::string xobj_dict,
+                                                    std::string xobj_stream) {
+    const auto key = hash_content(xobj_stream, hash_content(xobj_dict));
+    if(auto it = form_xobject_hashes.find(key); it != form_xobject_hashes.end()) {
+        const auto stored = object_contents(form_xobjects.at(it->second.id).xobj_num);
+        if(stored && stored->first == xobj_dict && stored->second == xobj_stream) {
+            return it->second;
+        }
+    }
     const auto xobj_num = add_object(FullPDFObject{std::move(xobj_dict), std::move(xobj_stream)});
 
     form_xobjects.emplace_back(FormXObjectInfo{xobj_num});
+    const CapyPDF_FormXObjectId fxoid{(int32_t)form_xobjects.size() - 1};
+    form_xobject_hashes[key] = fxoid;
+    return fxoid;
 }
 
 int32_t PdfDocument::create_subnavigation(const std::vector<SubPageNavigation> &subnav) {
@@ -602,6 +801,10 @@ rvoe<CapyPDF_RoleId> PdfDocument::add_rolemap_entry(std::string name,
 }
 
 rvoe<NoReturnValue> PdfDocument::create_catalog() {
+    if(merged_resources_object) {
+        document_objects.at(*merged_resources_object) =
+            FullPDFObject{build_resource_dict(merged_resources), {}};
+    }
     std::string buf;
     auto app = std::back_inserter(buf);
     std::string outline;
@@ -883,12 +1086,11 @@ int32_t PdfDocument::add_pdfa_metadata_object(CapyPDF_PDFA_Type atype) {
 }
 
 std::optional<CapyPDF_IccColorSpaceId> PdfDocument::find_icc_profile(std::string_view contents) {
-    for(size_t i = 0; i < icc_profiles.size(); ++i) {
-        const auto &stream_obj = document_objects.at(icc_profiles.at(i).stream_num);
-        assert(std::holds_alternative<DeflatePDFObject>(stream_obj));
-        const auto &stream_data = std::get<DeflatePDFObject>(stream_obj);
-        if(stream_data.stream == contents) {
-            return CapyPDF_IccColorSpaceId{(int32_t)i};
+    auto it = icc_hashes.find(hash_content(contents));
+    if(it != icc_hashes.end()) {
+        const auto stored = object_contents(get(it->second).stream_num);
+        if(stored && stored->second == contents) {
+            return it->second;
         }
     }
     return {};
@@ -907,10 +1109,13 @@ CapyPDF_IccColorSpaceId PdfDocument::store_icc_profile(std::string_view contents
   /N {}
 )",
                    num_channels);
-    auto stream_obj_id = add_object(DeflatePDFObject{std::move(buf), std::string{contents}});
+    auto stream_obj_id = add_object(
+        DeflatePDFObject{std::move(buf), std::string{contents}, CAPY_STREAM_CLASS_OTHER});
     auto obj_id =
         add_object(FullPDFObject{std::format("[ /ICCBased {} 0 R ]\n", stream_obj_id), {}});
     icc_profiles.emplace_back(IccInfo{stream_obj_id, obj_id, num_channels});
+    const CapyPDF_IccColorSpaceId iccid{(int32_t)icc_profiles.size() - 1};
+    icc_hashes[hash_content(contents)] = iccid;
     return CapyPDF_IccColorSpaceId{(int32_t)icc_profiles.size() - 1};
 }
 
@@ -1076,20 +1281,6 @@ rvoe<CapyPDF_ImageId> PdfDocument::add_image_object(int32_t w,
                                                     std::string_view original_bytes,
                                                     CapyPDF_Compression compression) {
     std::string buf;
-    std::string compression_buffer;
-    std::string_view compressed_bytes;
-    switch(compression) {
-    case CAPY_COMPRESSION_NONE: {
-        ERC(trial_compressed, flate_compress(original_bytes));
-        compression_buffer = std::move(trial_compressed);
-        compressed_bytes = compression_buffer;
-        break;
-    }
-    case CAPY_COMPRESSION_DEFLATE:
-        compressed_bytes = original_bytes;
-        break;
-    }
-
     auto app = std::back_inserter(buf);
     std::format_to(app,
                    R"(<<
@@ -1098,13 +1289,10 @@ rvoe<CapyPDF_ImageId> PdfDocument::add_image_object(int32_t w,
   /Width {}
   /Height {}
   /BitsPerComponent {}
-  /Length {}
-  /Filter /FlateDecode
 )",
                    w,
                    h,
-                   bits_per_component,
-                   compressed_bytes.size());
+                   bits_per_component);
 
     // Auto means don't specify the interpolation
     if(params.interp == CAPY_INTERPOLATION_PIXELATED) {
@@ -1114,14 +1302,17 @@ rvoe<CapyPDF_ImageId> PdfDocument::add_image_object(int32_t w,
     }
 
     // An image may only have ImageMask or ColorSpace key, not both.
+    int32_t num_channels = 1;
     if(params.as_mask) {
         buf += "  /ImageMask true\n";
     } else {
         if(auto cs = std::get_if<CapyPDF_ImageColorspace>(&colorspace)) {
             std::format_to(app, "  /ColorSpace {}\n", colorspace_names.at(*cs));
+            num_channels = num_channels_for(*cs);
         } else if(auto icc = std::get_if<CapyPDF_IccColorSpaceId>(&colorspace)) {
-            const auto icc_obj = get(*icc).object_num;
-            std::format_to(app, "  /ColorSpace {} 0 R\n", icc_obj);
+            const auto &icc_info = get(*icc);
+            std::format_to(app, "  /ColorSpace {} 0 R\n", icc_info.object_num);
+            num_channels = icc_info.num_channels;
         } else {
             fprintf(stderr, "Unknown colorspace.");
             std::abort();
@@ -1130,16 +1321,44 @@ rvoe<CapyPDF_ImageId> PdfDocument::add_image_object(int32_t w,
     if(smask_id) {
         std::format_to(app, "  /SMask {} 0 R\n", smask_id.value());
     }
-    buf += ">>\n";
+    if(compression == CAPY_COMPRESSION_DEFLATE) {
+        std::format_to(app,
+                       R"(  /Length {}
+  /Filter /FlateDecode
+>>
+)",
+                       original_bytes.size());
+    } else if(compression != CAPY_COMPRESSION_NONE) {
+        RETERR(Unreachable);
+    }
+    const auto key =
+        hash_content(original_bytes, hash_content(buf, ContentHash{(uint64_t)compression, 0}));
+    if(auto it = image_hashes.find(key); it != image_hashes.end()) {
+        const auto stored = object_contents(get(it->second).obj);
+        if(stored && stored->first == buf && stored->second == original_bytes) {
+            return it->second;
+        }
+    }
     int32_t im_id;
-    if(compression == CAPY_COMPRESSION_NONE) {
-        im_id = add_object(FullPDFObject{std::move(buf), std::move(compression_buffer)});
-    } else {
+    switch(compression) {
+    case CAPY_COMPRESSION_NONE:
+        // Encoded at write time, on the worker threads if there are any.
+        im_id = add_object(DeflatePDFObject{std::move(buf),
+                                            std::string{original_bytes},
+                                            CAPY_STREAM_CLASS_IMAGE,
+                                            RawPixelLayout{w, num_channels, bits_per_component}});
+        break;
+    case CAPY_COMPRESSION_DEFLATE:
         // FIXME. Makes a copy. Fix to grab original data instead.
         im_id = add_object(FullPDFObject{std::move(buf), std::string{original_bytes}});
+        break;
+    default:
+        RETERR(Unreachable);
     }
     image_info.emplace_back(ImageInfo{{w, h}, im_id});
-    return CapyPDF_ImageId{(int32_t)image_info.size() - 1};
+    const CapyPDF_ImageId iid{(int32_t)image_info.size() - 1};
+    image_hashes[key] = iid;
+    return iid;
 }
 
 rvoe<CapyPDF_ImageId> PdfDocument::embed_jpg(jpg_image jpg, const ImagePDFProperties &props) {
@@ -1168,9 +1387,18 @@ rvoe<CapyPDF_ImageId> PdfDocument::embed_jpg(jpg_image jpg, const ImagePDFProper
     }
     // FIXME, add other properties too?
 
+    const auto key = hash_content(jpg.file_contents, hash_content(buf));
+    if(auto it = image_hashes.find(key); it != image_hashes.end()) {
+        const auto stored = object_contents(get(it->second).obj);
+        if(stored && stored->first == buf && stored->second == jpg.file_contents) {
+            return it->second;
+        }
+    }
     auto im_id = add_object(FullPDFObject{std::move(buf), std::move(jpg.file_contents)});
     image_info.emplace_back(ImageInfo{{jpg.w, jpg.h}, im_id});
-    return CapyPDF_ImageId{(int32_t)image_info.size() - 1};
+    const CapyPDF_ImageId iid{(int32_t)image_info.size() - 1};
+    image_hashes[key] = iid;
+    return iid;
 }
 
 rvoe<CapyPDF_GraphicsStateId> PdfDocument::add_graphics_state(const GraphicsState &state) {
@@ -1461,23 +1689,36 @@ rvoe<CapyPDF_FormWidgetId> PdfDocument::create_form_checkbox(PdfBox loc,
 
 rvoe<CapyPDF_EmbeddedFileId> PdfDocument::embed_file(const std::filesystem::path &fname) {
     ERC(contents, load_file(fname));
-    std::string dict = std::format(R"(<<
-  /Type /EmbeddedFile
-  /Length {}
->>)",
-                                   contents.size());
-    auto fileobj_id = add_object(FullPDFObject{std::move(dict), std::move(contents)});
-    dict = std::format(R"(<<
-  /Type /Filespec
-  /F {}
-  /EF << /F {} 0 R >>
->>
-)",
-                       pdfstring_quote(fname.filename().string()),
-                       fileobj_id);
-    auto filespec_id = add_object(FullPDFObject{std::move(dict), {}});
+    const auto stream_key = hash_content(contents);
+    const auto quoted_name = pdfstring_quote(fname.filename().string());
+    const auto key = hash_content(quoted_name, stream_key);
+    if(auto it = embedded_file_hashes.find(key); it != embedded_file_hashes.end()) {
+        const auto &existing = embedded_files.at(it->second.id);
+        const auto stored_spec = object_contents(existing.filespec_obj);
+        const auto stored_file = object_contents(existing.contents_obj);
+        if(stored_spec && stored_file && stored_file->second == contents &&
+           stored_spec->first == filespec_dict(quoted_name, existing.contents_obj)) {
+            return it->second;
+        }
+    }
+    // Files with different names but the same contents share the stream.
+    int32_t fileobj_id = -1;
+    if(auto it = embedded_stream_hashes.find(stream_key); it != embedded_stream_hashes.end()) {
+        const auto stored = object_contents(it->second);
+        if(stored && stored->second == contents) {
+            fileobj_id = it->second;
+        }
+    }
+    if(fileobj_id < 0) {
+        fileobj_id = add_object(DeflatePDFObject{
+            "<<\n  /Type /EmbeddedFile\n", std::move(contents), CAPY_STREAM_CLASS_EMBEDDED_FILE});
+        embedded_stream_hashes[stream_key] = fileobj_id;
+    }
+    auto filespec_id = add_object(FullPDFObject{filespec_dict(quoted_name, fileobj_id), {}});
     embedded_files.emplace_back(EmbeddedFileObject{filespec_id, fileobj_id});
-    return CapyPDF_EmbeddedFileId{(int32_t)embedded_files.size() - 1};
+    const CapyPDF_EmbeddedFileId efid{(int32_t)embedded_files.size() - 1};
+    embedded_file_hashes[key] = efid;
+    return efid;
 }
 
 rvoe<CapyPDF_AnnotationId> PdfDocument::create_annotation(const Annotation &a) {
@@ -1547,21 +1788,77 @@ rvoe<CapyPDF_TransparencyGroupId> PdfDocument::add_transparency_group(PdfDrawCon
 
 std::optional<double>
 PdfDocument::glyph_advance(CapyPDF_FontId fid, double pointsize, uint32_t codepoint) const {
-    FT_Face face = fonts.at(fid.id).fontdata.face.get();
-    FT_Set_Char_Size(face, 0, (FT_F26Dot6)(pointsize * 64), 300, 300);
-    if(FT_Load_Char(face, codepoint, FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP) != 0) {
+    const auto metrics = glyph_metrics(fid, codepoint);
+    if(!metrics) {
         return {};
     }
-    const auto font_unit_advance = face->glyph->metrics.horiAdvance;
-    return (font_unit_advance / 64.0) / 300.0 * 72.0;
+    FT_Face face = fonts.at(get(fid).font_index_tmp).fontdata.face.get();
+    return metrics->advance * pointsize / face->units_per_EM;
 }
 
-rvoe<CapyPDF_FontId> PdfDocument::load_font(FT_Library ft, const std::filesystem::path &fname) {
-    ERC(fontdata, load_and_parse_truetype_font(fname));
-    TtfFont ttf{std::unique_ptr<FT_FaceRec_, FT_Error (*)(FT_Face)>{nullptr, guarded_face_close},
+std::optional<GlyphMetrics> PdfDocument::glyph_metrics(CapyPDF_FontId fid,
+                                                       uint32_t codepoint) const {
+    const auto &font = fonts.at(get(fid).font_index_tmp);
+    auto it = font.metrics_cache.find(codepoint);
+    if(it != font.metrics_cache.end()) {
+        return it->second;
+    }
+    FT_Face face = font.fontdata.face.get();
+    std::optional<GlyphMetrics> metrics;
+    const auto glyph_index = FT_Get_Char_Index(face, codepoint);
+    if(FT_Load_Glyph(face, glyph_index, FT_LOAD_NO_SCALE | FT_LOAD_NO_BITMAP) == 0) {
+        metrics = GlyphMetrics{glyph_index, (int32_t)face->glyph->metrics.horiAdvance};
+    }
+    font.metrics_cache.emplace(codepoint, metrics);
+    return metrics;
+}
+
+rvoe<int32_t>
+PdfDocument::glyph_kerning(CapyPDF_FontId fid, uint32_t left_glyph, uint32_t right_glyph) const {
+    const auto &font = fonts.at(get(fid).font_index_tmp);
+    FT_Face face = font.fontdata.face.get();
+    if(!FT_HAS_KERNING(face)) {
+        return 0;
+    }
+    const auto key = kerning_key(left_glyph, right_glyph);
+    auto it = font.kerning_cache.find(key);
+    if(it != font.kerning_cache.end()) {
+        return it->second;
+    }
+    if(font.kerning_complete) {
+        return 0;
+    }
+    FT_Vector kerning;
+    if(FT_Get_Kerning(face, left_glyph, right_glyph, FT_KERNING_UNSCALED, &kerning) != 0) {
+        RETERR(FreeTypeError);
+    }
+    font.kerning_cache[key] = (int32_t)kerning.x;
+    return (int32_t)kerning.x;
+}
+
+rvoe<CapyPDF_FontId> PdfDocument::load_font(FT_Library ft,
+                                            const std::filesystem::path &fname,
+                                            const FontProperties &props) {
+    ERC(file_contents, load_file(fname));
+    // The same file can be loaded once with each encoding.
+    const auto key = hash_content(file_contents, ContentHash{(uint64_t)props.encoding, 0});
+    if(auto it = font_hashes.find(key); it != font_hashes.end()) {
+        const auto &existing = fonts.at(get(it->second).font_index_tmp);
+        if(existing.encoding == props.encoding &&
+           existing.fontdata.file_contents == file_contents) {
+            return it->second;
+        }
+    }
+    ERC(fontdata, parse_truetype_font(file_contents));
+    TtfFont ttf{std::move(file_contents),
+                std::unique_ptr<FT_FaceRec_, FT_Error (*)(FT_Face)>{nullptr, guarded_face_close},
                 std::move(fontdata)};
     FT_Face face;
-    auto error = FT_New_Face(ft, fname.string().c_str(), 0, &face);
+    auto error = FT_New_Memory_Face(ft,
+                                    (const FT_Byte *)ttf.file_contents.data(),
+                                    (FT_Long)ttf.file_contents.size(),
+                                    0,
+                                    &face);
     if(error) {
         // By default Freetype is compiled without
         // error strings. Yay!
@@ -1597,8 +1894,12 @@ rvoe<CapyPDF_FontId> PdfDocument::load_font(FT_Library ft, const std::filesystem
         RETERR(UnsupportedFormat);
     }
     auto font_source_id = fonts.size();
-    ERC(fss, FontSubsetter::construct(fname, face));
-    fonts.emplace_back(FontThingy{std::move(ttf), std::move(fss)});
+    const bool is_cid = props.encoding == CAPY_FONT_ENCODING_IDENTITY_H;
+    ERC(fss, FontSubsetter::construct(fname, face, is_cid ? max_cid_glyphs : max_glyphs));
+    fonts.emplace_back(FontThingy{std::move(ttf), std::move(fss), props.encoding});
+    if(opts.preload_kerning) {
+        preload_kerning(fonts.back());
+    }
 
     const int32_t subset_num = 0;
     auto subfont_data_obj =
@@ -1609,13 +1910,41 @@ rvoe<CapyPDF_FontId> PdfDocument::load_font(FT_Library ft, const std::filesystem
         add_object(DelayedSubsetCMap{CapyPDF_FontId{(int32_t)font_source_id}, subset_num});
     auto subfont_obj = add_object(DelayedSubsetFont{
         CapyPDF_FontId{(int32_t)font_source_id}, subfont_descriptor_obj, subfont_cmap_obj});
-    (void)subfont_obj;
+    if(is_cid) {
+        // The subset font is the descendant CIDFont of this one.
+        auto type0_dict = std::format(R"(<<
+  /Type /Font
+  /Subtype /Type0
+  /BaseFont /{}
+  /Encoding /Identity-H
+  /DescendantFonts [ {} 0 R ]
+  /ToUnicode {} 0 R
+>>
+)",
+                                      subsetfontname2pdfname(FT_Get_Postscript_Name(face), 0),
+                                      subfont_obj,
+                                      subfont_cmap_obj);
+        subfont_obj = add_object(FullPDFObject{std::move(type0_dict), {}});
+    }
     CapyPDF_FontId fid{(int32_t)fonts.size() - 1};
     font_objects.push_back(
         FontInfo{subfont_data_obj, subfont_descriptor_obj, subfont_obj, fonts.size() - 1});
+    font_hashes[key] = fid;
     return fid;
 }
 
+std::optional<std::pair<std::string_view, std::string_view>>
+PdfDocument::object_contents(int32_t object_num) const {
+    const auto &obj = document_objects.at(object_num);
+    if(const auto *full = std::get_if<FullPDFObject>(&obj)) {
+        return std::pair<std::string_view, std::string_view>{full->dictionary, full->stream};
+    } else if(const auto *deflate = std::get_if<DeflatePDFObject>(&obj)) {
+        return std::pair<std::string_view, std::string_view>{deflate->unclosed_dictionary,
+                                                              deflate->stream};
+    }
+    return {};
+}
+
 rvoe<NoReturnValue> PdfDocument::validate_format(const RasterImage &ri) const {
     // Check that the image has the correct format.
     if(std::holds_alternative<CapyPDF_PDFX_Type>(opts.subtype)) {
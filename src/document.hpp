@@ -30,14 +30,26 @@ FT_Error guarded_face_close(FT_Face face);
 namespace capypdf::internal {
 
 struct TtfFont {
+    // Backs the FreeType face, so it is destroyed after it.
+    std::string file_contents;
     std::unique_ptr<FT_FaceRec_, FT_Error (*)(FT_Face)> face;
     TrueTypeFontFile fontdata;
 };
 
 struct PageOffsets {
+    // Objects from this one up to the page object belong only to the page.
+    int32_t first_obj_num;
     int32_t resource_obj_num;
     int32_t commands_obj_num;
     int32_t page_obj_num;
+    // Content stream chunks are the objects right before commands_obj_num.
+    int32_t num_content_chunks = 0;
+};
+
+// A part of a page's content stream that was compressed while drawing.
+struct ContentChunk {
+    std::string data;
+    uint64_t uncompressed_size;
 };
 
 struct ImageSize {
@@ -109,9 +121,15 @@ struct FullPDFObject {
     std::string stream;
 };
 
+// Compressed at write time according to the stream class's compression settings.
 struct DeflatePDFObject {
     std::string unclosed_dictionary;
     std::string stream;
+    CapyPDF_Stream_Class stream_class;
+    std::optional<RawPixelLayout> pixels = {};
+    // Set if the stream has already been encoded.
+    std::optional<uint64_t> uncompressed_size = {};
+    CapyPDF_Stream_Encoding encoding = CAPY_STREAM_ENCODING_DEFLATE;
 };
 
 struct DelayedSubsetFontData {
@@ -150,14 +168,31 @@ struct DelayedPage {
 
 struct SubsetGlyph {
     FontSubset ss;
-    uint8_t glyph_id;
+    uint16_t glyph_id;
+};
+
+struct GlyphMetrics {
+    uint32_t glyph_index;
+    // In font units, so the same value works for all point sizes.
+    int32_t advance;
 };
 
 struct FontThingy {
     TtfFont fontdata;
     FontSubsetter subsets;
+    CapyPDF_Font_Encoding encoding;
+    // Filled on first use of each codepoint, empty for missing glyphs.
+    mutable std::unordered_map<uint32_t, std::optional<GlyphMetrics>> metrics_cache{};
+    // Kerning of glyph pairs in font units, keyed by kerning_key().
+    mutable std::unordered_map<uint64_t, int32_t> kerning_cache{};
+    // Set when kerning_cache has every pair of the font, so missing pairs have no kerning.
+    bool kerning_complete = false;
 };
 
+inline uint64_t kerning_key(uint32_t left_glyph, uint32_t right_glyph) {
+    return (uint64_t(left_glyph) << 32) | right_glyph;
+}
+
 struct ColorProfiles {
     std::filesystem::path rgb_profile_file;
     std::filesystem::path gray_profile_file;
@@ -183,7 +218,34 @@ struct DocumentMetadata {
     ColorProfiles prof;
     std::variant<std::monostate, CapyPDF_PDFX_Type, CapyPDF_PDFA_Type> subtype;
     std::string intent_condition_identifier;
-    bool compress_streams = false;
+    CompressionPolicy compression;
+    bool stream_pages = false;
+    bool object_streams = false;
+    // Zero means one per hardware core.
+    int32_t num_threads = 1;
+    // Collect statistics and phase timings while writing.
+    bool write_stats = false;
+    // In streaming mode, pages are queued for a background writer thread
+    // if the depth is positive. Zero bytes means no size limit.
+    int32_t write_queue_depth = 0;
+    int64_t write_queue_max_bytes = 0;
+    // Most decimals written for real numbers in content streams.
+    int32_t number_precision = 6;
+    // Write content streams without indentation and optional whitespace.
+    bool compact_content = false;
+    // Store drawing operators in binary form and format them only
+    // when the draw context is serialized.
+    bool record_display_lists = false;
+    // Remove redundant operators from recorded content streams.
+    // Implies record_display_lists.
+    bool optimize_content = false;
+    // Write one resource dictionary that all pages share.
+    bool merge_resources = false;
+    // Compress page content in parts of about this many bytes as it is
+    // drawn. Zero keeps the whole content stream in memory.
+    int64_t content_chunk_size = 0;
+    // Read all kerning pairs from the kern table when a font is loaded.
+    bool preload_kerning = false;
 };
 
 struct Outline {
@@ -289,6 +351,11 @@ struct StructItem {
     StructItemExtraData extra;
 };
 
+// An object that has already been written to the output. Used for
+// pages in streaming mode and for object streams. Their locations
+// are tracked by the writer.
+struct WrittenObject {};
+
 struct StructureUsage {
     int32_t page_num;
     int32_t mcid_num;
@@ -305,9 +372,12 @@ typedef std::variant<DummyIndexZero,
                      DelayedPage,
                      DelayedCheckboxWidgetAnnotation, // FIXME, convert to hold all widgets
                      DelayedAnnotation,
-                     DelayedStructItem>
+                     DelayedStructItem,
+                     WrittenObject>
     ObjectType;
 
+static_assert(std::variant_size_v<ObjectType> == CAPY_OBJECT_KIND_WRITTEN + 1);
+
 struct RolemapEnty {
     std::string name;
     CapyPDF_StructureType builtin;
@@ -315,6 +385,71 @@ struct RolemapEnty {
 
 typedef std::variant<CapyPDF_ImageColorspace, CapyPDF_IccColorSpaceId> ImageColorspaceType;
 
+struct PhaseTiming {
+    int64_t wall_ns = 0;
+    int64_t cpu_ns = 0;
+};
+
+struct WriteStats {
+    // Number of streams written, indexed by stream class and encoding.
+    std::array<std::array<int32_t, CAPY_STREAM_ENCODING_PNG_PREDICTOR + 1>,
+               CAPY_STREAM_CLASS_OTHER + 1>
+        stream_counts{};
+    // Stream sizes before and after encoding, indexed by stream class.
+    std::array<int64_t, CAPY_STREAM_CLASS_OTHER + 1> raw_bytes{};
+    std::array<int64_t, CAPY_STREAM_CLASS_OTHER + 1> encoded_bytes{};
+    // The object list when writing began, indexed by ObjectType alternative.
+    std::array<int32_t, CAPY_OBJECT_KIND_WRITTEN + 1> object_counts{};
+    std::array<int64_t, CAPY_OBJECT_KIND_WRITTEN + 1> object_bytes{};
+    std::array<PhaseTiming, CAPY_WRITE_PHASE_OUTPUT + 1> phases{};
+    int64_t peak_buffered_bytes = 0;
+    // Operators dropped by the content stream optimizer.
+    int64_t removed_operators = 0;
+};
+
+// Named resources used by a content stream.
+struct ResourceUsage {
+    FlatSet<int32_t> images;
+    FlatSet<int32_t> form_xobjects;
+    FlatSet<CapyPDF_TransparencyGroupId> trgroups;
+    FlatSet<int32_t> fonts;
+    FlatSet<FontSubset> subset_fonts;
+    FlatSet<int32_t> colorspaces;
+    bool all_colorspace = false;
+    FlatSet<int32_t> gstates;
+    FlatSet<int32_t> shadings;
+    FlatSet<int32_t> patterns;
+    FlatSet<CapyPDF_OptionalContentGroupId> ocgs;
+
+    void clear() {
+        images.clear();
+        form_xobjects.clear();
+        trgroups.clear();
+        fonts.clear();
+        subset_fonts.clear();
+        colorspaces.clear();
+        all_colorspace = false;
+        gstates.clear();
+        shadings.clear();
+        patterns.clear();
+        ocgs.clear();
+    }
+
+    void merge(const ResourceUsage &other) {
+        images.merge(other.images);
+        form_xobjects.merge(other.form_xobjects);
+        trgroups.merge(other.trgroups);
+        fonts.merge(other.fonts);
+        subset_fonts.merge(other.subset_fonts);
+        colorspaces.merge(other.colorspaces);
+        all_colorspace = all_colorspace || other.all_colorspace;
+        gstates.merge(other.gstates);
+        shadings.merge(other.shadings);
+        patterns.merge(other.patterns);
+        ocgs.merge(other.ocgs);
+    }
+};
+
 class PdfDocument {
 public:
     static rvoe<PdfDocument> construct(const DocumentMetadata &d, PdfColorConverter cm);
@@ -326,18 +461,21 @@ public:
     friend class PdfWriter;
 
     // Pages
-    rvoe<NoReturnValue> add_page(std::string resource_dict,
+    rvoe<NoReturnValue> add_page(const ResourceUsage &resources,
                                  std::string unclosed_object_dict,
+                                 std::vector<ContentChunk> content_chunks,
                                  std::string command_stream,
                                  const PageProperties &custom_props,
-                                 const std::unordered_set<CapyPDF_FormWidgetId> &form_widgets,
-                                 const std::unordered_set<CapyPDF_AnnotationId> &annots,
+                                 const FlatSet<CapyPDF_FormWidgetId> &form_widgets,
+                                 const FlatSet<CapyPDF_AnnotationId> &annots,
                                  const std::vector<CapyPDF_StructureItemId> &structs,
                                  const std::optional<Transition> &transition,
                                  const std::vector<SubPageNavigation> &subnav);
 
+    std::string build_resource_dict(const ResourceUsage &used);
+
     // Form XObjects
-    void add_form_xobject(std::string xobj_data, std::string xobj_stream);
+    CapyPDF_FormXObjectId add_form_xobject(std::string xobj_data, std::string xobj_stream);
 
     // Colors
     rvoe<CapyPDF_SeparationId> create_separation(const asciistring &name,
@@ -346,7 +484,12 @@ public:
     rvoe<CapyPDF_IccColorSpaceId> load_icc_file(const std::filesystem::path &fname);
 
     // Fonts
-    rvoe<CapyPDF_FontId> load_font(FT_Library ft, const std::filesystem::path &fname);
+    rvoe<CapyPDF_FontId>
+    load_font(FT_Library ft, const std::filesystem::path &fname, const FontProperties &props);
+    // Identity-H fonts use two byte character codes, others one byte.
+    bool has_two_byte_codes(CapyPDF_FontId fid) const {
+        return fonts.at(get(fid).font_index_tmp).encoding == CAPY_FONT_ENCODING_IDENTITY_H;
+    }
     rvoe<SubsetGlyph> get_subset_glyph(CapyPDF_FontId fid,
                                        uint32_t codepoint,
                                        const std::optional<uint32_t> glyph_id);
@@ -405,6 +548,33 @@ public:
     // Transparency groups
     rvoe<CapyPDF_TransparencyGroupId> add_transparency_group(PdfDrawContext &ctx);
 
+    std::optional<GlyphMetrics> glyph_metrics(CapyPDF_FontId fid, uint32_t codepoint) const;
+    // In font units.
+    rvoe<int32_t>
+    glyph_kerning(CapyPDF_FontId fid, uint32_t left_glyph, uint32_t right_glyph) const;
+
+    // Calls func(codepoint, metrics, kerning) for every character of the text,
+    // where kerning is the adjustment before the character in font units.
+    // FreeType only knows the kern table, so GPOS kerning is not applied.
+    template<typename Func>
+    rvoe<NoReturnValue>
+    for_each_kerned_char(CapyPDF_FontId fid, const u8string &text, Func &&func) const {
+        std::optional<uint32_t> previous_glyph;
+        for(const auto codepoint : text) {
+            const auto metrics = glyph_metrics(fid, codepoint);
+            if(!metrics) {
+                RETERR(FreeTypeError);
+            }
+            int32_t kerning = 0;
+            if(previous_glyph) {
+                ERC(k, glyph_kerning(fid, *previous_glyph, metrics->glyph_index));
+                kerning = k;
+            }
+            func(codepoint, *metrics, kerning);
+            previous_glyph = metrics->glyph_index;
+        }
+        RETOK;
+    }
     std::optional<double>
     glyph_advance(CapyPDF_FontId fid, double pointsize, uint32_t codepoint) const;
 
@@ -455,6 +625,11 @@ private:
 
     rvoe<NoReturnValue> validate_format(const RasterImage &ri) const;
 
+    // The dictionary and stream of an object that has not been written
+    // yet. Deduplication compares them, as content hashes can collide.
+    std::optional<std::pair<std::string_view, std::string_view>>
+    object_contents(int32_t object_num) const;
+
     // Typed getters for less typing.
     IccInfo &get(CapyPDF_IccColorSpaceId id) { return icc_profiles.at(id.id); }
     const IccInfo &get(CapyPDF_IccColorSpaceId id) const { return icc_profiles.at(id.id); }
@@ -490,6 +665,20 @@ private:
     std::unordered_map<CapyPDF_FormWidgetId, int32_t> form_use;
     std::unordered_map<CapyPDF_AnnotationId, int32_t> annotation_use;
     std::unordered_map<CapyPDF_StructureItemId, StructureUsage> structure_use;
+    // Identical data is only stored once.
+    std::unordered_map<ContentHash, CapyPDF_ImageId> image_hashes;
+    std::unordered_map<ContentHash, CapyPDF_IccColorSpaceId> icc_hashes;
+    std::unordered_map<ContentHash, int32_t> embedded_stream_hashes;
+    std::unordered_map<ContentHash, CapyPDF_EmbeddedFileId> embedded_file_hashes;
+    std::unordered_map<ContentHash, CapyPDF_FormXObjectId> form_xobject_hashes;
+    std::unordered_map<ContentHash, CapyPDF_FontId> font_hashes;
+    // Page resource dictionaries, so that pages with the same
+    // resources share one object. They are short, so they are
+    // used as keys as is.
+    std::unordered_map<std::string, int32_t> resource_dicts;
+    // Union of the resources of all pages when they share one dictionary.
+    ResourceUsage merged_resources;
+    std::optional<int32_t> merged_resources_object;
     std::vector<std::vector<CapyPDF_StructureItemId>>
         structure_parent_tree_items; // FIXME should be a variant of some sort?
     std::optional<CapyPDF_IccColorSpaceId> output_profile;
@@ -499,6 +688,7 @@ private:
     std::optional<int32_t> pdfa_md_object;
     int32_t pages_object;
     bool write_attempted = false;
+    WriteStats write_stats;
 };
 
 } // namespace capypdf::internal
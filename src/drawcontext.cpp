@@ -12,10 +12,251 @@
 #include <array>
 #include <cmath>
 #include <cassert>
+#include <cstring>
 #include <memory>
 
 namespace capypdf::internal {
 
+namespace {
+
+struct PathOpInfo {
+    DLOp op;
+    size_t num_operands;
+};
+
+// Indexed by CapyPDF_Path_Op.
+const std::array<PathOpInfo, CAPY_PATH_OP_H + 1> path_op_infos{{
+    {DLOp::m, 2},
+    {DLOp::l, 2},
+    {DLOp::c, 6},
+    {DLOp::v, 4},
+    {DLOp::y, 4},
+    {DLOp::re, 4},
+    {DLOp::h, 0},
+}};
+
+// Reads the records of a command buffer.
+class CommandReader {
+public:
+    explicit CommandReader(std::span<const uint8_t> buf) : buf{buf} {}
+
+    bool at_end() const { return offset == buf.size(); }
+
+    template<typename T> rvoe<T> read() {
+        if(buf.size() - offset < sizeof(T)) {
+            RETERR(CommandBufferTruncated);
+        }
+        T value;
+        memcpy(&value, buf.data() + offset, sizeof(T));
+        offset += sizeof(T);
+        return value;
+    }
+
+    rvoe<std::string> read_text() {
+        ERC(size, read<int32_t>());
+        if(size < 0 || buf.size() - offset < (size_t)size) {
+            RETERR(CommandBufferTruncated);
+        }
+        std::string text((const char *)buf.data() + offset, size);
+        offset += size;
+        return text;
+    }
+
+    template<size_t N> rvoe<std::array<double, N>> read_numbers() {
+        std::array<double, N> numbers;
+        for(auto &n : numbers) {
+            ERC(value, read<double>());
+            n = value;
+        }
+        return numbers;
+    }
+
+    rvoe<std::vector<double>> read_number_array() {
+        ERC(size, read<int32_t>());
+        if(size < 0 || (buf.size() - offset) / sizeof(double) < (size_t)size) {
+            RETERR(CommandBufferTruncated);
+        }
+        std::vector<double> numbers(size);
+        memcpy(numbers.data(), buf.data() + offset, size * sizeof(double));
+        offset += size * sizeof(double);
+        return numbers;
+    }
+
+private:
+    std::span<const uint8_t> buf;
+    size_t offset = 0;
+};
+
+rvoe<NoReturnValue> execute_command(PdfDrawContext &ctx, CommandReader &reader) {
+    ERC(cmd, reader.read<uint8_t>());
+    switch((CapyPDF_Command)cmd) {
+    case CAPY_CMD_b:
+        return ctx.cmd_b();
+    case CAPY_CMD_B:
+        return ctx.cmd_B();
+    case CAPY_CMD_bstar:
+        return ctx.cmd_bstar();
+    case CAPY_CMD_Bstar:
+        return ctx.cmd_Bstar();
+    case CAPY_CMD_BDC_builtin: {
+        ERC(id, reader.read<int32_t>());
+        return ctx.cmd_BDC(CapyPDF_StructureItemId{id});
+    }
+    case CAPY_CMD_BDC_ocg: {
+        ERC(id, reader.read<int32_t>());
+        return ctx.cmd_BDC(CapyPDF_OptionalContentGroupId{id});
+    }
+    case CAPY_CMD_BMC: {
+        ERC(tag, reader.read_text());
+        return ctx.cmd_BMC(tag);
+    }
+    case CAPY_CMD_c: {
+        ERC(a, reader.read_numbers<6>());
+        return ctx.cmd_c(a[0], a[1], a[2], a[3], a[4], a[5]);
+    }
+    case CAPY_CMD_cm: {
+        ERC(a, reader.read_numbers<6>());
+        return ctx.cmd_cm(a[0], a[1], a[2], a[3], a[4], a[5]);
+    }
+    case CAPY_CMD_d: {
+        ERC(dashes, reader.read_number_array());
+        ERC(phase, reader.read<double>());
+        return ctx.cmd_d(dashes.data(), dashes.size(), phase);
+    }
+    case CAPY_CMD_Do: {
+        ERC(id, reader.read<int32_t>());
+        return ctx.cmd_Do(CapyPDF_TransparencyGroupId{id});
+    }
+    case CAPY_CMD_EMC:
+        return ctx.cmd_EMC();
+    case CAPY_CMD_f:
+        return ctx.cmd_f();
+    case CAPY_CMD_fstar:
+        return ctx.cmd_fstar();
+    case CAPY_CMD_G: {
+        ERC(a, reader.read_numbers<1>());
+        return ctx.cmd_G(a[0]);
+    }
+    case CAPY_CMD_g: {
+        ERC(a, reader.read_numbers<1>());
+        return ctx.cmd_g(a[0]);
+    }
+    case CAPY_CMD_gs: {
+        ERC(id, reader.read<int32_t>());
+        return ctx.cmd_gs(CapyPDF_GraphicsStateId{id});
+    }
+    case CAPY_CMD_h:
+        return ctx.cmd_h();
+    case CAPY_CMD_i: {
+        ERC(a, reader.read_numbers<1>());
+        return ctx.cmd_i(a[0]);
+    }
+    case CAPY_CMD_j: {
+        ERC(join, reader.read<int32_t>());
+        return ctx.cmd_j((CapyPDF_Line_Join)join);
+    }
+    case CAPY_CMD_J: {
+        ERC(cap, reader.read<int32_t>());
+        return ctx.cmd_J((CapyPDF_Line_Cap)cap);
+    }
+    case CAPY_CMD_K: {
+        ERC(a, reader.read_numbers<4>());
+        return ctx.cmd_K(a[0], a[1], a[2], a[3]);
+    }
+    case CAPY_CMD_k: {
+        ERC(a, reader.read_numbers<4>());
+        return ctx.cmd_k(a[0], a[1], a[2], a[3]);
+    }
+    case CAPY_CMD_l: {
+        ERC(a, reader.read_numbers<2>());
+        return ctx.cmd_l(a[0], a[1]);
+    }
+    case CAPY_CMD_m: {
+        ERC(a, reader.read_numbers<2>());
+        return ctx.cmd_m(a[0], a[1]);
+    }
+    case CAPY_CMD_M: {
+        ERC(a, reader.read_numbers<1>());
+        return ctx.cmd_M(a[0]);
+    }
+    case CAPY_CMD_n:
+        return ctx.cmd_n();
+    case CAPY_CMD_q:
+        return ctx.cmd_q();
+    case CAPY_CMD_Q:
+        return ctx.cmd_Q();
+    case CAPY_CMD_re: {
+        ERC(a, reader.read_numbers<4>());
+        return ctx.cmd_re(a[0], a[1], a[2], a[3]);
+    }
+    case CAPY_CMD_RG: {
+        ERC(a, reader.read_numbers<3>());
+        return ctx.cmd_RG(a[0], a[1], a[2]);
+    }
+    case CAPY_CMD_rg: {
+        ERC(a, reader.read_numbers<3>());
+        return ctx.cmd_rg(a[0], a[1], a[2]);
+    }
+    case CAPY_CMD_ri: {
+        ERC(ri, reader.read<int32_t>());
+        return ctx.cmd_ri((CapyPDF_Rendering_Intent)ri);
+    }
+    case CAPY_CMD_s:
+        return ctx.cmd_s();
+    case CAPY_CMD_S:
+        return ctx.cmd_S();
+    case CAPY_CMD_sh: {
+        ERC(id, reader.read<int32_t>());
+        return ctx.cmd_sh(CapyPDF_ShadingId{id});
+    }
+    case CAPY_CMD_Tr: {
+        ERC(mode, reader.read<int32_t>());
+        return ctx.cmd_Tr((CapyPDF_Text_Mode)mode);
+    }
+    case CAPY_CMD_v: {
+        ERC(a, reader.read_numbers<4>());
+        return ctx.cmd_v(a[0], a[1], a[2], a[3]);
+    }
+    case CAPY_CMD_w: {
+        ERC(a, reader.read_numbers<1>());
+        return ctx.cmd_w(a[0]);
+    }
+    case CAPY_CMD_W:
+        return ctx.cmd_W();
+    case CAPY_CMD_Wstar:
+        return ctx.cmd_Wstar();
+    case CAPY_CMD_y: {
+        ERC(a, reader.read_numbers<4>());
+        return ctx.cmd_y(a[0], a[1], a[2], a[3]);
+    }
+    case CAPY_CMD_DRAW_IMAGE: {
+        ERC(id, reader.read<int32_t>());
+        return ctx.draw_image(CapyPDF_ImageId{id});
+    }
+    case CAPY_CMD_RENDER_TEXT: {
+        ERC(text, reader.read_text());
+        ERC(id, reader.read<int32_t>());
+        ERC(a, reader.read_numbers<3>());
+        ERC(utxt, u8string::from_cstr(text));
+        return ctx.render_text(utxt, CapyPDF_FontId{id}, a[0], a[1], a[2]);
+    }
+    }
+    RETERR(BadEnum);
+}
+
+// Fonts with Identity-H encoding use two byte character codes.
+void format_glyph_code(std::back_insert_iterator<std::string> &app,
+                       uint16_t glyph_id,
+                       bool two_byte_codes) {
+    if(two_byte_codes) {
+        std::format_to(app, "<{:04x}>", glyph_id);
+    } else {
+        std::format_to(app, "<{:02x}>", (unsigned char)glyph_id);
+    }
+}
+
+} // namespace
+
 GstatePopper::~GstatePopper() { ctx->cmd_Q(); }
 
 PdfDrawContext::PdfDrawContext(
@@ -31,32 +272,38 @@ PdfDrawContext::PdfDrawContext(PdfDocument *doc,
 PdfDrawContext::~PdfDrawContext() {}
 
 DCSerialization PdfDrawContext::serialize() {
-    auto resource_dict = build_resource_dict();
+    finish_recording();
     if(context_type == CAPY_DC_FORM_XOBJECT) {
+        auto resource_dict = build_resource_dict();
         std::string dict = std::format(
             R"(<<
   /Type /XObject
   /Subtype /Form
-  /BBox [ {:f} {:f} {:f} {:f} ]
+  /BBox [ {} {} {} {} ]
   /Resources {}
   /Length {}
 >>
 )",
-            bbox.x1,
-            bbox.y1,
-            bbox.x2,
-            bbox.y2,
+            num(bbox.x1),
+            num(bbox.y1),
+            num(bbox.x2),
+            num(bbox.y2),
             resource_dict,
             commands.size());
         return SerializedXObject{std::move(dict), commands};
     } else if(context_type == CAPY_DC_TRANSPARENCY_GROUP) {
+        auto resource_dict = build_resource_dict();
         std::string dict = R"(<<
   /Type /XObject
   /Subtype /Form
 )";
         auto app = std::back_inserter(dict);
-        std::format_to(
-            app, "  /BBox [ {:f} {:f} {:f} {:f} ]\n", bbox.x1, bbox.y1, bbox.x2, bbox.y2);
+        std::format_to(app,
+                       "  /BBox [ {} {} {} {} ]\n",
+                       num(bbox.x1),
+                       num(bbox.y1),
+                       num(bbox.x2),
+                       num(bbox.y2));
         if(custom_props.transparency_props) {
             dict += "  /Group ";
             custom_props.transparency_props->serialize(app, "  ");
@@ -71,129 +318,93 @@ DCSerialization PdfDrawContext::serialize() {
         return SerializedXObject{std::move(dict), commands};
     } else {
         SerializedBasicContext sc;
-        sc.resource_dict = std::move(resource_dict);
         sc.unclosed_object_dict = "<<\n";
+        sc.content_chunks = std::move(content_chunks);
+        content_chunks.clear();
         sc.command_stream = commands;
         return sc;
     }
 }
 
-void PdfDrawContext::clear() {
-    commands.clear();
-    used_images.clear();
-    used_subset_fonts.clear();
-    used_fonts.clear();
-    used_colorspaces.clear();
-    used_gstates.clear();
-    used_shadings.clear();
-    used_patterns.clear();
-    used_widgets.clear();
-    used_annotations.clear();
-    used_ocgs.clear();
-    used_trgroups.clear();
-    ind.clear();
-    sub_navigations.clear();
-    transition.reset();
-    is_finalized = false;
-    uses_all_colorspace = false;
-    custom_props = PageProperties{};
+std::string_view PdfDrawContext::get_command_stream() {
+    finish_recording();
+    return commands;
 }
 
-std::string PdfDrawContext::build_resource_dict() {
-    std::string resources;
-    auto resource_appender = std::back_inserter(resources);
-    resources = "<<\n";
-    if(!used_images.empty() || !used_form_xobjects.empty() || !used_trgroups.empty()) {
-        resources += "  /XObject <<\n";
-        if(!used_images.empty()) {
-            for(const auto &i : used_images) {
-                std::format_to(resource_appender, "    /Image{} {} 0 R\n", i, i);
-            }
-        }
-        if(!used_form_xobjects.empty()) {
-            for(const auto &fx : used_form_xobjects) {
-                std::format_to(resource_appender, "    /FXO{} {} 0 R\n", fx, fx);
-            }
-        }
-        if(!used_trgroups.empty()) {
-            for(const auto &tg : used_trgroups) {
-                auto objnum = doc->transparency_groups.at(tg.id);
-                std::format_to(resource_appender, "    /TG{} {} 0 R\n", objnum, objnum);
-            }
-        }
-        resources += "  >>\n";
-    }
-    if(!used_fonts.empty() || !used_subset_fonts.empty()) {
-        resources += "  /Font <<\n";
-        for(const auto &i : used_fonts) {
-            std::format_to(resource_appender, "    /Font{} {} 0 R\n", i, i);
-        }
-        for(const auto &i : used_subset_fonts) {
-            const auto &bob = doc->get(i.fid);
-            std::format_to(resource_appender,
-                           "    /SFont{}-{} {} 0 R\n",
-                           bob.font_obj,
-                           i.subset_id,
-                           bob.font_obj);
-        }
-        resources += "  >>\n";
-    }
-    if(!used_colorspaces.empty() || uses_all_colorspace) {
-        resources += "  /ColorSpace <<\n";
-        if(uses_all_colorspace) {
-            std::format_to(resource_appender, "    /All {} 0 R\n", doc->separation_objects.at(0));
-        }
-        for(const auto &i : used_colorspaces) {
-            std::format_to(resource_appender, "    /CSpace{} {} 0 R\n", i, i);
+void PdfDrawContext::emit(DLOp op, std::span<const double> operands) {
+    if(!doc->opts.record_display_lists && !doc->opts.optimize_content) {
+        serialize_op(commands, ind, op, operands, doc->opts.number_precision);
+    } else {
+        if(!commands.empty()) {
+            display_list.add_raw(commands);
+            commands.clear();
         }
-        resources += "  >>\n";
+        display_list.add(op, (uint16_t)ind.size(), operands);
     }
-    if(!used_gstates.empty()) {
-        resources += "  /ExtGState <<\n";
-        for(const auto &s : used_gstates) {
-            std::format_to(resource_appender, "    /GS{} {} 0 R \n", s, s);
-        }
-        resources += "  >>\n";
+    maybe_cut_content_chunk();
+}
+
+void PdfDrawContext::maybe_cut_content_chunk() {
+    const auto chunk_size = doc->opts.content_chunk_size;
+    if(chunk_size == 0 || context_type != CAPY_DC_PAGE ||
+       (int64_t)(commands.size() + display_list.byte_size()) < chunk_size) {
+        return;
     }
-    if(!used_shadings.empty()) {
-        resources += "  /Shading <<\n";
-        for(const auto &s : used_shadings) {
-            std::format_to(resource_appender, "    /SH{} {} 0 R\n", s, s);
-        }
-        resources += "  >>\n";
+    finish_recording();
+    auto compressed = flate_compress(commands, doc->opts.compression.content_chunk_settings());
+    if(!compressed) {
+        // Keep the data, it will be written uncut.
+        return;
     }
-    if(!used_patterns.empty()) {
-        resources += "  /Pattern <<\n";
-        for(const auto &s : used_patterns) {
-            std::format_to(resource_appender, "    /Pattern-{} {} 0 R\n", s, s);
-        }
-        resources += "  >>\n";
+    content_chunks.emplace_back(ContentChunk{std::move(compressed.value()), commands.size()});
+    commands.clear();
+}
+
+void PdfDrawContext::finish_recording() {
+    if(display_list.empty()) {
+        return;
     }
-    if(!used_ocgs.empty()) {
-        resources += "  /Properties <<\n";
-        for(const auto &ocg : used_ocgs) {
-            auto objnum = doc->ocg_object_number(ocg);
-            std::format_to(resource_appender, "    /oc{} {} 0 R\n", objnum, objnum);
+    if(doc->opts.optimize_content) {
+        const auto removed = display_list.optimize();
+        if(doc->opts.write_stats) {
+            doc->write_stats.removed_operators += removed;
         }
-        resources += "  >>\n";
     }
-    resources += ">>\n";
-    return resources;
+    std::string serialized;
+    display_list.serialize(serialized, doc->opts.number_precision);
+    serialized += commands;
+    commands = std::move(serialized);
+    display_list.clear();
+}
+
+void PdfDrawContext::clear() {
+    commands.clear();
+    display_list.clear();
+    content_chunks.clear();
+    resources.clear();
+    used_widgets.clear();
+    used_annotations.clear();
+    used_structures.clear();
+    ind.clear();
+    sub_navigations.clear();
+    dstate_stack.clear();
+    transition.reset();
+    is_finalized = false;
+    marked_depth = 0;
+    custom_props = PageProperties{};
 }
 
 rvoe<NoReturnValue> PdfDrawContext::add_form_widget(CapyPDF_FormWidgetId widget) {
-    if(used_widgets.find(widget) != used_widgets.end()) {
+    if(!used_widgets.insert(widget)) {
         RETERR(AnnotationReuse);
     }
-    used_widgets.insert(widget);
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::annotate(CapyPDF_AnnotationId annotation) {
-    if(used_annotations.find(annotation) != used_annotations.end()) {
+    if(!used_annotations.insert(annotation)) {
         RETERR(AnnotationReuse);
     }
-    used_annotations.insert(annotation);
     RETOK;
 }
 
@@ -203,26 +414,22 @@ GstatePopper PdfDrawContext::push_gstate() {
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_b() {
-    commands += ind;
-    commands += "b\n";
+    emit(DLOp::b, {});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_B() {
-    commands += ind;
-    commands += "B\n";
+    emit(DLOp::B, {});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_bstar() {
-    commands += ind;
-    commands += "b*\n";
+    emit(DLOp::bstar, {});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_Bstar() {
-    commands += ind;
-    commands += "B*\n";
+    emit(DLOp::Bstar, {});
     RETOK;
 }
 
@@ -269,7 +476,7 @@ rvoe<NoReturnValue> PdfDrawContext::cmd_BDC(CapyPDF_StructureItemId sid) {
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_BDC(CapyPDF_OptionalContentGroupId ocgid) {
     ++marked_depth;
-    used_ocgs.insert(ocgid);
+    resources.ocgs.insert(ocgid);
     std::format_to(cmd_appender, "{}/OC /oc{} BDC\n", ind, doc->ocg_object_number(ocgid));
     ERCV(indent(DrawStateType::MarkedContent));
     RETOK;
@@ -287,15 +494,13 @@ rvoe<NoReturnValue> PdfDrawContext::cmd_BMC(std::string_view tag) {
 
 rvoe<NoReturnValue>
 PdfDrawContext::cmd_c(double x1, double y1, double x2, double y2, double x3, double y3) {
-    std::format_to(
-        cmd_appender, "{}{:f} {:f} {:f} {:f} {:f} {:f} c\n", ind, x1, y1, x2, y2, x3, y3);
+    emit(DLOp::c, {x1, y1, x2, y2, x3, y3});
     RETOK;
 }
 
 rvoe<NoReturnValue>
 PdfDrawContext::cmd_cm(double m1, double m2, double m3, double m4, double m5, double m6) {
-    std::format_to(
-        cmd_appender, "{}{:f} {:f} {:f} {:f} {:f} {:f} cm\n", ind, m1, m2, m3, m4, m5, m6);
+    emit(DLOp::cm, {m1, m2, m3, m4, m5, m6});
     RETOK;
 }
 
@@ -322,9 +527,9 @@ PdfDrawContext::cmd_d(double *dash_array, size_t dash_array_length, double phase
     commands += ind;
     commands += "[ ";
     for(size_t i = 0; i < dash_array_length; ++i) {
-        std::format_to(cmd_appender, "{:f} ", dash_array[i]);
+        std::format_to(cmd_appender, "{} ", num(dash_array[i]));
     }
-    std::format_to(cmd_appender, " ] {} d\n", phase);
+    std::format_to(cmd_appender, " ] {} d\n", num(phase));
     RETOK;
 }
 
@@ -334,7 +539,8 @@ rvoe<NoReturnValue> PdfDrawContext::cmd_Do(CapyPDF_FormXObjectId fxoid) {
     }
     CHECK_INDEXNESS(fxoid.id, doc->form_xobjects);
     std::format_to(cmd_appender, "{}/FXO{} Do\n", ind, doc->form_xobjects[fxoid.id].xobj_num);
-    used_form_xobjects.insert(doc->form_xobjects[fxoid.id].xobj_num);
+    resources.form_xobjects.insert(doc->form_xobjects[fxoid.id].xobj_num);
+    maybe_cut_content_chunk();
     RETOK;
 }
 
@@ -344,7 +550,8 @@ rvoe<NoReturnValue> PdfDrawContext::cmd_Do(CapyPDF_TransparencyGroupId trid) {
     }
     CHECK_INDEXNESS(trid.id, doc->transparency_groups);
     std::format_to(cmd_appender, "{}/TG{} Do\n", ind, doc->transparency_groups[trid.id]);
-    used_trgroups.insert(trid);
+    resources.trgroups.insert(trid);
+    maybe_cut_content_chunk();
     RETOK;
 }
 
@@ -360,35 +567,34 @@ rvoe<NoReturnValue> PdfDrawContext::cmd_EMC() {
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_f() {
-    commands += ind;
-    commands += "f\n";
+    emit(DLOp::f, {});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_fstar() {
-    commands += ind;
-    commands += "f*\n";
+    emit(DLOp::fstar, {});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_G(LimitDouble gray) {
-    return serialize_G(cmd_appender, ind, gray);
+    emit(DLOp::G, {gray.v()});
+    RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_g(LimitDouble gray) {
-    return serialize_g(cmd_appender, ind, gray);
+    emit(DLOp::g, {gray.v()});
+    RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_gs(CapyPDF_GraphicsStateId gid) {
     CHECK_INDEXNESS(gid.id, doc->document_objects);
-    used_gstates.insert(gid.id);
-    std::format_to(cmd_appender, "{}/GS{} gs\n", ind, gid.id);
+    resources.gstates.insert(gid.id);
+    emit(DLOp::gs, {(double)gid.id});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_h() {
-    commands += ind;
-    commands += "h\n";
+    emit(DLOp::h, {});
     RETOK;
 }
 
@@ -396,78 +602,118 @@ rvoe<NoReturnValue> PdfDrawContext::cmd_i(double flatness) {
     if(flatness < 0 || flatness > 100) {
         RETERR(InvalidFlatness);
     }
-    std::format_to(cmd_appender, "{}{:f} i\n", ind, flatness);
+    emit(DLOp::i, {flatness});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_j(CapyPDF_Line_Join join_style) {
     CHECK_ENUM(join_style, CAPY_LJ_BEVEL);
-    std::format_to(cmd_appender, "{}{} j\n", ind, (int)join_style);
+    emit(DLOp::j, {(double)join_style});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_J(CapyPDF_Line_Cap cap_style) {
     CHECK_ENUM(cap_style, CAPY_LC_PROJECTION);
-    std::format_to(cmd_appender, "{}{} J\n", ind, (int)cap_style);
+    emit(DLOp::J, {(double)cap_style});
     RETOK;
 }
 
 rvoe<NoReturnValue>
 PdfDrawContext::cmd_K(LimitDouble c, LimitDouble m, LimitDouble y, LimitDouble k) {
-    return serialize_K(cmd_appender, ind, c, m, y, k);
+    emit(DLOp::K, {c.v(), m.v(), y.v(), k.v()});
+    RETOK;
 }
 
 rvoe<NoReturnValue>
 PdfDrawContext::cmd_k(LimitDouble c, LimitDouble m, LimitDouble y, LimitDouble k) {
-    return serialize_k(cmd_appender, ind, c, m, y, k);
+    emit(DLOp::k, {c.v(), m.v(), y.v(), k.v()});
+    RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_l(double x, double y) {
-    std::format_to(cmd_appender, "{}{:f} {:f} l\n", ind, x, y);
+    emit(DLOp::l, {x, y});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_m(double x, double y) {
-    std::format_to(cmd_appender, "{}{:f} {:f} m\n", ind, x, y);
+    emit(DLOp::m, {x, y});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_M(double miterlimit) {
-    std::format_to(cmd_appender, "{}{:f} M\n", ind, miterlimit);
+    emit(DLOp::M, {miterlimit});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_n() {
-    commands += ind;
-    commands += "n\n";
+    emit(DLOp::n, {});
+    RETOK;
+}
+
+rvoe<NoReturnValue> PdfDrawContext::cmd_path(std::span<const uint8_t> ops,
+                                             std::span<const double> coords) {
+    // Validate everything first so that a failed call does not leave
+    // a partial path in the stream.
+    size_t num_coords = 0;
+    for(const auto op : ops) {
+        if(op >= path_op_infos.size()) {
+            RETERR(BadEnum);
+        }
+        num_coords += path_op_infos[op].num_operands;
+    }
+    if(num_coords != coords.size()) {
+        RETERR(PathOperandCountMismatch);
+    }
+    size_t offset = 0;
+    for(const auto op : ops) {
+        const auto &info = path_op_infos[op];
+        emit(info.op, coords.subspan(offset, info.num_operands));
+        offset += info.num_operands;
+    }
+    RETOK;
+}
+
+rvoe<NoReturnValue> PdfDrawContext::execute(std::span<const uint8_t> commands,
+                                            int32_t &failed_index) {
+    CommandReader reader(commands);
+    int32_t index = 0;
+    while(!reader.at_end()) {
+        auto rc = execute_command(*this, reader);
+        if(!rc) {
+            failed_index = index;
+            return rc;
+        }
+        ++index;
+    }
+    failed_index = -1;
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_q() {
-    commands += ind;
-    commands += "q\n";
+    emit(DLOp::q, {});
     ERCV(indent(DrawStateType::SaveState));
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_Q() {
     ERCV(dedent(DrawStateType::SaveState));
-    commands += ind;
-    commands += "Q\n";
+    emit(DLOp::Q, {});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_re(double x, double y, double w, double h) {
-    std::format_to(cmd_appender, "{}{:f} {:f} {:f} {:f} re\n", ind, x, y, w, h);
+    emit(DLOp::re, {x, y, w, h});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_RG(LimitDouble r, LimitDouble g, LimitDouble b) {
-    return serialize_RG(cmd_appender, ind, r, g, b);
+    emit(DLOp::RG, {r.v(), g.v(), b.v()});
+    RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_rg(LimitDouble r, LimitDouble g, LimitDouble b) {
-    return serialize_rg(cmd_appender, ind, r, g, b);
+    emit(DLOp::rg, {r.v(), g.v(), b.v()});
+    RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_ri(CapyPDF_Rendering_Intent ri) {
@@ -477,31 +723,30 @@ rvoe<NoReturnValue> PdfDrawContext::cmd_ri(CapyPDF_Rendering_Intent ri) {
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_s() {
-    commands += ind;
-    commands += "s\n";
+    emit(DLOp::s, {});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_S() {
-    commands += ind;
-    commands += "S\n";
+    emit(DLOp::S, {});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_SCN(double value) {
-    std::format_to(cmd_appender, "{}{:f} SCN\n", ind, value);
+    emit(DLOp::SCN, {value});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_scn(double value) {
-    std::format_to(cmd_appender, "{}{:f} scn\n", ind, value);
+    emit(DLOp::scn, {value});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_sh(CapyPDF_ShadingId shid) {
     CHECK_INDEXNESS(shid.id, doc->document_objects);
-    used_shadings.insert(shid.id);
+    resources.shadings.insert(shid.id);
     std::format_to(cmd_appender, "{}/SH{} sh\n", ind, shid.id);
+    maybe_cut_content_chunk();
     RETOK;
 }
 
@@ -512,7 +757,7 @@ rvoe<NoReturnValue> PdfDrawContext::cmd_Tr(CapyPDF_Text_Mode mode) {
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_v(double x2, double y2, double x3, double y3) {
-    std::format_to(cmd_appender, "{}{:f} {:f} {:f} {:f} v\n", ind, x2, y2, x3, y3);
+    emit(DLOp::v, {x2, y2, x3, y3});
     RETOK;
 }
 
@@ -520,38 +765,36 @@ rvoe<NoReturnValue> PdfDrawContext::cmd_w(double w) {
     if(w < 0) {
         RETERR(NegativeLineWidth);
     }
-    std::format_to(cmd_appender, "{}{:f} w\n", ind, w);
+    emit(DLOp::w, {w});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_W() {
-    commands += ind;
-    commands += "W\n";
+    emit(DLOp::W, {});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_Wstar() {
-    commands += ind;
-    commands += "W*\n";
+    emit(DLOp::Wstar, {});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::cmd_y(double x1, double y1, double x3, double y3) {
-    std::format_to(cmd_appender, "{}{:f} {:f} {:f} {:f} y\n", ind, x1, y1, x3, y3);
+    emit(DLOp::y, {x1, y1, x3, y3});
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::serialize_G(std::back_insert_iterator<std::string> &out,
                                                 std::string_view indent,
                                                 LimitDouble gray) const {
-    std::format_to(out, "{}{:f} G\n", indent, gray.v());
+    std::format_to(out, "{}{} G\n", indent, num(gray.v()));
     RETOK;
 }
 
 rvoe<NoReturnValue> PdfDrawContext::serialize_g(std::back_insert_iterator<std::string> &out,
                                                 std::string_view indent,
                                                 LimitDouble gray) const {
-    std::format_to(out, "{}{:f} g\n", indent, gray.v());
+    std::format_to(out, "{}{} g\n", indent, num(gray.v()));
     RETOK;
 }
 
@@ -561,7 +804,7 @@ rvoe<NoReturnValue> PdfDrawContext::serialize_K(std::back_insert_iterator<std::s
                                                 LimitDouble m,
                                                 LimitDouble y,
                                                 LimitDouble k) const {
-    std::format_to(out, "{}{:f} {:f} {:f} {:f} K\n", ind, c.v(), m.v(), y.v(), k.v());
+    std::format_to(out, "{}{} {} {} {} K\n", ind, num(c.v()), num(m.v()), num(y.v()), num(k.v()));
     RETOK;
 }
 
@@ -571,7 +814,7 @@ rvoe<NoReturnValue> PdfDrawContext::serialize_k(std::back_insert_iterator<std::s
                                                 LimitDouble m,
                                                 LimitDouble y,
                                                 LimitDouble k) const {
-    std::format_to(out, "{}{:f} {:f} {:f} {:f} k\n", ind, c.v(), m.v(), y.v(), k.v());
+    std::format_to(out, "{}{} {} {} {} k\n", ind, num(c.v()), num(m.v()), num(y.v()), num(k.v()));
     RETOK;
 }
 
@@ -580,7 +823,7 @@ rvoe<NoReturnValue> PdfDrawContext::serialize_RG(std::back_insert_iterator<std::
                                                  LimitDouble r,
                                                  LimitDouble g,
                                                  LimitDouble b) const {
-    std::format_to(out, "{}{:f} {:f} {:f} RG\n", indent, r.v(), g.v(), b.v());
+    std::format_to(out, "{}{} {} {} RG\n", indent, num(r.v()), num(g.v()), num(b.v()));
     RETOK;
 }
 
@@ -589,7 +832,7 @@ rvoe<NoReturnValue> PdfDrawContext::serialize_rg(std::back_insert_iterator<std::
                                                  LimitDouble r,
                                                  LimitDouble g,
                                                  LimitDouble b) const {
-    std::format_to(out, "{}{:f} {:f} {:f} rg\n", indent, r.v(), g.v(), b.v());
+    std::format_to(out, "{}{} {} {} rg\n", indent, num(r.v()), num(g.v()), num(b.v()));
     RETOK;
 }
 
@@ -682,11 +925,11 @@ rvoe<NoReturnValue> PdfDrawContext::set_color(const ICCColor &icc, bool stroke)
     if(icc_info.num_channels != (int32_t)icc.values.size()) {
         RETERR(IncorrectColorChannelCount);
     }
-    used_colorspaces.insert(icc_info.object_num);
+    resources.colorspaces.insert(icc_info.object_num);
     std::format_to(
         cmd_appender, "{}/CSpace{} {}\n", ind, icc_info.object_num, stroke ? "CS" : "cs");
     for(const auto &i : icc.values) {
-        std::format_to(cmd_appender, "{:f} ", i);
+        std::format_to(cmd_appender, "{} ", num(i));
     }
     std::format_to(cmd_appender, "{}\n", stroke ? "SCN" : "scn");
     RETOK;
@@ -707,7 +950,7 @@ rvoe<NoReturnValue> PdfDrawContext::set_color(CapyPDF_PatternId id, bool stroke)
         RETERR(PatternNotAccepted);
     }
     ERCV(cmd_cs("/Pattern"));
-    used_patterns.insert(id.id);
+    resources.patterns.insert(id.id);
     std::format_to(cmd_appender, "{}/Pattern-{} {}\n", ind, id.id, stroke ? "SCN" : "scn");
     RETOK;
 }
@@ -715,7 +958,7 @@ rvoe<NoReturnValue> PdfDrawContext::set_color(CapyPDF_PatternId id, bool stroke)
 rvoe<NoReturnValue> PdfDrawContext::set_color(const SeparationColor &color, bool stroke) {
     CHECK_INDEXNESS(color.id.id, doc->separation_objects);
     const auto idnum = doc->separation_object_number(color.id);
-    used_colorspaces.insert(idnum);
+    resources.colorspaces.insert(idnum);
     std::string csname = std::format("/CSpace{}", idnum);
     if(stroke) {
         cmd_CS(csname);
@@ -729,7 +972,7 @@ rvoe<NoReturnValue> PdfDrawContext::set_color(const SeparationColor &color, bool
 
 rvoe<NoReturnValue> PdfDrawContext::set_color(const LabColor &c, bool stroke) {
     CHECK_INDEXNESS(c.id.id, doc->document_objects);
-    used_colorspaces.insert(c.id.id);
+    resources.colorspaces.insert(c.id.id);
     std::string csname = std::format("/CSpace{}", c.id.id);
     if(stroke) {
         cmd_CS(csname);
@@ -737,12 +980,12 @@ rvoe<NoReturnValue> PdfDrawContext::set_color(const LabColor &c, bool stroke) {
         cmd_cs(csname);
     }
     std::format_to(
-        cmd_appender, "{}{:f} {:f} {:f} {}\n", ind, c.l, c.a, c.b, stroke ? "SCN" : "scn");
+        cmd_appender, "{}{} {} {} {}\n", ind, num(c.l), num(c.a), num(c.b), stroke ? "SCN" : "scn");
     RETOK;
 }
 
 void PdfDrawContext::set_all_stroke_color() {
-    uses_all_colorspace = true;
+    resources.all_colorspace = true;
     cmd_CS("/All");
     cmd_SCN(1.0);
 }
@@ -750,8 +993,9 @@ void PdfDrawContext::set_all_stroke_color() {
 rvoe<NoReturnValue> PdfDrawContext::draw_image(CapyPDF_ImageId im_id) {
     CHECK_INDEXNESS(im_id.id, doc->image_info);
     auto obj_num = doc->image_object_number(im_id);
-    used_images.insert(obj_num);
+    resources.images.insert(obj_num);
     std::format_to(cmd_appender, "{}/Image{} Do\n", ind, obj_num);
+    maybe_cut_content_chunk();
     RETOK;
 }
 
@@ -778,48 +1022,77 @@ rvoe<NoReturnValue> PdfDrawContext::serialize_charsequence(const TextEvents &cha
                                                            int32_t &current_subset,
                                                            double &current_pointsize) {
     std::back_insert_iterator<std::string> app = std::back_inserter(serialisation);
+    // In compact mode array elements are only separated where two numbers would merge.
+    const bool compact = doc->opts.compact_content;
+    const char *array_start = compact ? "[" : "[ ";
+    const char *array_end = compact ? "]TJ\n" : "] TJ\n";
     bool is_first = true;
-    auto appender_lambda =
-        [this, &serialisation, &is_first, &app, &current_font, &current_subset, &current_pointsize](
-            const SubsetGlyph &current_subset_glyph) {
-            used_subset_fonts.insert(current_subset_glyph.ss);
-            if(current_subset_glyph.ss.subset_id != current_subset) {
-                if(!is_first) {
-                    serialisation += "] TJ\n";
-                }
-                std::format_to(app,
-                               "{}/SFont{}-{} {} Tf\n{}[ ",
-                               ind,
-                               doc->get(current_subset_glyph.ss.fid).font_obj,
-                               current_subset_glyph.ss.subset_id,
-                               current_pointsize,
-                               ind);
-            } else {
-                if(is_first) {
-                    serialisation += ind;
-                    serialisation += "[ ";
-                }
+    bool after_number = false;
+    auto appender_lambda = [this,
+                            &serialisation,
+                            &is_first,
+                            &after_number,
+                            &app,
+                            &current_font,
+                            &current_subset,
+                            &current_pointsize,
+                            compact,
+                            array_start,
+                            array_end](const SubsetGlyph &current_subset_glyph) {
+        resources.subset_fonts.insert(current_subset_glyph.ss);
+        if(current_subset_glyph.ss.subset_id != current_subset) {
+            if(!is_first) {
+                serialisation += array_end;
             }
-            current_font = current_subset_glyph.ss.fid;
-            current_subset = current_subset_glyph.ss.subset_id;
-            std::format_to(app, "<{:02x}> ", current_subset_glyph.glyph_id);
-        };
+            std::format_to(app,
+                           "{}/SFont{}-{} {} Tf\n{}{}",
+                           ind,
+                           doc->get(current_subset_glyph.ss.fid).font_obj,
+                           current_subset_glyph.ss.subset_id,
+                           num(current_pointsize),
+                           ind,
+                           array_start);
+        } else {
+            if(is_first) {
+                serialisation += ind;
+                serialisation += array_start;
+            }
+        }
+        current_font = current_subset_glyph.ss.fid;
+        current_subset = current_subset_glyph.ss.subset_id;
+        format_glyph_code(app,
+                          current_subset_glyph.glyph_id,
+                          doc->has_two_byte_codes(current_subset_glyph.ss.fid));
+        if(!compact) {
+            serialisation += ' ';
+        }
+        after_number = false;
+    };
     for(const auto &e : charseq) {
         if(auto kval = std::get_if<KerningValue>(&e)) {
             if(is_first) {
                 serialisation += ind;
-                serialisation += "[ ";
+                serialisation += array_start;
+            } else if(compact && after_number) {
+                serialisation += ' ';
+            }
+            std::format_to(app, "{}", kval->v);
+            if(!compact) {
+                serialisation += ' ';
             }
-            std::format_to(app, "{} ", kval->v);
+            after_number = true;
         } else if(auto uglyph = std::get_if<UnicodeCharacter>(&e)) {
             const auto codepoint = uglyph->codepoint;
             ERC(current_subset_glyph, doc->get_subset_glyph(current_font, codepoint, {}));
             appender_lambda(current_subset_glyph);
         } else if(auto actualtext = std::get_if<ActualTextStart>(&e)) {
             auto u16 = utf8_to_pdfutf16be(actualtext->text);
-            std::format_to(app, "] TJ\n{}/Span << /ActualText {} >> BDC\n{}[", ind, u16, ind);
+            std::format_to(
+                app, "{}{}/Span << /ActualText {} >> BDC\n{}[", array_end, ind, u16, ind);
+            after_number = false;
         } else if(std::holds_alternative<ActualTextEnd>(e)) {
-            std::format_to(app, "] TJ\n{}EMC\n{}[", ind, ind);
+            std::format_to(app, "{}{}EMC\n{}[", array_end, ind, ind);
+            after_number = false;
         } else if(auto glyphitem = std::get_if<GlyphItem>(&e)) {
             ERC(current_subset_glyph,
                 doc->get_subset_glyph(
@@ -836,7 +1109,7 @@ rvoe<NoReturnValue> PdfDrawContext::serialize_charsequence(const TextEvents &cha
         }
         is_first = false;
     }
-    serialisation += "] TJ\n";
+    serialisation += array_end;
     return NoReturnValue{};
 }
 
@@ -852,31 +1125,17 @@ rvoe<NoReturnValue> PdfDrawContext::utf8_to_kerned_chars(const u8string &text,
         RETERR(BuiltinFontNotSupported);
     }
 
-    uint32_t previous_codepoint = -1;
-    // Freetype does not support GPOS kerning because it is context-sensitive.
-    // So this method might produce incorrect kerning. Users that need precision
-    // need to use the glyph based rendering method.
-    const bool has_kerning = FT_HAS_KERNING(face);
-    for(const auto &codepoint : text) {
-        if(has_kerning && previous_codepoint != (uint32_t)-1) {
-            FT_Vector kerning;
-            const auto index_left = FT_Get_Char_Index(face, previous_codepoint);
-            const auto index_right = FT_Get_Char_Index(face, codepoint);
-            auto ec = FT_Get_Kerning(face, index_left, index_right, FT_KERNING_DEFAULT, &kerning);
-            if(ec != 0) {
-                RETERR(FreeTypeError);
+    const double units_per_em = face->units_per_EM;
+    return doc->for_each_kerned_char(
+        fid, text, [&](uint32_t codepoint, const GlyphMetrics &, int32_t kerning) {
+            if(kerning != 0) {
+                // Text space units are thousandths of an em and
+                // positive values move the next glyph left.
+                const auto adjustment = std::lround(-kerning * 1000.0 / units_per_em);
+                charseq.emplace_back(KerningValue{(int32_t)adjustment});
             }
-            if(kerning.x != 0) {
-                // The value might be a integer, fraction or something else.
-                // None of the fonts I tested had kerning that Freetype recognized,
-                // so don't know if this actually works.
-                charseq.emplace_back(KerningValue{(int32_t)kerning.x});
-            }
-        }
-        charseq.emplace_back(UnicodeCharacter{codepoint});
-        previous_codepoint = codepoint;
-    }
-    RETOK;
+            charseq.emplace_back(UnicodeCharacter{codepoint});
+        });
 }
 
 rvoe<NoReturnValue> PdfDrawContext::render_text(const PdfText &textobj) {
@@ -898,17 +1157,17 @@ rvoe<NoReturnValue> PdfDrawContext::render_text(const PdfText &textobj) {
         },
 
         [&](const Tc_arg &tc) -> rvoe<NoReturnValue> {
-            std::format_to(app, "{}{} Tc\n", ind, tc.val);
+            std::format_to(app, "{}{} Tc\n", ind, num(tc.val));
             return NoReturnValue{};
         },
 
         [&](const Td_arg &td) -> rvoe<NoReturnValue> {
-            std::format_to(app, "{}{:f} {:f} Td\n", ind, td.tx, td.ty);
+            std::format_to(app, "{}{} {} Td\n", ind, num(td.tx), num(td.ty));
             return NoReturnValue{};
         },
 
         [&](const TD_arg &tD) -> rvoe<NoReturnValue> {
-            std::format_to(app, "{}{:f} {:f} TD\n", ind, tD.tx, tD.ty);
+            std::format_to(app, "{}{} {} TD\n", ind, num(tD.tx), num(tD.ty));
             return NoReturnValue{};
         },
 
@@ -937,20 +1196,20 @@ rvoe<NoReturnValue> PdfDrawContext::render_text(const PdfText &textobj) {
         },
 
         [&](const TL_arg &tL) -> rvoe<NoReturnValue> {
-            std::format_to(app, "{}{:f} TL\n", ind, tL.leading);
+            std::format_to(app, "{}{} TL\n", ind, num(tL.leading));
             return NoReturnValue{};
         },
 
         [&](const Tm_arg &tm) -> rvoe<NoReturnValue> {
             std::format_to(app,
-                           "{}{:f} {:f} {:f} {:f} {:f} {:f} Tm\n",
+                           "{}{} {} {} {} {} {} Tm\n",
                            ind,
-                           tm.a,
-                           tm.b,
-                           tm.c,
-                           tm.d,
-                           tm.e,
-                           tm.f);
+                           num(tm.a),
+                           num(tm.b),
+                           num(tm.c),
+                           num(tm.d),
+                           num(tm.e),
+                           num(tm.f));
             return NoReturnValue{};
         },
 
@@ -960,17 +1219,17 @@ rvoe<NoReturnValue> PdfDrawContext::render_text(const PdfText &textobj) {
         },
 
         [&](const Ts_arg &ts) -> rvoe<NoReturnValue> {
-            std::format_to(app, "{}{:f} Ts\n", ind, ts.rise);
+            std::format_to(app, "{}{} Ts\n", ind, num(ts.rise));
             return NoReturnValue{};
         },
 
         [&](const Tw_arg &tw) -> rvoe<NoReturnValue> {
-            std::format_to(app, "{}{:f} Tw\n", ind, tw.width);
+            std::format_to(app, "{}{} Tw\n", ind, num(tw.width));
             return NoReturnValue{};
         },
 
         [&](const Tz_arg &tz) -> rvoe<NoReturnValue> {
-            std::format_to(app, "{}{:f} Tz\n", ind, tz.scaling);
+            std::format_to(app, "{}{} Tz\n", ind, num(tz.scaling));
             return NoReturnValue{};
         },
 
@@ -1036,33 +1295,36 @@ rvoe<NoReturnValue> PdfDrawContext::render_text(const PdfText &textobj) {
     serialisation += ind;
     serialisation += "ET\n";
     commands += serialisation;
+    maybe_cut_content_chunk();
     RETOK;
 }
 
 void PdfDrawContext::render_raw_glyph(
     uint32_t glyph, CapyPDF_FontId fid, double pointsize, double x, double y) {
     auto &font_data = doc->get(fid);
-    // used_fonts.insert(font_data.font_obj);
+    // resources.fonts.insert(font_data.font_obj);
 
     const auto font_glyph_id = doc->glyph_for_codepoint(
         doc->fonts.at(font_data.font_index_tmp).fontdata.face.get(), glyph);
+    const auto inner = inner_indent();
     std::format_to(cmd_appender,
                    R"({}BT
-{}  /Font{} {} Tf
-{}  {:f} {:f} Td
-{}  (\{:o}) Tj
+{}/Font{} {} Tf
+{}{} {} Td
+{}(\{:o}) Tj
 {}ET
 )",
                    ind,
-                   ind,
+                   inner,
                    font_data.font_obj,
-                   pointsize,
-                   ind,
-                   x,
-                   y,
-                   ind,
+                   num(pointsize),
+                   inner,
+                   num(x),
+                   num(y),
+                   inner,
                    font_glyph_id,
                    ind);
+    maybe_cut_content_chunk();
 }
 
 rvoe<NoReturnValue> PdfDrawContext::render_glyphs(const std::vector<PdfGlyph> &glyphs,
@@ -1075,30 +1337,35 @@ rvoe<NoReturnValue> PdfDrawContext::render_glyphs(const std::vector<PdfGlyph> &g
         RETOK;
     }
     auto &font_data = doc->get(fid);
+    const bool two_byte_codes = doc->has_two_byte_codes(fid);
     // FIXME, do per character.
     // const auto &bob =
     //    doc->font_objects.at(doc->get_subset_glyph(fid,
     //    glyphs.front().codepoint).ss.fid.id);
+    const auto inner = inner_indent();
     std::format_to(cmd_appender,
                    R"({}BT
-{}  /SFont{}-{} {:f} Tf
+{}/SFont{}-{} {} Tf
 )",
                    ind,
-                   ind,
+                   inner,
                    font_data.font_obj,
                    0,
-                   pointsize);
+                   num(pointsize));
     for(const auto &g : glyphs) {
         ERC(current_subset_glyph, doc->get_subset_glyph(fid, g.codepoint, {}));
         // const auto &bob = doc->font_objects.at(current_subset_glyph.ss.fid.id);
-        used_subset_fonts.insert(current_subset_glyph.ss);
-        std::format_to(cmd_appender, "  {:f} {:f} Td\n", g.x - prev_x, g.y - prev_y);
+        resources.subset_fonts.insert(current_subset_glyph.ss);
+        std::format_to(
+            cmd_appender, "{}{} {} Td\n", inner, num(g.x - prev_x), num(g.y - prev_y));
         prev_x = g.x;
         prev_y = g.y;
-        std::format_to(
-            cmd_appender, "  <{:02x}> Tj\n", (unsigned char)current_subset_glyph.glyph_id);
+        commands += inner;
+        format_glyph_code(cmd_appender, current_subset_glyph.glyph_id, two_byte_codes);
+        commands += " Tj\n";
     }
     std::format_to(cmd_appender, "{}ET\n", ind);
+    maybe_cut_content_chunk();
     RETOK;
 }
 
@@ -1111,24 +1378,26 @@ rvoe<NoReturnValue> PdfDrawContext::render_pdfdoc_text_builtin(const char *pdfdo
         RETERR(BadOperationForIntent);
     }
     auto font_object = doc->font_object_number(doc->get_builtin_font_id(font_id));
-    used_fonts.insert(font_object);
+    resources.fonts.insert(font_object);
+    const auto inner = inner_indent();
     std::format_to(cmd_appender,
                    R"({}BT
-{}  /Font{} {} Tf
-{}  {:f} {:f} Td
-{}  {} Tj
+{}/Font{} {} Tf
+{}{} {} Td
+{}{} Tj
 {}ET
 )",
                    ind,
-                   ind,
+                   inner,
                    font_object,
-                   pointsize,
-                   ind,
-                   x,
-                   y,
-                   ind,
+                   num(pointsize),
+                   inner,
+                   num(x),
+                   num(y),
+                   inner,
                    pdfstring_quote(pdfdoc_encoded_text),
                    ind);
+    maybe_cut_content_chunk();
     RETOK;
 }
 
@@ -1161,7 +1430,7 @@ PdfDrawContext::add_simple_navigation(std::span<const CapyPDF_OptionalContentGro
         std::abort();
     }
     for(const auto &sn : navs) {
-        if(used_ocgs.find(sn) == used_ocgs.end()) {
+        if(!resources.ocgs.contains(sn)) {
             RETERR(UnusedOcg);
         }
     }
@@ -8,9 +8,9 @@
 #include <errorhandling.hpp>
 #include <colorconverter.hpp>
 #include <document.hpp>
+#include <displaylist.hpp>
 #include <string>
 #include <string_view>
-#include <unordered_set>
 #include <vector>
 #include <optional>
 #include <span>
@@ -43,8 +43,9 @@ struct GstatePopper {
 };
 
 struct SerializedBasicContext {
-    std::string resource_dict;
     std::string unclosed_object_dict;
+    // Parts of the content stream that come before command_stream.
+    std::vector<ContentChunk> content_chunks;
     std::string command_stream;
 };
 
@@ -122,6 +123,12 @@ public:
     rvoe<NoReturnValue> cmd_m(double x, double y);
     rvoe<NoReturnValue> cmd_M(double miterlimit);
     rvoe<NoReturnValue> cmd_n();
+    // Constructs a path in one call. Coordinates holds the operands of
+    // all operators back to back.
+    rvoe<NoReturnValue> cmd_path(std::span<const uint8_t> ops, std::span<const double> coords);
+    // Runs a buffer of CapyPDF_Command records. On failure failed_index
+    // is the index of the failing record, otherwise -1.
+    rvoe<NoReturnValue> execute(std::span<const uint8_t> commands, int32_t &failed_index);
     rvoe<NoReturnValue> cmd_q(); // Save
     rvoe<NoReturnValue> cmd_Q(); // Restore
     rvoe<NoReturnValue> cmd_re(double x, double y, double w, double h);
@@ -203,7 +210,9 @@ public:
     void draw_unit_circle();
     void draw_unit_box();
 
+    // Resets the context to its initial state but keeps the allocated buffers.
     void clear();
+    void reserve_content(size_t size) { commands.reserve(size); }
 
     rvoe<NoReturnValue> add_form_widget(CapyPDF_FormWidgetId widget);
     rvoe<NoReturnValue> annotate(CapyPDF_AnnotationId annotation);
@@ -211,16 +220,17 @@ public:
     CapyPDF_Draw_Context_Type draw_context_type() const { return context_type; }
     PdfDocument &get_doc() { return *doc; }
 
-    std::string build_resource_dict();
-    std::string_view get_command_stream() { return commands; }
+    std::string build_resource_dict() { return doc->build_resource_dict(resources); }
+    const ResourceUsage &get_resource_usage() const { return resources; }
+    std::string_view get_command_stream();
 
     double get_w() const { return bbox.x2 - bbox.x1; }
     double get_h() const { return bbox.y2 - bbox.y1; }
 
     int32_t marked_content_depth() const { return marked_depth; }
 
-    const std::unordered_set<CapyPDF_FormWidgetId> &get_form_usage() const { return used_widgets; }
-    const std::unordered_set<CapyPDF_AnnotationId> &get_annotation_usage() const {
+    const FlatSet<CapyPDF_FormWidgetId> &get_form_usage() const { return used_widgets; }
+    const FlatSet<CapyPDF_AnnotationId> &get_annotation_usage() const {
         return used_annotations;
     }
     const std::vector<CapyPDF_StructureItemId> &get_structure_usage() const {
@@ -262,7 +272,9 @@ private:
             }
         }
         dstate_stack.push_back(dtype);
-        ind += "  ";
+        if(!doc->opts.compact_content) {
+            ind += "  ";
+        }
         return NoReturnValue{};
     }
 
@@ -273,35 +285,49 @@ private:
         if(dstate_stack.back() != dtype) {
             RETERR(DrawStateEndMismatch);
         }
-        if(ind.size() < 2) {
-            std::abort();
-        }
         dstate_stack.pop_back();
-        ind.pop_back();
-        ind.pop_back();
+        if(!doc->opts.compact_content) {
+            if(ind.size() < 2) {
+                std::abort();
+            }
+            ind.pop_back();
+            ind.pop_back();
+        }
         return NoReturnValue{};
     }
 
+    // Indentation of the contents of a block that is written in one go.
+    std::string inner_indent() const { return doc->opts.compact_content ? ind : ind + "  "; }
+
     rvoe<int32_t> add_bcd_structure(CapyPDF_StructureItemId sid);
 
+    PdfNumber num(double value) const { return PdfNumber{value, doc->opts.number_precision}; }
+
+    // Records the operator or writes it out immediately, depending on the document settings.
+    void emit(DLOp op, std::initializer_list<double> operands) {
+        emit(op, std::span<const double>{operands.begin(), operands.size()});
+    }
+    void emit(DLOp op, std::span<const double> operands);
+    // Converts the recorded display list to PDF syntax.
+    void finish_recording();
+    // Compresses the content so far into a chunk if it has grown too big.
+    // Called after every painting operator, so state setting operators
+    // never grow the content unchecked for long.
+    void maybe_cut_content_chunk();
+
     PdfDocument *doc;
     PdfColorConverter *cm;
     CapyPDF_Draw_Context_Type context_type;
+    // When recording, operators without a display list
+    // representation are formatted here until the next record.
     std::string commands;
     std::back_insert_iterator<std::string> cmd_appender;
-    std::unordered_set<int32_t> used_images;
-    std::unordered_set<FontSubset> used_subset_fonts;
-    std::unordered_set<int32_t> used_fonts;
-    std::unordered_set<int32_t> used_colorspaces;
-    std::unordered_set<int32_t> used_gstates;
-    std::unordered_set<int32_t> used_shadings;
-    std::unordered_set<int32_t> used_patterns;
-    std::unordered_set<int32_t> used_form_xobjects;
-    std::unordered_set<CapyPDF_FormWidgetId> used_widgets;
-    std::unordered_set<CapyPDF_AnnotationId> used_annotations;
+    DisplayList display_list;
+    std::vector<ContentChunk> content_chunks;
+    ResourceUsage resources;
+    FlatSet<CapyPDF_FormWidgetId> used_widgets;
+    FlatSet<CapyPDF_AnnotationId> used_annotations;
     std::vector<CapyPDF_StructureItemId> used_structures; // A vector because numbering is relevant.
-    std::unordered_set<CapyPDF_OptionalContentGroupId> used_ocgs;
-    std::unordered_set<CapyPDF_TransparencyGroupId> used_trgroups;
     std::vector<SubPageNavigation> sub_navigations;
 
     // Not a std::stack because we need to access all entries.
@@ -311,7 +337,6 @@ private:
     PageProperties custom_props;
     // Reminder: If you add stuff here, also add them to .clear().
     bool is_finalized = false;
-    bool uses_all_colorspace = false;
     PdfRectangle bbox;
     int32_t marked_depth = 0;
     std::string ind;
@@ -75,6 +75,15 @@ const std::array<const char *, (std::size_t)ErrorCode::NumErrors> error_texts{
 "Page reference points to a non-existing page.",
 "Title is empty.",
 "Transparency properties can only be set on pages and transparency groups.",
+"Thread count must not be negative.",
+"Streaming mode can only write to the output file.",
+"Compression level must be between 0 and 9.",
+"Write queue limits must not be negative.",
+"Number precision must be between 0 and 10.",
+"Path coordinate count does not match the path operators.",
+"Command buffer ends in the middle of a command.",
+"Content chunk size must not be negative.",
+"Write queue requires streaming pages.",
 };
 
 // clang-format on
@@ -73,6 +73,15 @@ enum class ErrorCode : int32_t {
     InvalidPageNumber,
     EmptyTitle,
     WrongDCForTransp,
+    NegativeThreadCount,
+    StreamingOutputIsFile,
+    InvalidCompressionLevel,
+    InvalidWriteQueueSize,
+    InvalidNumberPrecision,
+    PathOperandCountMismatch,
+    CommandBufferTruncated,
+    InvalidContentChunkSize,
+    WriteQueueWithoutStreaming,
     // When you add an error code here, also add the string representation in the .cpp file.
     NumErrors,
 };
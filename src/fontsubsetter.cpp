@@ -17,12 +17,6 @@ namespace {
 
 const uint32_t SPACE = ' ';
 
-FontSubsetData create_startstate() {
-    std::vector<TTGlyphs> start_state{RegularGlyph{0}};
-    std::unordered_map<uint32_t, uint32_t> start_mapping{};
-    return FontSubsetData{std::move(start_state), std::move(start_mapping)};
-}
-
 rvoe<NoReturnValue> add_subglyphs(std::unordered_set<uint32_t> &new_subglyphs,
                                   uint32_t glyph_id,
                                   const TrueTypeFontFile &ttfile) {
@@ -50,11 +44,31 @@ rvoe<std::vector<uint32_t>> get_all_subglyphs(uint32_t glyph_id, const TrueTypeF
 
 } // namespace
 
-rvoe<FontSubsetter> FontSubsetter::construct(const std::filesystem::path &fontfile, FT_Face face) {
+rvoe<FontSubsetter> FontSubsetter::construct(const std::filesystem::path &fontfile,
+                                             FT_Face face,
+                                             std::size_t max_subset_glyphs) {
     ERC(ttfile, load_and_parse_truetype_font(fontfile));
-    std::vector<FontSubsetData> subsets;
-    subsets.emplace_back(create_startstate());
-    return FontSubsetter(std::move(ttfile), face, std::move(subsets));
+    return FontSubsetter(std::move(ttfile), face, max_subset_glyphs);
+}
+
+void FontSubsetter::add_subset() {
+    subsets.emplace_back();
+    append_glyph(RegularGlyph{0});
+}
+
+void FontSubsetter::append_glyph(TTGlyphs glyph) {
+    auto &glyphs = subsets.back().glyphs;
+    index_glyph(glyph, FontSubsetInfo{int32_t(subsets.size() - 1), int32_t(glyphs.size())});
+    glyphs.emplace_back(std::move(glyph));
+}
+
+void FontSubsetter::index_glyph(const TTGlyphs &glyph, FontSubsetInfo location) {
+    // Lookups return the earliest location, so existing entries are never replaced.
+    if(const auto *rg = std::get_if<RegularGlyph>(&glyph)) {
+        codepoint_index.try_emplace(rg->unicode_codepoint, location);
+    } else if(const auto *lg = std::get_if<LigatureGlyph>(&glyph)) {
+        ligature_index.try_emplace(std::string{lg->text.sv()}, location);
+    }
 }
 
 rvoe<FontSubsetInfo> FontSubsetter::get_glyph_subset(uint32_t codepoint,
@@ -79,8 +93,8 @@ rvoe<FontSubsetInfo> FontSubsetter::get_glyph_subset(const u8string &text,
 rvoe<FontSubsetInfo>
 FontSubsetter::unchecked_insert_glyph_to_last_subset(const uint32_t codepoint,
                                                      const std::optional<uint32_t> glyph_id) {
-    if(subsets.back().glyphs.size() == max_glyphs) {
-        subsets.emplace_back(create_startstate());
+    if(subsets.back().glyphs.size() == max_subset_glyphs) {
+        add_subset();
     }
     const uint32_t glyph_index = glyph_id ? glyph_id.value() : FT_Get_Char_Index(face, codepoint);
     if(glyph_index == 0) {
@@ -91,7 +105,7 @@ FontSubsetter::unchecked_insert_glyph_to_last_subset(const uint32_t codepoint,
         // Every subset font _must_ have the space character in
         // location 32.
         if(subsets.back().glyphs.size() == SPACE) {
-            subsets.back().glyphs.push_back(RegularGlyph{codepoint, glyph_index});
+            append_glyph(RegularGlyph{codepoint, glyph_index});
             subsets.back().font_index_mapping[glyph_index] =
                 (uint32_t)subsets.back().glyphs.size() - 1;
         }
@@ -101,10 +115,10 @@ FontSubsetter::unchecked_insert_glyph_to_last_subset(const uint32_t codepoint,
     if(subsets.back().glyphs.size() == SPACE) {
         // NOTE: the case where the subset font has fewer than 32 characters
         // is handled when serializing the font.
-        subsets.back().glyphs.emplace_back(RegularGlyph{SPACE, FT_Get_Char_Index(face, SPACE)});
+        append_glyph(RegularGlyph{SPACE, FT_Get_Char_Index(face, SPACE)});
         subsets.back().font_index_mapping[glyph_index] = SPACE;
     }
-    subsets.back().glyphs.push_back(RegularGlyph{codepoint, glyph_index});
+    append_glyph(RegularGlyph{codepoint, glyph_index});
     subsets.back().font_index_mapping[glyph_index] = (uint32_t)subsets.back().glyphs.size() - 1;
     return FontSubsetInfo{int32_t(subsets.size() - 1), int32_t(subsets.back().glyphs.size() - 1)};
 }
@@ -116,7 +130,7 @@ rvoe<NoReturnValue> FontSubsetter::handle_subglyphs(uint32_t glyph_index) {
     ERC(iscomp, is_composite_glyph(ttfile.glyphs.at(glyph_index)));
     if(iscomp) {
         ERC(subglyphs, get_all_subglyphs(glyph_index, ttfile));
-        if(subglyphs.size() + subsets.back().glyphs.size() >= max_glyphs) {
+        if(subglyphs.size() + subsets.back().glyphs.size() >= max_subset_glyphs) {
             fprintf(stderr, "Composite glyph overflow not yet implemented.");
             std::abort();
         }
@@ -126,7 +140,7 @@ rvoe<NoReturnValue> FontSubsetter::handle_subglyphs(uint32_t glyph_index) {
                 continue;
             }
             // Composite glyph parts do not necessarily correspond to any Unicode codepoint.
-            subsets.back().glyphs.push_back(CompositeGlyph{new_glyph});
+            append_glyph(CompositeGlyph{new_glyph});
             subsets.back().font_index_mapping[new_glyph] =
                 (uint32_t)subsets.back().glyphs.size() - 1;
         }
@@ -136,56 +150,35 @@ rvoe<NoReturnValue> FontSubsetter::handle_subglyphs(uint32_t glyph_index) {
 
 rvoe<FontSubsetInfo> FontSubsetter::unchecked_insert_glyph_to_last_subset(const u8string &text,
                                                                           uint32_t glyph_id) {
-    if(subsets.back().glyphs.size() == max_glyphs) {
-        subsets.emplace_back(create_startstate());
+    if(subsets.back().glyphs.size() == max_subset_glyphs) {
+        add_subset();
     }
     if(subsets.back().glyphs.size() == SPACE) {
         // NOTE: the case where the subset font has fewer than 32 characters
         // is handled when serializing the font.
-        subsets.back().glyphs.emplace_back(RegularGlyph{SPACE, FT_Get_Char_Index(face, SPACE)});
+        append_glyph(RegularGlyph{SPACE, FT_Get_Char_Index(face, SPACE)});
         subsets.back().font_index_mapping[glyph_id] = SPACE;
     }
     ERCV(handle_subglyphs(glyph_id));
-    subsets.back().glyphs.push_back(LigatureGlyph{text, glyph_id});
+    append_glyph(LigatureGlyph{text, glyph_id});
     subsets.back().font_index_mapping[glyph_id] = (uint32_t)subsets.back().glyphs.size() - 1;
     return FontSubsetInfo{int32_t(subsets.size() - 1), int32_t(subsets.back().glyphs.size() - 1)};
 }
 
 std::optional<FontSubsetInfo> FontSubsetter::find_glyph(uint32_t glyph) const {
-    for(size_t subset = 0; subset < subsets.size(); ++subset) {
-        auto loc =
-            std::find_if(subsets.at(subset).glyphs.cbegin(),
-                         subsets.at(subset).glyphs.cend(),
-                         [&glyph](const TTGlyphs &ttg) {
-                             if(std::holds_alternative<RegularGlyph>(ttg)) {
-                                 return std::get<RegularGlyph>(ttg).unicode_codepoint == glyph;
-                             }
-                             return false;
-                         });
-        if(loc != subsets[subset].glyphs.cend()) {
-            return FontSubsetInfo{int32_t(subset),
-                                  int32_t(loc - subsets.at(subset).glyphs.cbegin())};
-        }
+    auto it = codepoint_index.find(glyph);
+    if(it == codepoint_index.end()) {
+        return {};
     }
-    return {};
+    return it->second;
 }
 
 std::optional<FontSubsetInfo> FontSubsetter::find_glyph(const u8string &text) const {
-    for(size_t subset = 0; subset < subsets.size(); ++subset) {
-        auto loc = std::find_if(subsets.at(subset).glyphs.cbegin(),
-                                subsets.at(subset).glyphs.cend(),
-                                [&text](const TTGlyphs &ttg) {
-                                    if(std::holds_alternative<LigatureGlyph>(ttg)) {
-                                        return std::get<LigatureGlyph>(ttg).text == text;
-                                    }
-                                    return false;
-                                });
-        if(loc != subsets[subset].glyphs.cend()) {
-            return FontSubsetInfo{int32_t(subset),
-                                  int32_t(loc - subsets.at(subset).glyphs.cbegin())};
-        }
+    auto it = ligature_index.find(std::string{text.sv()});
+    if(it == ligature_index.end()) {
+        return {};
     }
-    return {};
+    return it->second;
 }
 
 rvoe<std::string> FontSubsetter::generate_subset(FT_Face face,
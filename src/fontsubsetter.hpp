@@ -18,7 +18,10 @@ typedef struct FT_FaceRec_ *FT_Face;
 
 namespace capypdf::internal {
 
+// Simple fonts use one byte character codes.
 static const std::size_t max_glyphs = 255;
+// Identity-H uses two byte character codes, so a font only needs one subset.
+static const std::size_t max_cid_glyphs = 65535;
 
 struct FontSubsetInfo {
     int32_t subset;
@@ -32,10 +35,14 @@ struct FontSubsetData {
 
 class FontSubsetter {
 public:
-    static rvoe<FontSubsetter> construct(const std::filesystem::path &fontfile, FT_Face face);
+    static rvoe<FontSubsetter> construct(const std::filesystem::path &fontfile,
+                                         FT_Face face,
+                                         std::size_t max_subset_glyphs = max_glyphs);
 
-    FontSubsetter(TrueTypeFontFile ttfile, FT_Face face, std::vector<FontSubsetData> subsets)
-        : ttfile{ttfile}, face{face}, subsets{subsets} {}
+    FontSubsetter(TrueTypeFontFile ttfile, FT_Face face, std::size_t max_subset_glyphs)
+        : ttfile{std::move(ttfile)}, face{face}, max_subset_glyphs{max_subset_glyphs} {
+        add_subset();
+    }
 
     rvoe<FontSubsetInfo> get_glyph_subset(uint32_t glyph, const std::optional<uint32_t> glyph_id);
     rvoe<FontSubsetInfo> get_glyph_subset(const u8string &text, const uint32_t glyph_id);
@@ -49,10 +56,6 @@ public:
         return subsets.at(subset_number).glyphs;
     }
 
-    std::vector<TTGlyphs> &get_subset(int32_t subset_number) {
-        return subsets.at(subset_number).glyphs;
-    }
-
     size_t num_subsets() const { return subsets.size(); }
     size_t subset_size(size_t subset) const { return subsets.at(subset).glyphs.size(); }
 
@@ -61,13 +64,22 @@ public:
 
 private:
     rvoe<NoReturnValue> handle_subglyphs(uint32_t glyph_index);
+    void add_subset();
+    // All glyphs must be added with this so that the lookup indexes stay up to date.
+    void append_glyph(TTGlyphs glyph);
+    void index_glyph(const TTGlyphs &glyph, FontSubsetInfo location);
 
     TrueTypeFontFile ttfile;
     FT_Face face;
+    // Maximum number of glyphs in one subset.
+    std::size_t max_subset_glyphs;
     std::optional<FontSubsetInfo> find_glyph(uint32_t glyph) const;
     std::optional<FontSubsetInfo> find_glyph(const u8string &text) const;
 
     std::vector<FontSubsetData> subsets;
+    // The first location of every codepoint and ligature in subsets.
+    std::unordered_map<uint32_t, FontSubsetInfo> codepoint_index;
+    std::unordered_map<std::string, FontSubsetInfo> ligature_index;
 };
 
 } // namespace capypdf::internal
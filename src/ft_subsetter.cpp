@@ -553,7 +553,7 @@ subset_glyphs(FT_Face face,
               const std::unordered_map<uint32_t, uint32_t> &comp_mapping) {
     std::vector<std::string> subset;
     assert(std::get<RegularGlyph>(glyphs[0]).unicode_codepoint == 0);
-    assert(glyphs.size() < 255);
+    assert(glyphs.size() <= 65535);
     for(const auto &g : glyphs) {
         uint32_t gid = font_id_for_glyph(face, g);
         assert(gid < source.glyphs.size());
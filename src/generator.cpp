@@ -10,6 +10,7 @@
 #include <cassert>
 #include <stdexcept>
 #include <array>
+#include <algorithm>
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include FT_FONT_FORMATS_H
@@ -45,23 +46,51 @@ rvoe<std::unique_ptr<PdfGen>> PdfGen::construct(const std::filesystem::path &ofn
         RETERR(FreeTypeError);
     }
     std::unique_ptr<FT_LibraryRec_, FT_Error (*)(FT_LibraryRec_ *)> ft(ft_, FT_Done_FreeType);
+    if(d.write_queue_depth > 0 && !d.stream_pages) {
+        RETERR(WriteQueueWithoutStreaming);
+    }
     ERC(cm,
         PdfColorConverter::construct(
             d.prof.rgb_profile_file, d.prof.gray_profile_file, d.prof.cmyk_profile_file));
     ERC(pdoc, PdfDocument::construct(d, std::move(cm)));
-    return std::unique_ptr<PdfGen>(new PdfGen(ofname, std::move(ft), std::move(pdoc)));
+    std::unique_ptr<PdfGen> gen(new PdfGen(ofname, std::move(ft), std::move(pdoc)));
+    if(d.stream_pages) {
+        gen->streamer.reset(new PdfWriter(gen->pdoc));
+        ERCV(gen->streamer->begin_streaming(ofname));
+    }
+    return gen;
 }
 
 PdfGen::~PdfGen() {
+    streamer.reset();
     pdoc.font_objects.clear();
     pdoc.fonts.clear();
 }
 
 rvoe<NoReturnValue> PdfGen::write() {
+    if(streamer) {
+        return streamer->finish_streaming();
+    }
     PdfWriter pwriter(pdoc);
     return pwriter.write_to_file(ofilename);
 }
 
+rvoe<NoReturnValue> PdfGen::write_to_callback(CapyPDF_Write_Callback cb, void *user_data) {
+    if(streamer) {
+        RETERR(StreamingOutputIsFile);
+    }
+    PdfWriter pwriter(pdoc);
+    return pwriter.write_to_callback(cb, user_data);
+}
+
+rvoe<NoReturnValue> PdfGen::write_to_memory(std::string &output) {
+    if(streamer) {
+        RETERR(StreamingOutputIsFile);
+    }
+    PdfWriter pwriter(pdoc);
+    return pwriter.write_to_memory(output);
+}
+
 rvoe<RasterImage> PdfGen::load_image(const std::filesystem::path &fname) {
     return load_image_file(fname);
 }
@@ -102,8 +131,10 @@ rvoe<PageId> PdfGen::add_page(PdfDrawContext &ctx) {
     auto sc_var = ctx.serialize();
     assert(std::holds_alternative<SerializedBasicContext>(sc_var));
     auto &sc = std::get<SerializedBasicContext>(sc_var);
-    ERCV(pdoc.add_page(std::move(sc.resource_dict),
+    update_content_size_hint(sc.command_stream.size());
+    ERCV(pdoc.add_page(ctx.get_resource_usage(),
                        std::move(sc.unclosed_object_dict),
+                       std::move(sc.content_chunks),
                        std::move(sc.command_stream),
                        ctx.get_custom_props(),
                        ctx.get_form_usage(),
@@ -111,6 +142,9 @@ rvoe<PageId> PdfGen::add_page(PdfDrawContext &ctx) {
                        ctx.get_structure_usage(),
                        ctx.get_transition(),
                        ctx.get_subpage_navigation()));
+    if(streamer) {
+        ERCV(streamer->stream_page(pdoc.pages.back()));
+    }
     ctx.clear();
     return PageId{(int32_t)pdoc.pages.size() - 1};
 }
@@ -125,10 +159,8 @@ rvoe<CapyPDF_FormXObjectId> PdfGen::add_form_xobject(PdfDrawContext &ctx) {
     auto sc_var = ctx.serialize();
     assert(std::holds_alternative<SerializedXObject>(sc_var));
     auto &sc = std::get<SerializedXObject>(sc_var);
-    pdoc.add_form_xobject(std::move(sc.dict), std::move(sc.command_stream));
+    auto fxoid = pdoc.add_form_xobject(std::move(sc.dict), std::move(sc.command_stream));
     ctx.clear();
-    CapyPDF_FormXObjectId fxoid;
-    fxoid.id = (int32_t)pdoc.form_xobjects.size() - 1;
     return rvoe<CapyPDF_FormXObjectId>{fxoid};
 }
 
@@ -143,12 +175,43 @@ DrawContextPopper PdfGen::guarded_page_context() {
                              pdoc.opts.default_page_properties.mediabox->h()};
 }
 
+void PdfGen::update_content_size_hint(size_t content_size) {
+    // A decaying average, so that one exceptionally big page does not
+    // inflate every buffer allocated after it.
+    content_size_hint =
+        content_size_hint == 0 ? content_size : (3 * content_size_hint + content_size) / 4;
+    const auto chunk_size = pdoc.opts.content_chunk_size;
+    if(chunk_size > 0) {
+        // The buffer is emptied whenever it reaches the chunk size.
+        content_size_hint = std::min(content_size_hint, (size_t)chunk_size);
+    }
+}
+
 PdfDrawContext *PdfGen::new_page_draw_context() {
-    return new PdfDrawContext{&pdoc,
-                              &pdoc.cm,
-                              CAPY_DC_PAGE,
-                              pdoc.opts.default_page_properties.mediabox->w(),
-                              pdoc.opts.default_page_properties.mediabox->h()};
+    if(!context_pool.empty()) {
+        auto *ctx = context_pool.back().release();
+        context_pool.pop_back();
+        return ctx;
+    }
+    auto *ctx = new PdfDrawContext{&pdoc,
+                                   &pdoc.cm,
+                                   CAPY_DC_PAGE,
+                                   pdoc.opts.default_page_properties.mediabox->w(),
+                                   pdoc.opts.default_page_properties.mediabox->h()};
+    ctx->reserve_content(content_size_hint);
+    return ctx;
+}
+
+rvoe<NoReturnValue> PdfGen::recycle_draw_context(PdfDrawContext *ctx) {
+    if(&ctx->get_doc() != &pdoc) {
+        RETERR(IncorrectDocumentForObject);
+    }
+    if(ctx->draw_context_type() != CAPY_DC_PAGE) {
+        RETERR(InvalidDrawContextType);
+    }
+    ctx->clear();
+    context_pool.emplace_back(ctx);
+    RETOK;
 }
 
 PdfDrawContext PdfGen::new_color_pattern_builder(double w, double h) {
@@ -164,34 +227,16 @@ PdfGen::utf8_text_width(const u8string &txt, CapyPDF_FontId fid, double pointsiz
     if(txt.empty()) {
         return 0;
     }
-    double w = 0;
     FT_Face face = pdoc.fonts.at(pdoc.get(fid).font_index_tmp).fontdata.face.get();
     if(!face) {
         RETERR(BuiltinFontNotSupported);
     }
-    uint32_t previous_codepoint = -1;
-    const bool has_kerning = FT_HAS_KERNING(face);
-    for(const auto codepoint : txt) {
-        if(has_kerning && previous_codepoint != (uint32_t)-1) {
-            FT_Vector kerning;
-            const auto index_left = FT_Get_Char_Index(face, previous_codepoint);
-            const auto index_right = FT_Get_Char_Index(face, codepoint);
-            auto ec = FT_Get_Kerning(face, index_left, index_right, FT_KERNING_DEFAULT, &kerning);
-            if(ec != 0) {
-                RETERR(FreeTypeError);
-            }
-            if(kerning.x != 0) {
-                // None of the fonts I tested had kerning that Freetype recognized,
-                // so don't know if this actually works.
-                w += int(kerning.x) / face->units_per_EM;
-            }
-        }
-        auto bob = glyph_advance(fid, pointsize, codepoint);
-        assert(bob);
-        w += *bob;
-        previous_codepoint = codepoint;
-    }
-    return w;
+    int64_t font_units = 0;
+    ERCV(pdoc.for_each_kerned_char(
+        fid, txt, [&font_units](uint32_t, const GlyphMetrics &metrics, int32_t kerning) {
+            font_units += metrics.advance + kerning;
+        }));
+    return font_units * pointsize / face->units_per_EM;
 }
 
 } // namespace capypdf::internal
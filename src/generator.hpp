@@ -4,6 +4,7 @@
 #pragma once
 
 #include <drawcontext.hpp>
+#include <pdfwriter.hpp>
 
 #include <cstdio>
 #include <cstdint>
@@ -43,6 +44,8 @@ public:
     ~PdfGen();
 
     rvoe<NoReturnValue> write();
+    rvoe<NoReturnValue> write_to_callback(CapyPDF_Write_Callback cb, void *user_data);
+    rvoe<NoReturnValue> write_to_memory(std::string &output);
 
     rvoe<RasterImage> load_image(const std::filesystem::path &fname);
     rvoe<CapyPDF_ImageId> embed_jpg(const std::filesystem::path &fname,
@@ -50,8 +53,9 @@ public:
     rvoe<CapyPDF_EmbeddedFileId> embed_file(const std::filesystem::path &fname) {
         return pdoc.embed_file(fname);
     }
-    rvoe<CapyPDF_FontId> load_font(const std::filesystem::path &fname) {
-        return pdoc.load_font(ft.get(), fname);
+    rvoe<CapyPDF_FontId> load_font(const std::filesystem::path &fname,
+                                   const FontProperties &props = {}) {
+        return pdoc.load_font(ft.get(), fname, props);
     };
 
     rvoe<RasterImage> convert_image_to_cs(RasterImage image,
@@ -108,6 +112,8 @@ public:
 
     DrawContextPopper guarded_page_context();
     PdfDrawContext *new_page_draw_context();
+    // Hands a page context back for reuse by new_page_draw_context.
+    rvoe<NoReturnValue> recycle_draw_context(PdfDrawContext *ctx);
 
     DrawContextPopper guarded_form_xobject(double w, double h) {
         return DrawContextPopper(this, &this->pdoc, &pdoc.cm, CAPY_DC_FORM_XOBJECT, w, h);
@@ -150,6 +156,8 @@ public:
 
     int32_t num_pages() const { return (int32_t)pdoc.pages.size(); }
 
+    const WriteStats &write_stats() const { return pdoc.write_stats; }
+
     std::optional<double>
     glyph_advance(CapyPDF_FontId fid, double pointsize, uint32_t codepoint) const {
         return pdoc.glyph_advance(fid, pointsize, codepoint);
@@ -167,9 +175,16 @@ private:
            PdfDocument pdoc)
         : ofilename(std::move(ofilename)), ft(std::move(ft)), pdoc(std::move(pdoc)) {}
 
+    void update_content_size_hint(size_t content_size);
+
     std::filesystem::path ofilename;
     std::unique_ptr<FT_LibraryRec_, FT_Error (*)(FT_LibraryRec_ *)> ft;
     PdfDocument pdoc;
+    std::unique_ptr<PdfWriter> streamer;
+    // Recycled page contexts, which keep their buffer capacities.
+    std::vector<std::unique_ptr<PdfDrawContext>> context_pool;
+    // Typical page content size, used to size new buffers.
+    size_t content_size_hint = 0;
 };
 
 struct GenPopper {
@@ -0,0 +1,91 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Jussi Pakkanen
+
+// Measures the cost of looking up already subsetted glyphs as the
+// number of subsets grows. It should stay the same for every row.
+
+#include <fontsubsetter.hpp>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+using namespace capypdf::internal;
+
+namespace {
+
+const int lookup_rounds = 100;
+
+// Codepoints of simple outline glyphs. Composite glyphs could
+// overflow a subset and empty glyphs can not be subsetted.
+std::vector<uint32_t> simple_codepoints(FT_Face face) {
+    std::vector<uint32_t> codepoints;
+    FT_UInt glyph_index;
+    FT_ULong codepoint = FT_Get_First_Char(face, &glyph_index);
+    while(glyph_index != 0) {
+        if(codepoint != ' ' && FT_Load_Glyph(face, glyph_index, FT_LOAD_NO_RECURSE) == 0 &&
+           face->glyph->format == FT_GLYPH_FORMAT_OUTLINE && face->glyph->outline.n_contours > 0) {
+            codepoints.push_back((uint32_t)codepoint);
+        }
+        codepoint = FT_Get_Next_Char(face, codepoint, &glyph_index);
+    }
+    return codepoints;
+}
+
+void benchmark(const char *fontfile, FT_Face face, const std::vector<uint32_t> &codepoints) {
+    auto subsetter = FontSubsetter::construct(fontfile, face);
+    if(!subsetter) {
+        fprintf(stderr, "%s\n", error_text(subsetter.error()));
+        std::exit(1);
+    }
+    for(const auto cp : codepoints) {
+        if(!subsetter->get_glyph_subset(cp, {})) {
+            fprintf(stderr, "Could not subset codepoint %u.\n", cp);
+            std::exit(1);
+        }
+    }
+    int64_t checksum = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for(int round = 0; round < lookup_rounds; ++round) {
+        for(const auto cp : codepoints) {
+            checksum += subsetter->get_glyph_subset(cp, {}).value().offset;
+        }
+    }
+    const auto end = std::chrono::steady_clock::now();
+    const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    printf("%8zu glyphs %6zu subsets %8.1f ns per lookup (%lld)\n",
+           codepoints.size(),
+           subsetter->num_subsets(),
+           ns / (double(lookup_rounds) * codepoints.size()),
+           (long long)checksum);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    const char *fontfile = argc > 1 ? argv[1] : "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf";
+    FT_Library ft;
+    if(FT_Init_FreeType(&ft) != 0) {
+        fprintf(stderr, "Could not initialize FreeType.\n");
+        return 1;
+    }
+    std::unique_ptr<FT_LibraryRec_, FT_Error (*)(FT_LibraryRec_ *)> ftcloser(ft, FT_Done_FreeType);
+    FT_Face face;
+    if(FT_New_Face(ft, fontfile, 0, &face) != 0) {
+        fprintf(stderr, "Could not load font %s.\n", fontfile);
+        return 1;
+    }
+    std::unique_ptr<FT_FaceRec_, FT_Error (*)(FT_FaceRec_ *)> facecloser(face, FT_Done_Face);
+    const auto codepoints = simple_codepoints(face);
+    for(size_t count = 256; count < codepoints.size(); count *= 2) {
+        const std::vector<uint32_t> prefix(codepoints.begin(), codepoints.begin() + count);
+        benchmark(fontfile, face, prefix);
+    }
+    benchmark(fontfile, face, codepoints);
+    return 0;
+}
@@ -141,4 +141,39 @@ CodepointIterator::CharInfo CodepointIterator::extract_one_codepoint(const unsig
     return CharInfo{unpack_one(buf, par), 1 + par.num_subsequent_bytes};
 }
 
+rvoe<CompressionPolicy> CompressionPolicy::from_preset(CapyPDF_Compression_Preset preset) {
+    CompressionPolicy policy;
+    switch(preset) {
+    case CAPY_COMPRESSION_PRESET_DEFAULT:
+        break;
+    case CAPY_COMPRESSION_PRESET_FAST:
+        // Raw image data is mostly runs of similar pixels, RLE gets most of
+        // the gains for a fraction of the time.
+        for(auto &s : policy.classes) {
+            s = DeflateSettings{1, CAPY_DEFLATE_DEFAULT};
+        }
+        policy.get(CAPY_STREAM_CLASS_IMAGE).strategy = CAPY_DEFLATE_RLE;
+        break;
+    case CAPY_COMPRESSION_PRESET_MAX:
+        for(auto &s : policy.classes) {
+            s = DeflateSettings{9, CAPY_DEFLATE_DEFAULT};
+        }
+        break;
+    default:
+        RETERR(BadEnum);
+    }
+    return policy;
+}
+
+DeflateSettings CompressionPolicy::content_chunk_settings() const {
+    // zlib's own default, chunks are compressed on the drawing thread.
+    const int32_t moderate_level = 6;
+    auto settings = get(CAPY_STREAM_CLASS_CONTENT);
+    if(settings.level == 0) {
+        // Storing the chunks uncompressed would not save any memory.
+        settings.level = moderate_level;
+    }
+    return settings;
+}
+
 } // namespace capypdf::internal
@@ -6,6 +6,7 @@
 #include <capypdf.h>
 #include <errorhandling.hpp>
 
+#include <algorithm>
 #include <optional>
 #include <vector>
 #include <array>
@@ -425,6 +426,13 @@ struct FontSubset {
     }
 
     bool operator!=(const FontSubset &other) const { return !(*this == other); }
+
+    bool operator<(const FontSubset &other) const {
+        if(fid.id != other.fid.id) {
+            return fid.id < other.fid.id;
+        }
+        return subset_id < other.subset_id;
+    }
 };
 
 struct Transition {
@@ -486,6 +494,99 @@ struct ImagePDFProperties {
     bool as_mask = false;
 };
 
+struct FontProperties {
+    CapyPDF_Font_Encoding encoding = CAPY_FONT_ENCODING_SUBSETS;
+};
+
+struct DeflateSettings {
+    // Zero means the stream is stored uncompressed.
+    int32_t level = 9;
+    CapyPDF_Deflate_Strategy strategy = CAPY_DEFLATE_DEFAULT;
+};
+
+struct CompressionPolicy {
+    // Content streams are stored uncompressed by default.
+    std::array<DeflateSettings, CAPY_STREAM_CLASS_OTHER + 1> classes{
+        DeflateSettings{0}, {}, {}, {}, {}};
+    // Sample images and embedded files to choose their encoding.
+    bool probe = true;
+
+    const DeflateSettings &get(CapyPDF_Stream_Class sclass) const { return classes.at(sclass); }
+    DeflateSettings &get(CapyPDF_Stream_Class sclass) { return classes.at(sclass); }
+
+    static rvoe<CompressionPolicy> from_preset(CapyPDF_Compression_Preset preset);
+
+    // Settings for page content that is compressed in chunks while drawing.
+    DeflateSettings content_chunk_settings() const;
+};
+
+// Layout of uncompressed image data, needed by PNG predictors.
+struct RawPixelLayout {
+    int32_t width;
+    int32_t channels;
+    int32_t bits_per_component;
+};
+
+// A real number written with at most `precision` decimals. Trailing zeros
+// are dropped, so whole numbers are written as integers.
+struct PdfNumber {
+    double value;
+    int32_t precision = 6;
+};
+
+const int32_t max_number_precision = 10;
+
+// 128 bit content hash used to find duplicate objects.
+struct ContentHash {
+    uint64_t lo = 0;
+    uint64_t hi = 0;
+
+    bool operator==(const ContentHash &other) const = default;
+};
+
+// A set stored as a sorted vector. Iteration order does not depend on
+// insertion order or hashing and clearing keeps the allocated memory.
+template<typename T> class FlatSet {
+public:
+    typedef typename std::vector<T>::const_iterator const_iterator;
+
+    // Returns false if the value was already in the set.
+    bool insert(const T &value) {
+        auto it = std::lower_bound(entries.begin(), entries.end(), value);
+        if(it != entries.end() && *it == value) {
+            return false;
+        }
+        entries.insert(it, value);
+        return true;
+    }
+
+    bool contains(const T &value) const {
+        return std::binary_search(entries.begin(), entries.end(), value);
+    }
+
+    // Adds all values of other.
+    void merge(const FlatSet &other) {
+        std::vector<T> merged;
+        merged.reserve(entries.size() + other.entries.size());
+        std::set_union(entries.begin(),
+                       entries.end(),
+                       other.entries.begin(),
+                       other.entries.end(),
+                       std::back_inserter(merged));
+        entries = std::move(merged);
+    }
+
+    bool empty() const { return entries.empty(); }
+    size_t size() const { return entries.size(); }
+    void clear() { entries.clear(); }
+
+    const_iterator begin() const { return entries.cbegin(); }
+    const_iterator end() const { return entries.cend(); }
+
+private:
+    std::vector<T> entries;
+};
+
 struct DestinationXYZ {
     std::optional<double> x;
     std::optional<double> y;
@@ -506,3 +607,7 @@ struct Destination {
 };
 
 } // namespace capypdf::internal
+
+template<> struct std::hash<capypdf::internal::ContentHash> {
+    size_t operator()(const capypdf::internal::ContentHash &h) const noexcept { return h.lo; }
+};
@@ -10,11 +10,16 @@
 #include FT_FONT_FORMATS_H
 #include FT_OPENTYPE_VALIDATE_H
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <ctime>
 
 #ifdef _WIN32
 #include <io.h>
 #else
+#include <sys/uio.h>
 #include <unistd.h>
 #endif
 
@@ -24,33 +29,130 @@ namespace {
 
 const char PDF_header[] = "%PDF-1.7\n%\xe5\xf6\xc4\xd6\n";
 
-std::string fontname2pdfname(std::string_view original) {
-    std::string out;
-    out.reserve(original.size());
-    for(const auto c : original) {
-        if(c == ' ') {
-            continue;
+// Same as what Acrobat and most other generators use.
+const size_t max_objects_per_stream = 100;
+
+// Number of objects serialized in memory at a time in parallel mode.
+const int32_t serialize_window_size = 1024;
+
+#ifndef _WIN32
+// IOV_MAX on Linux and macOS.
+const size_t max_iovecs = 1024;
+#endif
+
+// Measures the time between calls to lap(). Reading the process
+// CPU time is a system call, so it can be left out for short laps.
+class PhaseTimer {
+public:
+    explicit PhaseTimer(bool measure_cpu = true) : measure_cpu{measure_cpu} { restart(); }
+
+    PhaseTiming lap() {
+        const auto wall_end = std::chrono::steady_clock::now();
+        PhaseTiming elapsed;
+        elapsed.wall_ns =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(wall_end - wall_start).count();
+        if(measure_cpu) {
+            elapsed.cpu_ns = (int64_t)((std::clock() - cpu_start) * (1e9 / CLOCKS_PER_SEC));
         }
-        if(c == '\\') {
-            continue;
+        restart();
+        return elapsed;
+    }
+
+private:
+    void restart() {
+        wall_start = std::chrono::steady_clock::now();
+        if(measure_cpu) {
+            cpu_start = std::clock();
+        }
+    }
+
+    bool measure_cpu;
+    std::chrono::steady_clock::time_point wall_start;
+    std::clock_t cpu_start = 0;
+};
+
+// Objects that use the same FreeType face must be serialized by the same thread.
+std::optional<CapyPDF_FontId> font_of(const ObjectType &obj) {
+    if(const auto *d = std::get_if<DelayedSubsetFontData>(&obj)) {
+        return d->fid;
+    } else if(const auto *fd = std::get_if<DelayedSubsetFontDescriptor>(&obj)) {
+        return fd->fid;
+    } else if(const auto *cm = std::get_if<DelayedSubsetCMap>(&obj)) {
+        return cm->fid;
+    } else if(const auto *f = std::get_if<DelayedSubsetFont>(&obj)) {
+        return f->fid;
+    }
+    return {};
+}
+
+std::string serialize_object(int32_t object_number,
+                             std::string_view dict_data,
+                             std::string_view stream_data) {
+    std::string buf;
+    auto appender = std::back_inserter(buf);
+    std::format_to(appender, "{} 0 obj\n", object_number);
+    buf += dict_data;
+    if(!stream_data.empty()) {
+        if(buf.back() != '\n') {
+            buf += '\n';
         }
-        out += c;
+        buf += "stream\n";
+        buf += stream_data;
+        // PDF spec says that there must always be a newline before "endstream".
+        // It is not counted in the /Length key in the object dictionary.
+        buf += "\nendstream\n";
     }
-    // FIXME: might need to escape other special characters as well.
-    return out;
+    if(buf.back() != '\n') {
+        buf += '\n';
+    }
+    buf += "endobj\n";
+    return buf;
 }
 
-std::string subsetfontname2pdfname(std::string_view original, const int32_t subset_number) {
-    std::string out;
-    const int bufsize = 10;
-    char buf[bufsize];
-    snprintf(buf, bufsize, "%06d", subset_number);
-    for(int i = 0; i < 6; ++i) {
-        out += 'A' + (buf[i] - '0');
+CapyPDF_Stream_Encoding default_encoding(const DeflateSettings &settings) {
+    return settings.level == 0 ? CAPY_STREAM_ENCODING_RAW : CAPY_STREAM_ENCODING_DEFLATE;
+}
+
+// Stream dictionary entries describing how the stream data was stored.
+std::string stream_entries(CapyPDF_Stream_Encoding encoding,
+                           size_t length,
+                           const std::optional<RawPixelLayout> &pixels = {}) {
+    if(encoding == CAPY_STREAM_ENCODING_RAW) {
+        return std::format("  /Length {}\n", length);
+    }
+    if(encoding == CAPY_STREAM_ENCODING_PNG_PREDICTOR) {
+        assert(pixels);
+        return std::format(R"(  /Filter /FlateDecode
+  /DecodeParms << /Predictor 15 /Colors {} /BitsPerComponent {} /Columns {} >>
+  /Length {}
+)",
+                           pixels->channels,
+                           pixels->bits_per_component,
+                           pixels->width,
+                           length);
     }
-    out += "+";
-    out += fontname2pdfname(original);
-    return out;
+    return std::format("  /Filter /FlateDecode\n  /Length {}\n", length);
+}
+
+rvoe<std::string> encode_stream(std::string_view data, const DeflateSettings &settings) {
+    if(settings.level == 0) {
+        return std::string{data};
+    }
+    return flate_compress(data, settings);
+}
+
+CompressedStream encode_deflate_object(const DeflatePDFObject &pobj,
+                                       const CompressionPolicy &policy) {
+    CompressedStream cs;
+    cs.uncompressed_size = pobj.stream.size();
+    cs.encoding = choose_stream_encoding(pobj.stream, pobj.stream_class, pobj.pixels, policy);
+    if(cs.encoding == CAPY_STREAM_ENCODING_RAW) {
+        cs.data = std::string{};
+    } else {
+        cs.data = encode_stream_data(
+            pobj.stream, cs.encoding, pobj.pixels, policy.get(pobj.stream_class));
+    }
+    return cs;
 }
 
 void write_rectangle(auto &appender, const char *boxname, const PdfRectangle &box) {
@@ -58,7 +160,10 @@ void write_rectangle(auto &appender, const char *boxname, const PdfRectangle &bo
         appender, "  /{} [ {:f} {:f} {:f} {:f} ]\n", boxname, box.x1, box.y1, box.x2, box.y2);
 }
 
-std::string create_subset_cmap(const std::vector<TTGlyphs> &glyphs) {
+// A cmap may have at most 100 entries per bfchar block.
+const size_t max_bfchar_entries = 100;
+
+std::string create_subset_cmap(const std::vector<TTGlyphs> &glyphs, bool two_byte_codes) {
     std::string buf = std::format(R"(/CIDInit/ProcSet findresource begin
 12 dict begin
 begincmap
@@ -70,29 +175,42 @@ begincmap
 /CMapName/Adobe-Identity-UCS def
 /CMapType 2 def
 1 begincodespacerange
-<00> <FF>
+{}
 endcodespacerange
-{} beginbfchar
 )",
-                                  glyphs.size() - 1);
+                                  two_byte_codes ? "<0000> <FFFF>" : "<00> <FF>");
     // Glyph zero is not mapped.
     auto appender = std::back_inserter(buf);
     for(size_t i = 1; i < glyphs.size(); ++i) {
+        if((i - 1) % max_bfchar_entries == 0) {
+            if(i > 1) {
+                buf += "endbfchar\n";
+            }
+            std::format_to(
+                appender, "{} beginbfchar\n", std::min(max_bfchar_entries, glyphs.size() - i));
+        }
         const auto &g = glyphs[i];
+        if(two_byte_codes) {
+            std::format_to(appender, "<{:04X}> ", i);
+        } else {
+            std::format_to(appender, "<{:02X}> ", i);
+        }
         if(std::holds_alternative<LigatureGlyph>(g)) {
             const auto &lg = std::get<LigatureGlyph>(g);
             const auto u16repr = utf8_to_pdfutf16be(lg.text, false);
-            std::format_to(appender, "<{:02X}> <{}>\n", i, u16repr);
+            std::format_to(appender, "<{}>\n", u16repr);
         } else {
             uint32_t unicode_codepoint = 0;
             if(std::holds_alternative<RegularGlyph>(g)) {
                 unicode_codepoint = std::get<RegularGlyph>(g).unicode_codepoint;
             }
-            std::format_to(appender, "<{:02X}> <{:04X}>\n", i, unicode_codepoint);
+            std::format_to(appender, "<{:04X}>\n", unicode_codepoint);
         }
     }
-    buf += R"(endbfchar
-endcmap
+    if(glyphs.size() > 1) {
+        buf += "endbfchar\n";
+    }
+    buf += R"(endcmap
 CMapName currentdict /CMap defineresource pop
 end
 end
@@ -100,24 +218,38 @@ end
     return buf;
 }
 
-rvoe<std::string> build_subset_width_array(FT_Face face, const std::vector<TTGlyphs> &glyphs) {
+template<typename F> rvoe<NoReturnValue> guard_exceptions(F &&func) {
+    try {
+        return func();
+    } catch(const std::exception &e) {
+        fprintf(stderr, "%s\n", e.what());
+        RETERR(DynamicError);
+    } catch(...) {
+        fprintf(stderr, "Unexpected error.\n");
+        RETERR(DynamicError);
+    }
+}
+
+// Advances come from the parsed hmtx table rather than FreeType, so
+// width arrays of several subsets can be built at the same time.
+std::string build_subset_width_array(const TrueTypeFontFile &source,
+                                     const std::vector<TTGlyphs> &glyphs) {
     std::string arr{"[ "};
     auto bi = std::back_inserter(arr);
-    const auto load_flags = FT_LOAD_NO_SCALE | FT_LOAD_LINEAR_DESIGN | FT_LOAD_NO_HINTING;
+    const auto &longhor = source.hmtx.longhor;
     for(const auto &glyph : glyphs) {
-        const auto glyph_id = font_id_for_glyph(face, glyph);
-        FT_Pos horiadvance = 0;
-        if(glyph_id != 0) {
-            auto error = FT_Load_Glyph(face, glyph_id, load_flags);
-            if(error != 0) {
-                RETERR(FreeTypeError);
-            }
-            horiadvance = face->glyph->metrics.horiAdvance;
+        const auto glyph_id = font_id_for_glyph(nullptr, glyph);
+        int32_t horiadvance = 0;
+        if(glyph_id != 0 && !longhor.empty()) {
+            // Glyphs after the last long metric have its advance.
+            horiadvance = glyph_id < longhor.size() ? longhor[glyph_id].advance_width
+                                                    : longhor.back().advance_width;
         }
         // I don't know if this is correct or not, but it worked with all fonts I had.
         //
         // Determined via debugging empirism.
-        std::format_to(bi, "{} ", (int32_t)(double(horiadvance) * 1000 / face->units_per_EM));
+        std::format_to(
+            bi, "{} ", (int32_t)(double(horiadvance) * 1000 / source.head.units_per_em));
     }
     arr += "]";
     return arr;
@@ -125,9 +257,176 @@ rvoe<std::string> build_subset_width_array(FT_Face face, const std::vector<TTGly
 
 } // namespace
 
-PdfWriter::PdfWriter(PdfDocument &doc) : doc(doc) {}
+PdfWriter::PdfWriter(PdfDocument &doc) : doc(doc) {
+    // Only reproducible document IDs are derived from the output.
+    if(getenv("SOURCE_DATE_EPOCH")) {
+        output_hash.emplace();
+    }
+}
+
+PdfWriter::~PdfWriter() {
+    stop_background_writer();
+    if(auto *fs = std::get_if<FileSink>(&sink)) {
+        // The document was never finished, do not leave a partial file behind.
+        fs->f.reset();
+        std::error_code ec;
+        std::filesystem::remove(fs->temp_name, ec);
+    }
+}
 
 rvoe<NoReturnValue> PdfWriter::write_to_file(const std::filesystem::path &ofilename) {
+    ERCV(check_writability());
+    ERCV(open_file(ofilename));
+    return write_all();
+}
+
+rvoe<NoReturnValue> PdfWriter::write_to_callback(CapyPDF_Write_Callback cb, void *user_data) {
+    ERCV(check_writability());
+    assert(std::holds_alternative<std::monostate>(sink));
+    sink = CallbackSink{cb, user_data};
+    bytes_written = 0;
+    return write_all();
+}
+
+rvoe<NoReturnValue> PdfWriter::write_to_memory(std::string &output) {
+    ERCV(check_writability());
+    assert(std::holds_alternative<std::monostate>(sink));
+    sink = MemorySink{&output};
+    bytes_written = 0;
+    return write_all();
+}
+
+rvoe<NoReturnValue> PdfWriter::write_all() {
+    ERCV(guard_exceptions([&]() -> rvoe<NoReturnValue> {
+        ERCV(write_header());
+        return write_to_file_impl();
+    }));
+    return close_output();
+}
+
+rvoe<NoReturnValue> PdfWriter::begin_streaming(const std::filesystem::path &ofilename) {
+    ERCV(open_file(ofilename));
+    ERCV(guard_exceptions([&]() { return write_header(); }));
+    if(doc.opts.write_queue_depth > 0) {
+        background_writing = true;
+        writer_thread = std::thread([this]() { background_writer(); });
+    }
+    return NoReturnValue{};
+}
+
+rvoe<NoReturnValue> PdfWriter::stream_page(const PageOffsets &p) {
+    assert(std::holds_alternative<FileSink>(sink) || background_writing);
+    if(background_writing) {
+        return guard_exceptions([&]() { return queue_page(p); });
+    }
+    // All objects of a page, including the subnavigation nodes
+    // created for it, have consecutive object numbers.
+    return guard_exceptions([&]() -> rvoe<NoReturnValue> {
+        for(int32_t i = p.first_obj_num; i <= p.page_obj_num; ++i) {
+            ERCV(write_object(i));
+            doc.document_objects.at(i) = WrittenObject{};
+        }
+        return flush_object_stream(false);
+    });
+}
+
+rvoe<NoReturnValue> PdfWriter::finish_streaming() {
+    ERCV(stop_background_writer());
+    ERCV(check_writability());
+    if(!std::holds_alternative<FileSink>(sink)) {
+        RETERR(FileWriteError);
+    }
+    ERCV(guard_exceptions([&]() { return write_to_file_impl(); }));
+    return close_output();
+}
+
+rvoe<NoReturnValue> PdfWriter::queue_page(const PageOffsets &p) {
+    QueuedPage page;
+    // Page dictionaries refer to other document data, so they are
+    // serialized here. Everything else is independent of the document.
+    for(int32_t i = p.first_obj_num; i <= p.page_obj_num; ++i) {
+        auto &obj = doc.document_objects.at(i);
+        if(const auto *dp = std::get_if<DelayedPage>(&obj)) {
+            obj = FullPDFObject{serialize_delayed_page(*dp), {}};
+        }
+        if(const auto *full = std::get_if<FullPDFObject>(&obj)) {
+            page.size += full->dictionary.size() + full->stream.size();
+        } else if(const auto *deflate = std::get_if<DeflatePDFObject>(&obj)) {
+            page.size += deflate->unclosed_dictionary.size() + deflate->stream.size();
+        }
+        page.objects.emplace_back(i, std::move(obj));
+        obj = WrittenObject{};
+    }
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    // Always accept a page into an empty queue, no matter how big it is.
+    queue_changed.wait(lock, [&]() {
+        const uint64_t max_bytes = doc.opts.write_queue_max_bytes;
+        const bool full =
+            write_queue.size() >= (size_t)doc.opts.write_queue_depth ||
+            (max_bytes > 0 && queued_bytes + page.size > max_bytes && queued_bytes > 0);
+        return background_error != ErrorCode::NoError || !full;
+    });
+    if(background_error != ErrorCode::NoError) {
+        return std::unexpected(background_error);
+    }
+    queued_bytes += page.size;
+    note_buffered(queued_bytes);
+    write_queue.push_back(std::move(page));
+    queue_changed.notify_all();
+    return NoReturnValue{};
+}
+
+void PdfWriter::background_writer() {
+    while(true) {
+        QueuedPage page;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_changed.wait(lock, [&]() { return queue_closed || !write_queue.empty(); });
+            if(write_queue.empty()) {
+                return;
+            }
+            page = std::move(write_queue.front());
+            write_queue.pop_front();
+        }
+        auto rc = guard_exceptions([&]() -> rvoe<NoReturnValue> {
+            for(const auto &[object_number, obj] : page.objects) {
+                ERCV(write_object(object_number, obj));
+            }
+            return NoReturnValue{};
+        });
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        // Bytes are accounted until written so that memory use stays bounded.
+        queued_bytes -= page.size;
+        if(!rc) {
+            background_error = rc.error();
+            write_queue.clear();
+            queued_bytes = 0;
+        }
+        queue_changed.notify_all();
+        if(!rc) {
+            return;
+        }
+    }
+}
+
+rvoe<NoReturnValue> PdfWriter::stop_background_writer() {
+    if(!background_writing) {
+        return NoReturnValue{};
+    }
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        queue_closed = true;
+    }
+    queue_changed.notify_all();
+    writer_thread.join();
+    background_writing = false;
+    if(background_error != ErrorCode::NoError) {
+        return std::unexpected(background_error);
+    }
+    return NoReturnValue{};
+}
+
+rvoe<NoReturnValue> PdfWriter::check_writability() {
     if(doc.pages.size() == 0) {
         RETERR(NoPages);
     }
@@ -135,25 +434,34 @@ rvoe<NoReturnValue> PdfWriter::write_to_file(const std::filesystem::path &ofilen
         RETERR(WritingTwice);
     }
     doc.write_attempted = true;
-    auto tempfname = ofilename;
-    tempfname.replace_extension(".pdf~");
-    FILE *out_file = fopen(tempfname.string().c_str(), "wb");
-    if(!out_file) {
+    return NoReturnValue{};
+}
+
+rvoe<NoReturnValue> PdfWriter::open_file(const std::filesystem::path &ofilename) {
+    assert(std::holds_alternative<std::monostate>(sink));
+    FileSink fs;
+    fs.final_name = ofilename;
+    fs.temp_name = ofilename;
+    fs.temp_name.replace_extension(".pdf~");
+    fs.f.reset(fopen(fs.temp_name.string().c_str(), "wb"));
+    if(!fs.f) {
         perror(nullptr);
         RETERR(CouldNotOpenFile);
     }
-    std::unique_ptr<FILE, int (*)(FILE *)> fcloser(out_file, fclose);
+    sink = std::move(fs);
+    bytes_written = 0;
+    return NoReturnValue{};
+}
 
-    try {
-        ERCV(write_to_file(out_file));
-    } catch(const std::exception &e) {
-        fprintf(stderr, "%s\n", e.what());
-        RETERR(DynamicError);
-    } catch(...) {
-        fprintf(stderr, "Unexpected error.\n");
-        RETERR(DynamicError);
+rvoe<NoReturnValue> PdfWriter::close_output() {
+    auto finished_sink = std::move(sink);
+    sink = std::monostate{};
+    auto *fs = std::get_if<FileSink>(&finished_sink);
+    if(!fs) {
+        // Callbacks and memory buffers need no finalization.
+        return NoReturnValue{};
     }
-
+    FILE *out_file = fs->f.get();
     if(fflush(out_file) != 0) {
         perror(nullptr);
         RETERR(DynamicError);
@@ -170,7 +478,7 @@ rvoe<NoReturnValue> PdfWriter::write_to_file(const std::filesystem::path &ofilen
         RETERR(FileWriteError);
     }
     // Close the file manually to verify it worked.
-    fcloser.release();
+    fs->f.release();
     if(fclose(out_file) != 0) {
         perror(nullptr);
         RETERR(FileWriteError);
@@ -178,7 +486,7 @@ rvoe<NoReturnValue> PdfWriter::write_to_file(const std::filesystem::path &ofilen
 
     // If we made it here, the file has been fully written and fsynd'd to disk. Now replace.
     std::error_code ec;
-    std::filesystem::rename(tempfname, ofilename, ec);
+    std::filesystem::rename(fs->temp_name, fs->final_name, ec);
     if(ec) {
         fprintf(stderr, "%s\n", ec.category().message(ec.value()).c_str());
         RETERR(FileWriteError);
@@ -186,34 +494,223 @@ rvoe<NoReturnValue> PdfWriter::write_to_file(const std::filesystem::path &ofilen
     return NoReturnValue{};
 }
 
-rvoe<NoReturnValue> PdfWriter::write_to_file(FILE *output_file) {
-    assert(ofile == nullptr);
-    ofile = output_file;
-    try {
-        auto rc = write_to_file_impl();
-        ofile = nullptr;
-        return rc;
-    } catch(...) {
-        ofile = nullptr;
-        throw;
-    }
-}
-
 rvoe<NoReturnValue> PdfWriter::write_to_file_impl() {
-    ERCV(write_header());
+    PhaseTimer timer;
     ERCV(doc.create_catalog());
+    add_phase_time(CAPY_WRITE_PHASE_CATALOG, timer.lap());
     doc.pad_subset_fonts();
-    ERC(object_offsets, write_objects());
-    const int64_t xref_offset = ftell(ofile);
-    ERCV(write_cross_reference_table(object_offsets));
-    ERCV(write_trailer(xref_offset));
+    add_phase_time(CAPY_WRITE_PHASE_PAD_FONTS, timer.lap());
+    count_objects();
+    // The catalog is the last object created. Object streams get
+    // object numbers after it.
+    const int32_t root = doc.document_objects.size() - 1;
+    if(doc.opts.num_threads != 1) {
+        // Serial writing generates and compresses each stream when its
+        // object is written, so that only one is held in memory at a time.
+        ERCV(build_subset_fonts());
+        add_phase_time(CAPY_WRITE_PHASE_SUBSET_FONTS, timer.lap());
+        ERCV(precompress_streams());
+    }
+    timer.lap();
+    ERCV(write_objects());
+    add_phase_time(CAPY_WRITE_PHASE_OBJECTS, timer.lap());
+    if(doc.opts.object_streams) {
+        ERCV(write_cross_reference_stream(root));
+    } else {
+        const int64_t xref_offset = bytes_written;
+        std::string xref_table;
+        ERCV(write_cross_reference_table(xref_table));
+        ERCV(write_trailer(xref_offset, root, xref_table));
+    }
+    add_phase_time(CAPY_WRITE_PHASE_XREF, timer.lap());
+    return NoReturnValue{};
+}
+
+rvoe<NoReturnValue> PdfWriter::build_subset_fonts() {
+    // Entries are created before the jobs run, so the maps are not modified concurrently.
+    std::vector<int32_t> jobs;
+    for(size_t i = 0; i < doc.document_objects.size(); ++i) {
+        const auto &obj = doc.document_objects[i];
+        if(std::holds_alternative<DelayedSubsetFontData>(obj)) {
+            compressed_streams[i];
+            jobs.push_back(i);
+        } else if(std::holds_alternative<DelayedSubsetFont>(obj) ||
+                  std::holds_alternative<DelayedSubsetCMap>(obj)) {
+            subset_font_parts[i];
+            jobs.push_back(i);
+        }
+    }
+    // None of the jobs use FreeType faces, which must not be shared between threads.
+    std::vector<ErrorCode> errors(jobs.size(), ErrorCode::NoError);
+    parallel_for(jobs.size(), doc.opts.num_threads, [&](size_t job) {
+        const int32_t object_number = jobs[job];
+        const auto &obj = doc.document_objects[object_number];
+        try {
+            if(const auto *ssfont = std::get_if<DelayedSubsetFontData>(&obj)) {
+                const auto &font = doc.fonts.at(ssfont->fid.id);
+                auto &cs = compressed_streams.at(object_number);
+                cs.data = font.subsets.generate_subset(
+                    font.fontdata.face.get(), font.fontdata.fontdata, ssfont->subset_id);
+                if(cs.data) {
+                    cs.uncompressed_size = cs.data->size();
+                }
+            } else if(const auto *ssfont = std::get_if<DelayedSubsetFont>(&obj)) {
+                const auto &font = doc.fonts.at(ssfont->fid.id);
+                subset_font_parts.at(object_number) =
+                    build_subset_width_array(font.fontdata.fontdata, font.subsets.get_subset(0));
+            } else if(const auto *sscmap = std::get_if<DelayedSubsetCMap>(&obj)) {
+                const auto &font = doc.fonts.at(sscmap->fid.id);
+                subset_font_parts.at(object_number) =
+                    create_subset_cmap(font.subsets.get_subset(sscmap->subset_id),
+                                       font.encoding == CAPY_FONT_ENCODING_IDENTITY_H);
+            }
+        } catch(...) {
+            errors[job] = ErrorCode::DynamicError;
+        }
+    });
+    for(const auto &error : errors) {
+        if(error != ErrorCode::NoError) {
+            return std::unexpected(error);
+        }
+    }
+    return NoReturnValue{};
+}
+
+rvoe<NoReturnValue> PdfWriter::precompress_streams() {
+    const auto &font_settings = doc.opts.compression.get(CAPY_STREAM_CLASS_FONT);
+    std::vector<int32_t> jobs;
+    for(size_t i = 0; i < doc.document_objects.size(); ++i) {
+        const auto &obj = doc.document_objects[i];
+        if(const auto *pobj = std::get_if<DeflatePDFObject>(&obj)) {
+            if(doc.opts.compression.get(pobj->stream_class).level == 0 ||
+               pobj->uncompressed_size) {
+                continue;
+            }
+            compressed_streams[i];
+            jobs.push_back(i);
+        } else if(std::holds_alternative<DelayedSubsetFontData>(obj)) {
+            // Generated by build_subset_fonts.
+            auto &cs = compressed_streams.at(i);
+            if(!cs.data) {
+                return std::unexpected(cs.data.error());
+            }
+            cs.encoding = default_encoding(font_settings);
+            if(cs.encoding != CAPY_STREAM_ENCODING_RAW) {
+                jobs.push_back(i);
+            }
+        }
+    }
+    // The map is not modified while the jobs run, so concurrent lookups are safe.
+    PhaseTimer timer;
+    parallel_for(jobs.size(), doc.opts.num_threads, [&](size_t job) {
+        const int32_t object_number = jobs[job];
+        auto &cs = compressed_streams.at(object_number);
+        const auto &obj = doc.document_objects[object_number];
+        try {
+            if(const auto *pobj = std::get_if<DeflatePDFObject>(&obj)) {
+                cs = encode_deflate_object(*pobj, doc.opts.compression);
+            } else {
+                cs.data = flate_compress(cs.data.value(), font_settings);
+            }
+        } catch(...) {
+            cs.data = std::unexpected(ErrorCode::DynamicError);
+        }
+    });
+    add_phase_time(CAPY_WRITE_PHASE_COMPRESS, timer.lap());
+    uint64_t buffered = 0;
+    for(const auto &[object_number, cs] : compressed_streams) {
+        if(cs.data) {
+            buffered += cs.data->size();
+        }
+    }
+    note_buffered(buffered);
     return NoReturnValue{};
 }
 
 rvoe<NoReturnValue> PdfWriter::write_bytes(const char *buf, size_t buf_size) {
-    if(fwrite(buf, 1, buf_size, ofile) != buf_size) {
-        perror(nullptr);
-        RETERR(FileWriteError);
+    std::optional<PhaseTimer> timer;
+    if(doc.opts.write_stats) {
+        timer.emplace(false);
+    }
+    if(auto *fs = std::get_if<FileSink>(&sink)) {
+        if(fwrite(buf, 1, buf_size, fs->f.get()) != buf_size) {
+            perror(nullptr);
+            RETERR(FileWriteError);
+        }
+    } else if(auto *cs = std::get_if<CallbackSink>(&sink)) {
+        if(cs->cb(buf, (int64_t)buf_size, cs->user_data) != 0) {
+            RETERR(FileWriteError);
+        }
+    } else if(auto *ms = std::get_if<MemorySink>(&sink)) {
+        ms->output->append(buf, buf_size);
+    } else {
+        RETERR(Unreachable);
+    }
+    if(output_hash) {
+        output_hash->update(std::string_view(buf, buf_size));
+    }
+    if(timer) {
+        add_phase_time(CAPY_WRITE_PHASE_OUTPUT, timer->lap());
+    }
+    bytes_written += buf_size;
+    return NoReturnValue{};
+}
+
+rvoe<NoReturnValue> PdfWriter::write_buffers(const std::vector<std::string_view> &buffers) {
+#ifndef _WIN32
+    if(auto *fs = std::get_if<FileSink>(&sink)) {
+        // Bypass stdio buffering so that a batch goes out in a few system calls.
+        std::optional<PhaseTimer> timer;
+        if(doc.opts.write_stats) {
+            timer.emplace(false);
+        }
+        const int fd = fileno(fs->f.get());
+        std::vector<iovec> iov;
+        iov.reserve(buffers.size());
+        for(const auto &b : buffers) {
+            if(!b.empty()) {
+                iov.push_back(iovec{(void *)b.data(), b.size()});
+            }
+            if(output_hash) {
+                output_hash->update(b);
+            }
+        }
+        size_t current = 0;
+        while(current < iov.size()) {
+            // Data still buffered by stdio must reach the file before
+            // anything written to the descriptor directly.
+            if(fflush(fs->f.get()) != 0) {
+                perror(nullptr);
+                RETERR(FileWriteError);
+            }
+            const int count = (int)std::min(iov.size() - current, max_iovecs);
+            ssize_t written = writev(fd, iov.data() + current, count);
+            if(written < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                perror(nullptr);
+                RETERR(FileWriteError);
+            }
+            bytes_written += written;
+            // Skip the fully written buffers and trim a partially written one.
+            while(current < iov.size() && (size_t)written >= iov[current].iov_len) {
+                written -= iov[current].iov_len;
+                ++current;
+            }
+            if(written > 0) {
+                iov[current].iov_base = (char *)iov[current].iov_base + written;
+                iov[current].iov_len -= written;
+            }
+        }
+        if(timer) {
+            add_phase_time(CAPY_WRITE_PHASE_OUTPUT, timer->lap());
+        }
+        return NoReturnValue{};
+    }
+#endif
+    for(const auto &b : buffers) {
+        ERCV(write_bytes(b));
     }
     return NoReturnValue{};
 }
@@ -222,10 +719,14 @@ rvoe<NoReturnValue> PdfWriter::write_header() {
     return write_bytes(PDF_header, strlen(PDF_header));
 }
 
-rvoe<std::vector<uint64_t>> PdfWriter::write_objects() {
-    size_t i = 0;
+rvoe<NoReturnValue> PdfWriter::write_object(int32_t object_number) {
+    return write_object(object_number, doc.document_objects.at(object_number));
+}
+
+rvoe<NoReturnValue> PdfWriter::write_object(int32_t object_number, const ObjectType &obj) {
+    const int32_t i = object_number;
     auto visitor = overloaded{
-        [](DummyIndexZero &) -> rvoe<NoReturnValue> { return NoReturnValue{}; },
+        [](const DummyIndexZero &) -> rvoe<NoReturnValue> { return NoReturnValue{}; },
 
         [&](const FullPDFObject &pobj) -> rvoe<NoReturnValue> {
             ERCV(write_finished_object(i, pobj.dictionary, pobj.stream));
@@ -233,11 +734,37 @@ rvoe<std::vector<uint64_t>> PdfWriter::write_objects() {
         },
 
         [&](const DeflatePDFObject &pobj) -> rvoe<NoReturnValue> {
-            ERC(compressed, flate_compress(pobj.stream));
-            std::string dict = std::format("{}  /Filter /FlateDecode\n  /Length {}\n>>\n",
-                                           pobj.unclosed_dictionary,
-                                           compressed.size());
-            ERCV(write_finished_object(i, dict, compressed));
+            if(pobj.uncompressed_size) {
+                std::string dict = std::format(
+                    "{}{}>>\n",
+                    pobj.unclosed_dictionary,
+                    stream_entries(pobj.encoding, pobj.stream.size(), pobj.pixels));
+                ERCV(write_finished_object(i, dict, pobj.stream));
+                count_stream(pobj.stream_class,
+                             pobj.encoding,
+                             *pobj.uncompressed_size,
+                             pobj.stream.size());
+                return NoReturnValue{};
+            }
+            CompressedStream cs;
+            // The map must not be modified here, objects can be serialized concurrently.
+            auto precompressed = compressed_streams.find(i);
+            if(precompressed != compressed_streams.end()) {
+                cs = std::move(precompressed->second);
+            } else {
+                cs = encode_deflate_object(pobj, doc.opts.compression);
+            }
+            if(!cs.data) {
+                return std::unexpected(cs.data.error());
+            }
+            const std::string_view stream_data =
+                cs.encoding == CAPY_STREAM_ENCODING_RAW ? pobj.stream : cs.data.value();
+            std::string dict =
+                std::format("{}{}>>\n",
+                            pobj.unclosed_dictionary,
+                            stream_entries(cs.encoding, stream_data.size(), pobj.pixels));
+            ERCV(write_finished_object(i, dict, stream_data));
+            count_stream(pobj.stream_class, cs.encoding, pobj.stream.size(), stream_data.size());
             return NoReturnValue{};
         },
 
@@ -292,42 +819,203 @@ rvoe<std::vector<uint64_t>> PdfWriter::write_objects() {
             ERCV(write_delayed_structure_item(i, si));
             return NoReturnValue{};
         },
+
+        [](const WrittenObject &) -> rvoe<NoReturnValue> { return NoReturnValue{}; },
     };
+    return std::visit(visitor, obj);
+}
 
-    std::vector<uint64_t> object_offsets;
-    for(; i < doc.document_objects.size(); ++i) {
-        object_offsets.push_back(ftell(ofile));
-        ERCV(std::visit(visitor, doc.document_objects.at(i)));
+rvoe<NoReturnValue> PdfWriter::write_objects() {
+    if(doc.opts.num_threads != 1) {
+        ERCV(write_objects_parallel());
+    } else {
+        // New object streams are appended to the object list while looping.
+        for(size_t i = 0; i < doc.document_objects.size(); ++i) {
+            if(std::holds_alternative<WrittenObject>(doc.document_objects[i])) {
+                continue;
+            }
+            ERCV(write_object(i));
+            ERCV(flush_object_stream(false));
+        }
     }
-    return object_offsets;
+    ERCV(flush_object_stream(true));
+    object_locations.resize(doc.document_objects.size());
+    compressed_streams.clear();
+    subset_font_parts.clear();
+    return NoReturnValue{};
 }
 
-rvoe<NoReturnValue>
-PdfWriter::write_cross_reference_table(const std::vector<uint64_t> &object_offsets) {
-    std::string buf;
+// Produces the same output as the serial loop above. Objects are first
+// serialized into their own buffers in parallel. Then they are laid out
+// in order, which gives their offsets as a running sum of buffer sizes,
+// and written out in large batches.
+rvoe<NoReturnValue> PdfWriter::write_objects_parallel() {
+    std::vector<std::string_view> batch;
+    uint64_t batch_size = 0;
+    // New object streams are appended to the object list while looping.
+    for(int32_t first = 0; first < (int32_t)doc.document_objects.size();
+        first += serialize_window_size) {
+        const int32_t end =
+            std::min(first + serialize_window_size, (int32_t)doc.document_objects.size());
+        ERCV(serialize_window(first, end));
+        for(int32_t i = first; i < end; ++i) {
+            const auto &so = serialized[i - first];
+            if(so.error != ErrorCode::NoError) {
+                return std::unexpected(so.error);
+            }
+            if(!so.present) {
+                continue;
+            }
+            if(so.packable) {
+                ERCV(pack_object(i, so.data));
+            } else {
+                record_location(i, DirectLocation{bytes_written + batch_size});
+                batch.push_back(so.data);
+                batch_size += so.data.size();
+            }
+            if(packed_objects.size() >= max_objects_per_stream) {
+                // The object stream must come after the objects before it.
+                ERCV(write_buffers(batch));
+                batch.clear();
+                batch_size = 0;
+                ERCV(flush_object_stream(false));
+            }
+        }
+        ERCV(write_buffers(batch));
+        batch.clear();
+        batch_size = 0;
+    }
+    serialized.clear();
+    return NoReturnValue{};
+}
+
+rvoe<NoReturnValue> PdfWriter::serialize_window(int32_t first, int32_t end) {
+    serialized.clear();
+    serialized.resize(end - first);
+    std::vector<std::vector<int32_t>> jobs;
+    std::unordered_map<int32_t, size_t> font_jobs;
+    for(int32_t i = first; i < end; ++i) {
+        const auto &obj = doc.document_objects[i];
+        if(std::holds_alternative<WrittenObject>(obj)) {
+            continue;
+        }
+        if(auto fid = font_of(obj)) {
+            auto it = font_jobs.find(fid->id);
+            if(it == font_jobs.end()) {
+                it = font_jobs.emplace(fid->id, jobs.size()).first;
+                jobs.emplace_back();
+            }
+            jobs[it->second].push_back(i);
+        } else {
+            jobs.push_back({i});
+        }
+    }
+    capturing = true;
+    serialized_base = first;
+    parallel_for(jobs.size(), doc.opts.num_threads, [&](size_t job) {
+        for(const auto object_number : jobs[job]) {
+            auto &so = serialized[object_number - first];
+            try {
+                auto rc = write_object(object_number);
+                if(!rc) {
+                    so.error = rc.error();
+                }
+            } catch(...) {
+                so.error = ErrorCode::DynamicError;
+            }
+        }
+    });
+    capturing = false;
+    uint64_t buffered = 0;
+    for(const auto &so : serialized) {
+        buffered += so.data.size();
+    }
+    note_buffered(buffered);
+    return NoReturnValue{};
+}
+
+void PdfWriter::record_location(int32_t object_number, ObjectLocation loc) {
+    if((size_t)object_number >= object_locations.size()) {
+        object_locations.resize(object_number + 1);
+    }
+    object_locations[object_number] = loc;
+}
+
+rvoe<NoReturnValue> PdfWriter::pack_object(int32_t object_number, std::string_view dict_data) {
+    packed_objects.emplace_back(object_number, packed_data.size());
+    packed_data += dict_data;
+    if(packed_data.back() != '\n') {
+        packed_data += '\n';
+    }
+    return NoReturnValue{};
+}
+
+rvoe<NoReturnValue> PdfWriter::flush_object_stream(bool force) {
+    if(packed_objects.empty() || (!force && packed_objects.size() < max_objects_per_stream)) {
+        return NoReturnValue{};
+    }
+    const int32_t objstm_number = doc.add_object(WrittenObject{});
+    std::string stream;
+    auto app = std::back_inserter(stream);
+    for(const auto &[object_number, offset] : packed_objects) {
+        std::format_to(app, "{} {}\n", object_number, offset);
+    }
+    const size_t first = stream.size();
+    stream += packed_data;
+    const auto &settings = doc.opts.compression.get(CAPY_STREAM_CLASS_OTHER);
+    ERC(compressed, encode_stream(stream, settings));
+    auto dict = std::format(R"(<<
+  /Type /ObjStm
+  /N {}
+  /First {}
+{}>>
+)",
+                            packed_objects.size(),
+                            first,
+                            stream_entries(default_encoding(settings), compressed.size()));
+    ERCV(write_finished_object(objstm_number, dict, compressed));
+    count_stream(
+        CAPY_STREAM_CLASS_OTHER, default_encoding(settings), stream.size(), compressed.size());
+    for(size_t i = 0; i < packed_objects.size(); ++i) {
+        record_location(packed_objects[i].first, PackedLocation{objstm_number, (int32_t)i});
+    }
+    packed_objects.clear();
+    packed_data.clear();
+    return NoReturnValue{};
+}
+
+rvoe<NoReturnValue> PdfWriter::write_cross_reference_table(std::string &buf) {
     auto app = std::back_inserter(buf);
     std::format_to(app,
                    R"(xref
 0 {}
 )",
-                   object_offsets.size());
-    bool first = true;
-    for(const auto &i : object_offsets) {
-        if(first) {
-            buf += "0000000000 65535 f \n"; // The end of line whitespace is significant.
-            first = false;
+                   object_locations.size());
+    for(const auto &loc : object_locations) {
+        if(const auto *direct = std::get_if<DirectLocation>(&loc)) {
+            std::format_to(app, "{:010} 00000 n \n", direct->offset);
         } else {
-            std::format_to(app, "{:010} 00000 n \n", i);
+            // Object zero is the only unused one.
+            assert(std::holds_alternative<std::monostate>(loc));
+            buf += "0000000000 65535 f \n"; // The end of line whitespace is significant.
         }
     }
     return write_bytes(buf);
 }
 
-rvoe<NoReturnValue> PdfWriter ::write_trailer(int64_t xref_offset) {
-    const int32_t info = 1;                               // Info object is the first printed.
-    const int32_t root = doc.document_objects.size() - 1; // Root object is the last one printed.
+std::string PdfWriter::document_id(std::string_view xref_data) const {
+    // Every byte written so far and the cross reference data, which is
+    // not written yet when it goes in a stream.
+    auto hasher = output_hash.value_or(ContentHasher{});
+    hasher.update(xref_data);
+    return create_trailer_id(hasher.digest());
+}
+
+rvoe<NoReturnValue>
+PdfWriter ::write_trailer(int64_t xref_offset, int32_t root, std::string_view xref_table) {
+    const int32_t info = 1; // Info object is the first printed.
     std::string buf;
-    auto documentid = create_trailer_id();
+    auto documentid = document_id(xref_table);
     std::format_to(std::back_inserter(buf),
                    R"(trailer
 <<
@@ -349,28 +1037,141 @@ startxref
     return write_bytes(buf);
 }
 
+rvoe<NoReturnValue> PdfWriter::write_cross_reference_stream(int32_t root) {
+    const int32_t info = 1;
+    const int32_t xref_number = doc.add_object(WrittenObject{});
+    const uint64_t xref_offset = bytes_written;
+    record_location(xref_number, DirectLocation{xref_offset});
+
+    // Each entry is a type byte, an offset or object stream number
+    // and a generation number or an index within the object stream.
+    const uint64_t max_value = std::max<uint64_t>(xref_offset, object_locations.size());
+    int32_t field_width = 1;
+    while(field_width < 8 && (max_value >> (8 * field_width)) != 0) {
+        ++field_width;
+    }
+    std::string entries;
+    auto append_field = [&entries](uint64_t value, int32_t width) {
+        for(int32_t i = width - 1; i >= 0; --i) {
+            entries += (char)((value >> (8 * i)) & 0xFF);
+        }
+    };
+    for(const auto &loc : object_locations) {
+        if(const auto *direct = std::get_if<DirectLocation>(&loc)) {
+            append_field(1, 1);
+            append_field(direct->offset, field_width);
+            append_field(0, 2);
+        } else if(const auto *packed = std::get_if<PackedLocation>(&loc)) {
+            append_field(2, 1);
+            append_field(packed->objstm_number, field_width);
+            append_field(packed->index, 2);
+        } else {
+            append_field(0, 1);
+            append_field(0, field_width);
+            append_field(65535, 2);
+        }
+    }
+    const auto &settings = doc.opts.compression.get(CAPY_STREAM_CLASS_OTHER);
+    ERC(compressed, encode_stream(entries, settings));
+    auto documentid = document_id(entries);
+    auto dict = std::format(R"(<<
+  /Type /XRef
+  /Size {}
+  /W [ 1 {} 2 ]
+  /Root {} 0 R
+  /Info {} 0 R
+  /ID [{}{}]
+{}>>
+)",
+                            object_locations.size(),
+                            field_width,
+                            root,
+                            info,
+                            documentid,
+                            documentid,
+                            stream_entries(default_encoding(settings), compressed.size()));
+    ERCV(write_finished_object(xref_number, dict, compressed));
+    count_stream(
+        CAPY_STREAM_CLASS_OTHER, default_encoding(settings), entries.size(), compressed.size());
+    return write_bytes(std::format(R"(startxref
+{}
+%%EOF
+)",
+                                   xref_offset));
+}
+
 rvoe<NoReturnValue> PdfWriter::write_finished_object(int32_t object_number,
                                                      std::string_view dict_data,
                                                      std::string_view stream_data) {
-    std::string buf;
-    auto appender = std::back_inserter(buf);
-    std::format_to(appender, "{} 0 obj\n", object_number);
-    buf += dict_data;
-    if(!stream_data.empty()) {
-        if(buf.back() != '\n') {
-            buf += '\n';
+    // Object streams get their numbers from the document,
+    // which the background writer thread must not modify.
+    const bool packable =
+        stream_data.empty() && doc.opts.object_streams && !background_writing;
+    if(capturing) {
+        auto &so = serialized.at(object_number - serialized_base);
+        so.present = true;
+        so.packable = packable;
+        if(packable) {
+            so.data = dict_data;
+        } else {
+            so.data = serialize_object(object_number, dict_data, stream_data);
         }
-        buf += "stream\n";
-        buf += stream_data;
-        // PDF spec says that there must always be a newline before "endstream".
-        // It is not counted in the /Length key in the object dictionary.
-        buf += "\nendstream\n";
+        return NoReturnValue{};
     }
-    if(buf.back() != '\n') {
-        buf += '\n';
+    if(packable) {
+        return pack_object(object_number, dict_data);
+    }
+    record_location(object_number, DirectLocation{bytes_written});
+    return write_bytes(serialize_object(object_number, dict_data, stream_data));
+}
+
+void PdfWriter::count_stream(CapyPDF_Stream_Class sclass,
+                             CapyPDF_Stream_Encoding encoding,
+                             uint64_t raw_size,
+                             uint64_t encoded_size) {
+    if(!doc.opts.write_stats) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    ++doc.write_stats.stream_counts[sclass][encoding];
+    doc.write_stats.raw_bytes[sclass] += raw_size;
+    doc.write_stats.encoded_bytes[sclass] += encoded_size;
+}
+
+void PdfWriter::count_objects() {
+    if(!doc.opts.write_stats) {
+        return;
+    }
+    auto &stats = doc.write_stats;
+    for(const auto &obj : doc.document_objects) {
+        int64_t size = sizeof(ObjectType);
+        if(const auto *full = std::get_if<FullPDFObject>(&obj)) {
+            size += full->dictionary.size() + full->stream.size();
+        } else if(const auto *deflate = std::get_if<DeflatePDFObject>(&obj)) {
+            size += deflate->unclosed_dictionary.size() + deflate->stream.size();
+        }
+        ++stats.object_counts[obj.index()];
+        stats.object_bytes[obj.index()] += size;
     }
-    buf += "endobj\n";
-    return write_bytes(buf);
+}
+
+void PdfWriter::add_phase_time(CapyPDF_Write_Phase phase, const PhaseTiming &elapsed) {
+    if(!doc.opts.write_stats) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    auto &timing = doc.write_stats.phases[phase];
+    timing.wall_ns += elapsed.wall_ns;
+    timing.cpu_ns += elapsed.cpu_ns;
+}
+
+void PdfWriter::note_buffered(uint64_t buffered_bytes) {
+    if(!doc.opts.write_stats) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    auto &peak = doc.write_stats.peak_buffered_bytes;
+    peak = std::max(peak, (int64_t)buffered_bytes);
 }
 
 rvoe<NoReturnValue> PdfWriter::write_subset_font(int32_t object_num,
@@ -382,7 +1183,28 @@ rvoe<NoReturnValue> PdfWriter::write_subset_font(int32_t object_num,
     const std::vector<TTGlyphs> &subset_glyphs = font.subsets.get_subset(subset);
     int32_t start_char = 0;
     int32_t end_char = subset_glyphs.size() - 1;
-    ERC(width_arr, build_subset_width_array(face, subset_glyphs));
+    auto prebuilt = subset_font_parts.find(object_num);
+    const auto width_arr = prebuilt != subset_font_parts.end()
+                               ? std::move(prebuilt->second)
+                               : build_subset_width_array(font.fontdata.fontdata, subset_glyphs);
+    if(font.encoding == CAPY_FONT_ENCODING_IDENTITY_H) {
+        // Descendant of a Type0 font, which holds the ToUnicode map.
+        auto objbuf = std::format(R"(<<
+  /Type /Font
+  /Subtype /CIDFontType2
+  /BaseFont /{}
+  /CIDSystemInfo << /Registry (Adobe) /Ordering (Identity) /Supplement 0 >>
+  /FontDescriptor {} 0 R
+  /W [ {} {} ]
+  /CIDToGIDMap /Identity
+>>
+)",
+                                  subsetfontname2pdfname(FT_Get_Postscript_Name(face), subset),
+                                  font_descriptor_obj,
+                                  start_char,
+                                  width_arr);
+        return write_finished_object(object_num, objbuf, "");
+    }
     auto objbuf = std::format(R"(<<
   /Type /Font
   /Subtype /TrueType
@@ -406,21 +1228,33 @@ rvoe<NoReturnValue> PdfWriter::write_subset_font(int32_t object_num,
 
 rvoe<NoReturnValue> PdfWriter::write_subset_font_data(int32_t object_num,
                                                       const DelayedSubsetFontData &ssfont) {
-    const auto &font = doc.fonts.at(ssfont.fid.id);
-    ERC(subset_font,
-        font.subsets.generate_subset(
-            font.fontdata.face.get(), font.fontdata.fontdata, ssfont.subset_id));
-
-    ERC(compressed_bytes, flate_compress(subset_font));
+    const auto &settings = doc.opts.compression.get(CAPY_STREAM_CLASS_FONT);
+    CompressedStream cs;
+    auto precompressed = compressed_streams.find(object_num);
+    if(precompressed != compressed_streams.end()) {
+        cs = std::move(precompressed->second);
+    } else {
+        const auto &font = doc.fonts.at(ssfont.fid.id);
+        ERC(subset_font,
+            font.subsets.generate_subset(
+                font.fontdata.face.get(), font.fontdata.fontdata, ssfont.subset_id));
+        cs.uncompressed_size = subset_font.size();
+        cs.data = encode_stream(subset_font, settings);
+        cs.encoding = default_encoding(settings);
+    }
+    if(!cs.data) {
+        return std::unexpected(cs.data.error());
+    }
+    const auto &compressed_bytes = cs.data.value();
     std::string dictbuf = std::format(R"(<<
-  /Length {}
-  /Length1 {}
-  /Filter /FlateDecode
+{}  /Length1 {}
 >>
 )",
-                                      compressed_bytes.size(),
-                                      subset_font.size());
+                                      stream_entries(cs.encoding, compressed_bytes.size()),
+                                      cs.uncompressed_size);
     ERCV(write_finished_object(object_num, dictbuf, compressed_bytes));
+    count_stream(
+        CAPY_STREAM_CLASS_FONT, cs.encoding, cs.uncompressed_size, compressed_bytes.size());
     return NoReturnValue{};
 }
 
@@ -461,7 +1295,11 @@ void PdfWriter::write_subset_font_descriptor(int32_t object_num,
 
 rvoe<NoReturnValue>
 PdfWriter::write_subset_cmap(int32_t object_num, const FontThingy &font, int32_t subset_number) {
-    auto cmap = create_subset_cmap(font.subsets.get_subset(subset_number));
+    auto prebuilt = subset_font_parts.find(object_num);
+    const auto cmap = prebuilt != subset_font_parts.end()
+                          ? std::move(prebuilt->second)
+                          : create_subset_cmap(font.subsets.get_subset(subset_number),
+                                               font.encoding == CAPY_FONT_ENCODING_IDENTITY_H);
     auto dict = std::format(R"(<<
   /Length {}
 >>
@@ -485,6 +1323,11 @@ rvoe<NoReturnValue> PdfWriter::write_pages_root() {
 }
 
 rvoe<NoReturnValue> PdfWriter::write_delayed_page(const DelayedPage &dp) {
+    return write_finished_object(
+        doc.pages.at(dp.page_num).page_obj_num, serialize_delayed_page(dp), "");
+}
+
+std::string PdfWriter::serialize_delayed_page(const DelayedPage &dp) {
     std::string buf;
 
     auto buf_append = std::back_inserter(buf);
@@ -527,12 +1370,16 @@ rvoe<NoReturnValue> PdfWriter::write_delayed_page(const DelayedPage &dp) {
         std::format_to(buf_append, "  /UserUnit {:f}\n", *current_props.user_unit);
     }
 
-    std::format_to(buf_append,
-                   R"(  /Contents {} 0 R
-  /Resources {} 0 R
-)",
-                   p.commands_obj_num,
-                   p.resource_obj_num);
+    if(p.num_content_chunks > 0) {
+        buf += "  /Contents [\n";
+        for(int32_t i = p.commands_obj_num - p.num_content_chunks; i <= p.commands_obj_num; ++i) {
+            std::format_to(buf_append, "    {} 0 R\n", i);
+        }
+        buf += "  ]\n";
+    } else {
+        std::format_to(buf_append, "  /Contents {} 0 R\n", p.commands_obj_num);
+    }
+    std::format_to(buf_append, "  /Resources {} 0 R\n", p.resource_obj_num);
 
     if(!dp.used_form_widgets.empty() || !dp.used_annotations.empty()) {
         buf += "  /Annots [\n";
@@ -553,8 +1400,7 @@ rvoe<NoReturnValue> PdfWriter::write_delayed_page(const DelayedPage &dp) {
         std::format_to(buf_append, "  /PresSteps {} 0 R\n", dp.subnav_root.value());
     }
     buf += ">>\n";
-
-    return write_finished_object(p.page_obj_num, buf, "");
+    return buf;
 }
 
 rvoe<NoReturnValue>
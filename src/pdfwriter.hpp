@@ -4,32 +4,129 @@
 #pragma once
 
 #include <document.hpp>
+#include <utils.hpp>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 namespace capypdf::internal {
 
+struct DirectLocation {
+    uint64_t offset;
+};
+
+struct PackedLocation {
+    int32_t objstm_number;
+    int32_t index;
+};
+
+typedef std::variant<std::monostate, DirectLocation, PackedLocation> ObjectLocation;
+
+// Writes to a temporary file that is renamed to the final
+// name only after it has been fully written and synced to disk.
+struct FileSink {
+    std::unique_ptr<FILE, int (*)(FILE *)> f{nullptr, fclose};
+    std::filesystem::path final_name;
+    std::filesystem::path temp_name;
+};
+
+struct CallbackSink {
+    CapyPDF_Write_Callback cb;
+    void *user_data;
+};
+
+struct MemorySink {
+    std::string *output;
+};
+
+typedef std::variant<std::monostate, FileSink, CallbackSink, MemorySink> OutputSink;
+
+struct CompressedStream {
+    // Empty for raw DeflatePDFObjects, whose own data is written as is.
+    rvoe<std::string> data;
+    size_t uncompressed_size = 0;
+    CapyPDF_Stream_Encoding encoding = CAPY_STREAM_ENCODING_DEFLATE;
+};
+
+// An object serialized ahead of writing. Objects that go in an object
+// stream hold only their dictionary, the rest hold their complete text.
+struct SerializedObject {
+    std::string data;
+    bool present = false;
+    bool packable = false;
+    ErrorCode error = ErrorCode::NoError;
+};
+
+// The objects of one page, detached from the document so that
+// the background writer thread can use them without locking.
+struct QueuedPage {
+    std::vector<std::pair<int32_t, ObjectType>> objects;
+    uint64_t size = 0;
+};
+
 class PdfWriter {
 public:
     explicit PdfWriter(PdfDocument &doc);
+    ~PdfWriter();
     rvoe<NoReturnValue> write_to_file(const std::filesystem::path &ofilename);
+    rvoe<NoReturnValue> write_to_callback(CapyPDF_Write_Callback cb, void *user_data);
+    rvoe<NoReturnValue> write_to_memory(std::string &output);
+
+    // Streaming mode. The output file is opened up front, every page is
+    // written out as soon as it is finished and the remaining objects
+    // are written when the document is finalized. If the document has a
+    // write queue, pages are written by a background thread instead.
+    rvoe<NoReturnValue> begin_streaming(const std::filesystem::path &ofilename);
+    rvoe<NoReturnValue> stream_page(const PageOffsets &p);
+    rvoe<NoReturnValue> finish_streaming();
 
 private:
-    rvoe<NoReturnValue> write_to_file(FILE *output_file);
+    rvoe<NoReturnValue> check_writability();
+    rvoe<NoReturnValue> write_all();
+    rvoe<NoReturnValue> open_file(const std::filesystem::path &ofilename);
+    rvoe<NoReturnValue> close_output();
     rvoe<NoReturnValue> write_to_file_impl();
+    rvoe<NoReturnValue> build_subset_fonts();
+    rvoe<NoReturnValue> precompress_streams();
+
+    rvoe<NoReturnValue> queue_page(const PageOffsets &p);
+    void background_writer();
+    rvoe<NoReturnValue> stop_background_writer();
 
     rvoe<NoReturnValue> write_bytes(const char *buf,
                                     size_t buf_size); // With error checking.
     rvoe<NoReturnValue> write_bytes(std::string_view view) {
         return write_bytes(view.data(), view.size());
     }
+    rvoe<NoReturnValue> write_buffers(const std::vector<std::string_view> &buffers);
 
-    rvoe<std::vector<uint64_t>> write_objects();
+    rvoe<NoReturnValue> write_objects();
+    rvoe<NoReturnValue> write_objects_parallel();
+    rvoe<NoReturnValue> serialize_window(int32_t first, int32_t end);
+    rvoe<NoReturnValue> write_object(int32_t object_number);
+    rvoe<NoReturnValue> write_object(int32_t object_number, const ObjectType &obj);
+    void record_location(int32_t object_number, ObjectLocation loc);
+    rvoe<NoReturnValue> pack_object(int32_t object_number, std::string_view dict_data);
+    rvoe<NoReturnValue> flush_object_stream(bool force);
 
     rvoe<NoReturnValue> write_header();
-    rvoe<NoReturnValue> write_cross_reference_table(const std::vector<uint64_t> &object_offsets);
-    rvoe<NoReturnValue> write_trailer(int64_t xref_offset);
+    rvoe<NoReturnValue> write_cross_reference_table(std::string &table);
+    rvoe<NoReturnValue>
+    write_trailer(int64_t xref_offset, int32_t root, std::string_view xref_table);
+    std::string document_id(std::string_view xref_data) const;
+    rvoe<NoReturnValue> write_cross_reference_stream(int32_t root);
     rvoe<NoReturnValue> write_finished_object(int32_t object_number,
                                               std::string_view dict_data,
                                               std::string_view stream_data);
+    void count_stream(CapyPDF_Stream_Class sclass,
+                      CapyPDF_Stream_Encoding encoding,
+                      uint64_t raw_size,
+                      uint64_t encoded_size);
+    void count_objects();
+    void add_phase_time(CapyPDF_Write_Phase phase, const PhaseTiming &elapsed);
+    void note_buffered(uint64_t buffered_bytes);
     rvoe<NoReturnValue> write_subset_font_data(int32_t object_num,
                                                const DelayedSubsetFontData &ssfont);
     void write_subset_font_descriptor(int32_t object_num,
@@ -45,13 +142,45 @@ private:
                                           int32_t tounicode_obj);
     rvoe<NoReturnValue> write_pages_root();
     rvoe<NoReturnValue> write_delayed_page(const DelayedPage &p);
+    std::string serialize_delayed_page(const DelayedPage &p);
     rvoe<NoReturnValue> write_checkbox_widget(int obj_num,
                                               const DelayedCheckboxWidgetAnnotation &checkbox);
     rvoe<NoReturnValue> write_annotation(int obj_num, const DelayedAnnotation &annotation);
     rvoe<NoReturnValue> write_delayed_structure_item(int obj_num, const DelayedStructItem &p);
 
     PdfDocument &doc;
-    FILE *ofile = nullptr;
+    OutputSink sink;
+    uint64_t bytes_written = 0;
+    // Hash of all output, kept for reproducible document IDs.
+    std::optional<ContentHasher> output_hash;
+    // Stream data compressed ahead of time when writing in parallel,
+    // indexed by object number.
+    std::unordered_map<int32_t, CompressedStream> compressed_streams;
+    // Width arrays and ToUnicode maps of subset fonts built ahead of time
+    // when writing in parallel, indexed by object number.
+    std::unordered_map<int32_t, std::string> subset_font_parts;
+    // Indexed by object number.
+    std::vector<ObjectLocation> object_locations;
+    // Objects waiting to be put in the next object stream
+    // and their offsets within it.
+    std::vector<std::pair<int32_t, size_t>> packed_objects;
+    std::string packed_data;
+    // While objects are serialized in parallel, finished objects are
+    // stored here, indexed from serialized_base, instead of being written.
+    bool capturing = false;
+    int32_t serialized_base = 0;
+    std::vector<SerializedObject> serialized;
+    std::mutex stats_mutex;
+    // Background writing state. While the writer thread runs, only it
+    // touches the output and the object locations.
+    bool background_writing = false;
+    std::thread writer_thread;
+    std::mutex queue_mutex;
+    std::condition_variable queue_changed;
+    std::deque<QueuedPage> write_queue;
+    uint64_t queued_bytes = 0;
+    bool queue_closed = false;
+    ErrorCode background_error = ErrorCode::NoError;
 };
 
 } // namespace capypdf::internal
@@ -3,6 +3,9 @@
 
 #include <utils.hpp>
 #include <zlib.h>
+#ifdef CAPY_USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 #include <cassert>
 #include <cstring>
 #ifdef _WIN32
@@ -12,9 +15,14 @@
 #include <sys/time.h>
 #endif
 
+#include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <charconv>
 #include <format>
 #include <memory>
 #include <random>
+#include <thread>
 
 namespace capypdf::internal {
 
@@ -86,9 +94,124 @@ bool needs_quoting(const unsigned char c) {
     return false;
 }
 
+// Streams smaller than this are always deflated, probing them is not worth it.
+const size_t probe_min_size = 4096;
+const size_t probe_sample_size = 4096;
+const size_t probe_num_samples = 8;
+// Bits per byte above which deflate can not gain anything meaningful.
+const double incompressible_entropy = 7.8;
+// How much a predictor must lower the entropy to be worth using.
+const double min_predictor_gain = 0.5;
+
+typedef std::array<uint64_t, 256> ByteHistogram;
+
+double entropy(const ByteHistogram &histogram) {
+    uint64_t total = 0;
+    for(const auto count : histogram) {
+        total += count;
+    }
+    if(total == 0) {
+        return 0;
+    }
+    double bits = 0;
+    for(const auto count : histogram) {
+        if(count != 0) {
+            const double p = (double)count / total;
+            bits -= p * std::log2(p);
+        }
+    }
+    return bits;
+}
+
+size_t row_size(const RawPixelLayout &pixels) {
+    return ((size_t)pixels.width * pixels.channels * pixels.bits_per_component + 7) / 8;
+}
+
+// Distance to the corresponding byte in the previous pixel. PNG uses one byte
+// for images with less than eight bits per pixel.
+size_t pixel_size(const RawPixelLayout &pixels) {
+    return std::max<size_t>(1, (size_t)pixels.channels * pixels.bits_per_component / 8);
+}
+
+uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+    const int p = (int)a + b - c;
+    const int pa = std::abs(p - a);
+    const int pb = std::abs(p - b);
+    const int pc = std::abs(p - c);
+    if(pa <= pb && pa <= pc) {
+        return a;
+    }
+    return pb <= pc ? b : c;
+}
+
+template<typename F>
+void paeth_row(const uint8_t *row, const uint8_t *prev, size_t rsize, size_t psize, F &&out) {
+    for(size_t i = 0; i < rsize; ++i) {
+        const uint8_t a = i >= psize ? row[i - psize] : 0;
+        const uint8_t b = prev ? prev[i] : 0;
+        const uint8_t c = prev && i >= psize ? prev[i - psize] : 0;
+        out((uint8_t)(row[i] - paeth(a, b, c)));
+    }
+}
+
+#ifndef CAPY_USE_LIBDEFLATE
+int zlib_strategy(CapyPDF_Deflate_Strategy strategy) {
+    switch(strategy) {
+    case CAPY_DEFLATE_FILTERED:
+        return Z_FILTERED;
+    case CAPY_DEFLATE_HUFFMAN_ONLY:
+        return Z_HUFFMAN_ONLY;
+    case CAPY_DEFLATE_RLE:
+        return Z_RLE;
+    default:
+        return Z_DEFAULT_STRATEGY;
+    }
+}
+#endif
+
+uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+const uint64_t murmur_c1 = 0x87c37b91114253d5ULL;
+const uint64_t murmur_c2 = 0x4cf5ad432745937fULL;
+
+uint64_t mix_k1(uint64_t k1) { return rotl64(k1 * murmur_c1, 31) * murmur_c2; }
+
+uint64_t mix_k2(uint64_t k2) { return rotl64(k2 * murmur_c2, 33) * murmur_c1; }
+
 } // namespace
 
-rvoe<std::string> flate_compress(std::string_view data) {
+#ifdef CAPY_USE_LIBDEFLATE
+
+rvoe<std::string> flate_compress(std::string_view data, const DeflateSettings &settings) {
+    // Libdeflate picks block types on its own, so the strategy is ignored.
+    std::unique_ptr<libdeflate_compressor, void (*)(libdeflate_compressor *)> compressor(
+        libdeflate_alloc_compressor(settings.level), libdeflate_free_compressor);
+    if(!compressor) {
+        RETERR(CompressionFailure);
+    }
+    std::string compressed;
+    compressed.resize(libdeflate_zlib_compress_bound(compressor.get(), data.size()));
+    const size_t compressed_size = libdeflate_zlib_compress(
+        compressor.get(), data.data(), data.size(), compressed.data(), compressed.size());
+    if(compressed_size == 0) {
+        RETERR(CompressionFailure);
+    }
+    compressed.resize(compressed_size);
+    return std::move(compressed);
+}
+
+#else
+
+rvoe<std::string> flate_compress(std::string_view data, const DeflateSettings &settings) {
     std::string compressed;
     const int CHUNK = 1024 * 1024;
     std::string buf;
@@ -97,7 +220,8 @@ rvoe<std::string> flate_compress(std::string_view data) {
     strm.zfree = Z_NULL;
     strm.opaque = Z_NULL;
 
-    auto ret = deflateInit(&strm, Z_BEST_COMPRESSION);
+    auto ret = deflateInit2(
+        &strm, settings.level, Z_DEFLATED, 15, 8, zlib_strategy(settings.strategy));
     if(ret != Z_OK) {
         RETERR(CompressionFailure);
     }
@@ -127,6 +251,212 @@ rvoe<std::string> flate_compress(std::string_view data) {
     return std::move(compressed);
 }
 
+#endif
+
+CapyPDF_Stream_Encoding probe_stream_encoding(std::string_view data,
+                                              const std::optional<RawPixelLayout> &pixels) {
+    if(data.size() < probe_min_size) {
+        return CAPY_STREAM_ENCODING_DEFLATE;
+    }
+    const auto *bytes = (const uint8_t *)data.data();
+    ByteHistogram raw{};
+    if(pixels) {
+        const size_t rsize = row_size(*pixels);
+        const size_t num_rows = rsize > 0 ? data.size() / rsize : 0;
+        if(num_rows >= 2 && num_rows * rsize == data.size()) {
+            // Compare the raw bytes of a few rows against their prediction residuals.
+            ByteHistogram residual{};
+            const size_t psize = pixel_size(*pixels);
+            const size_t num_samples = std::min(probe_num_samples, num_rows - 1);
+            for(size_t i = 0; i < num_samples; ++i) {
+                const size_t row = 1 + i * (num_rows - 1) / num_samples;
+                const uint8_t *cur = bytes + row * rsize;
+                for(size_t j = 0; j < rsize; ++j) {
+                    ++raw[cur[j]];
+                }
+                paeth_row(cur, cur - rsize, rsize, psize, [&](uint8_t b) { ++residual[b]; });
+            }
+            const double raw_entropy = entropy(raw);
+            const double residual_entropy = entropy(residual);
+            if(std::min(raw_entropy, residual_entropy) > incompressible_entropy) {
+                return CAPY_STREAM_ENCODING_RAW;
+            }
+            if(residual_entropy + min_predictor_gain < raw_entropy) {
+                return CAPY_STREAM_ENCODING_PNG_PREDICTOR;
+            }
+            return CAPY_STREAM_ENCODING_DEFLATE;
+        }
+    }
+    const size_t sample_size = std::min(probe_sample_size, data.size() / probe_num_samples);
+    for(size_t i = 0; i < probe_num_samples; ++i) {
+        const size_t offset = i * (data.size() - sample_size) / (probe_num_samples - 1);
+        for(size_t j = 0; j < sample_size; ++j) {
+            ++raw[bytes[offset + j]];
+        }
+    }
+    return entropy(raw) > incompressible_entropy ? CAPY_STREAM_ENCODING_RAW
+                                                 : CAPY_STREAM_ENCODING_DEFLATE;
+}
+
+std::string png_predict(std::string_view data, const RawPixelLayout &pixels) {
+    const size_t rsize = row_size(pixels);
+    const size_t psize = pixel_size(pixels);
+    const auto *bytes = (const uint8_t *)data.data();
+    std::string predicted;
+    predicted.reserve(data.size() + data.size() / rsize);
+    const uint8_t *prev = nullptr;
+    for(size_t offset = 0; offset + rsize <= data.size(); offset += rsize) {
+        const uint8_t *cur = bytes + offset;
+        // Every row starts with its PNG filter type.
+        predicted += (char)4;
+        paeth_row(cur, prev, rsize, psize, [&](uint8_t b) { predicted += (char)b; });
+        prev = cur;
+    }
+    return predicted;
+}
+
+CapyPDF_Stream_Encoding choose_stream_encoding(std::string_view data,
+                                               CapyPDF_Stream_Class sclass,
+                                               const std::optional<RawPixelLayout> &pixels,
+                                               const CompressionPolicy &policy) {
+    if(policy.get(sclass).level == 0) {
+        return CAPY_STREAM_ENCODING_RAW;
+    }
+    // Images and attachments are often already compressed or noisy.
+    const bool probed =
+        sclass == CAPY_STREAM_CLASS_IMAGE || sclass == CAPY_STREAM_CLASS_EMBEDDED_FILE;
+    if(policy.probe && probed) {
+        return probe_stream_encoding(data, pixels);
+    }
+    return CAPY_STREAM_ENCODING_DEFLATE;
+}
+
+rvoe<std::string> encode_stream_data(std::string_view data,
+                                     CapyPDF_Stream_Encoding encoding,
+                                     const std::optional<RawPixelLayout> &pixels,
+                                     const DeflateSettings &settings) {
+    assert(encoding != CAPY_STREAM_ENCODING_RAW);
+    if(encoding == CAPY_STREAM_ENCODING_PNG_PREDICTOR) {
+        return flate_compress(png_predict(data, pixels.value()), settings);
+    }
+    return flate_compress(data, settings);
+}
+
+char *format_number(char *buf, const PdfNumber &n) {
+    char *const buf_end = buf + max_number_length;
+    if(!std::isfinite(n.value)) {
+        // Infinities and NaN are not representable in PDF.
+        *buf = '0';
+        return buf + 1;
+    }
+    // Whole numbers are common in content streams, skip the decimals for them.
+    if(std::trunc(n.value) == n.value && std::abs(n.value) < 1e15) {
+        return std::to_chars(buf, buf_end, (int64_t)n.value).ptr;
+    }
+    char *end = std::to_chars(buf, buf_end, n.value, std::chars_format::fixed, n.precision).ptr;
+    if(std::find(buf, end, '.') != end) {
+        while(end[-1] == '0') {
+            --end;
+        }
+        if(end[-1] == '.') {
+            --end;
+        }
+    }
+    // Values that round to zero would otherwise be written as "-0".
+    if(end - buf == 2 && buf[0] == '-' && buf[1] == '0') {
+        *buf = '0';
+        return buf + 1;
+    }
+    return end;
+}
+
+ContentHash hash_content(std::string_view data, ContentHash seed) {
+    ContentHasher hasher(seed);
+    hasher.update(data);
+    return hasher.digest();
+}
+
+void ContentHasher::add_block(const char *block) {
+    uint64_t k1, k2;
+    memcpy(&k1, block, sizeof(k1));
+    memcpy(&k2, block + 8, sizeof(k2));
+    h1 ^= mix_k1(k1);
+    h1 = rotl64(h1, 27) + h2;
+    h1 = h1 * 5 + 0x52dce729;
+    h2 ^= mix_k2(k2);
+    h2 = rotl64(h2, 31) + h1;
+    h2 = h2 * 5 + 0x38495ab5;
+}
+
+void ContentHasher::update(std::string_view data) {
+    length += data.size();
+    if(pending_size > 0) {
+        const size_t fill = std::min(sizeof(pending) - pending_size, data.size());
+        memcpy(pending + pending_size, data.data(), fill);
+        pending_size += fill;
+        data.remove_prefix(fill);
+        if(pending_size < sizeof(pending)) {
+            return;
+        }
+        add_block(pending);
+        pending_size = 0;
+    }
+    while(data.size() >= sizeof(pending)) {
+        add_block(data.data());
+        data.remove_prefix(sizeof(pending));
+    }
+    memcpy(pending, data.data(), data.size());
+    pending_size = data.size();
+}
+
+ContentHash ContentHasher::digest() const {
+    uint64_t d1 = h1;
+    uint64_t d2 = h2;
+    // The tail is zero padded, which is the same as the reference byte by byte switch.
+    if(pending_size > 0) {
+        uint64_t tail[2] = {0, 0};
+        memcpy(tail, pending, pending_size);
+        if(pending_size > 8) {
+            d2 ^= mix_k2(tail[1]);
+        }
+        d1 ^= mix_k1(tail[0]);
+    }
+    d1 ^= length;
+    d2 ^= length;
+    d1 += d2;
+    d2 += d1;
+    d1 = fmix64(d1);
+    d2 = fmix64(d2);
+    d1 += d2;
+    d2 += d1;
+    return ContentHash{d1, d2};
+}
+
+void parallel_for(size_t num_jobs, int32_t num_threads, const std::function<void(size_t)> &func) {
+    size_t thread_count =
+        num_threads > 0 ? (size_t)num_threads : (size_t)std::thread::hardware_concurrency();
+    thread_count = std::min(thread_count, num_jobs);
+    if(thread_count <= 1) {
+        for(size_t i = 0; i < num_jobs; ++i) {
+            func(i);
+        }
+        return;
+    }
+    std::atomic<size_t> next_job{0};
+    auto worker = [&]() {
+        size_t i;
+        while((i = next_job.fetch_add(1)) < num_jobs) {
+            func(i);
+        }
+    };
+    std::vector<std::jthread> threads;
+    threads.reserve(thread_count - 1);
+    for(size_t i = 1; i < thread_count; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+}
+
 rvoe<std::string> load_file(const char *fname) {
     FILE *f = fopen(fname, "rb");
     if(!f) {
@@ -277,6 +607,35 @@ bool is_ascii(std::string_view text) {
 }
 
 // As in PDF 2.0 spec 7.3.5
+std::string fontname2pdfname(std::string_view original) {
+    std::string out;
+    out.reserve(original.size());
+    for(const auto c : original) {
+        if(c == ' ') {
+            continue;
+        }
+        if(c == '\\') {
+            continue;
+        }
+        out += c;
+    }
+    // FIXME: might need to escape other special characters as well.
+    return out;
+}
+
+std::string subsetfontname2pdfname(std::string_view original, const int32_t subset_number) {
+    std::string out;
+    const int bufsize = 10;
+    char buf[bufsize];
+    snprintf(buf, bufsize, "%06d", subset_number);
+    for(int i = 0; i < 6; ++i) {
+        out += 'A' + (buf[i] - '0');
+    }
+    out += "+";
+    out += fontname2pdfname(original);
+    return out;
+}
+
 std::string bytes2pdfstringliteral(std::string_view raw, bool add_slash) {
     std::string result;
     char buf[10];
@@ -298,17 +657,24 @@ std::string bytes2pdfstringliteral(std::string_view raw, bool add_slash) {
     return result;
 }
 
-std::string create_trailer_id() {
+std::string create_trailer_id(ContentHash content) {
     int num_bytes = 16;
     std::string msg;
     msg.reserve(num_bytes * 2 + 2);
     auto app = std::back_inserter(msg);
     msg.push_back('<');
-    std::random_device r;
-    std::default_random_engine gen(r());
-    std::uniform_int_distribution<int> dist(0, 255);
-    for(int i = 0; i < num_bytes; ++i) {
-        std::format_to(app, "{:02X}", (unsigned char)dist(gen));
+    if(const char *epoch = getenv("SOURCE_DATE_EPOCH")) {
+        // Reproducible builds need identical output for identical input,
+        // but documents built with the same epoch must still differ.
+        const auto h = hash_content(epoch, content);
+        std::format_to(app, "{:016X}{:016X}", h.hi, h.lo);
+    } else {
+        std::random_device r;
+        std::default_random_engine gen(r());
+        std::uniform_int_distribution<int> dist(0, 255);
+        for(int i = 0; i < num_bytes; ++i) {
+            std::format_to(app, "{:02X}", (unsigned char)dist(gen));
+        }
     }
     msg.push_back('>');
     return msg;
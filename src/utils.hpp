@@ -11,6 +11,9 @@
 #include <string_view>
 #include <filesystem>
 #include <vector>
+#include <functional>
+#include <algorithm>
+#include <format>
 
 namespace capypdf::internal {
 
@@ -22,7 +25,61 @@ template<class... Ts> struct overloaded : Ts... {
 template<class... Ts> overloaded(Ts...) -> overloaded<Ts...>;
 #endif
 
-rvoe<std::string> flate_compress(std::string_view data);
+rvoe<std::string> flate_compress(std::string_view data,
+                                 const DeflateSettings &settings = DeflateSettings{});
+
+CapyPDF_Stream_Encoding probe_stream_encoding(std::string_view data,
+                                              const std::optional<RawPixelLayout> &pixels);
+
+std::string png_predict(std::string_view data, const RawPixelLayout &pixels);
+
+// The encoding the policy gives a stream of the given class.
+CapyPDF_Stream_Encoding choose_stream_encoding(std::string_view data,
+                                               CapyPDF_Stream_Class sclass,
+                                               const std::optional<RawPixelLayout> &pixels,
+                                               const CompressionPolicy &policy);
+
+// Compresses the data for an encoding other than raw.
+rvoe<std::string> encode_stream_data(std::string_view data,
+                                     CapyPDF_Stream_Encoding encoding,
+                                     const std::optional<RawPixelLayout> &pixels,
+                                     const DeflateSettings &settings);
+
+// Longest possible output of format_number, DBL_MAX has 309 integer digits.
+const size_t max_number_length = 330;
+
+// Writes the number to buf, which must hold max_number_length
+// characters, and returns the end of the output.
+char *format_number(char *buf, const PdfNumber &n);
+
+// MurmurHash3 x64 128. Hashes are only compared within one process so
+// they are not portable between byte orders. Pass the hash of a previous
+// block as the seed to hash several blocks as one.
+ContentHash hash_content(std::string_view data, ContentHash seed = ContentHash{});
+
+// Computes hash_content over data given in parts. The result does not
+// depend on how the data is split between calls to update.
+class ContentHasher {
+public:
+    explicit ContentHasher(ContentHash seed = ContentHash{}) : h1{seed.lo}, h2{seed.hi} {}
+
+    void update(std::string_view data);
+    ContentHash digest() const;
+
+private:
+    void add_block(const char *block);
+
+    uint64_t h1;
+    uint64_t h2;
+    uint64_t length = 0;
+    char pending[16];
+    size_t pending_size = 0;
+};
+
+// Calls func(i) for every i in [0, num_jobs) using at most num_threads
+// threads. Zero means one thread per hardware core. The function must
+// not throw and calls for different indexes must be independent.
+void parallel_for(size_t num_jobs, int32_t num_threads, const std::function<void(size_t)> &func);
 
 rvoe<std::string> load_file(const char *fname);
 
@@ -44,7 +101,12 @@ bool is_ascii(std::string_view text);
 
 std::string bytes2pdfstringliteral(std::string_view raw, bool add_slash = true);
 
-std::string create_trailer_id();
+std::string fontname2pdfname(std::string_view original);
+
+// Prefixes the font name with a tag that is unique to the subset.
+std::string subsetfontname2pdfname(std::string_view original, const int32_t subset_number);
+
+std::string create_trailer_id(ContentHash content);
 
 void serialize_trans(std::back_insert_iterator<std::string> buf_append,
                      const Transition &t,
@@ -53,3 +115,14 @@ void serialize_trans(std::back_insert_iterator<std::string> buf_append,
 void quote_xml_element_data_into(const u8string &content, std::string &result);
 
 } // namespace capypdf::internal
+
+template<> struct std::formatter<capypdf::internal::PdfNumber> {
+    constexpr auto parse(std::format_parse_context &ctx) { return ctx.begin(); }
+
+    template<typename FormatContext>
+    auto format(const capypdf::internal::PdfNumber &n, FormatContext &ctx) const {
+        char buf[capypdf::internal::max_number_length];
+        const char *end = capypdf::internal::format_number(buf, n);
+        return std::copy(static_cast<const char *>(buf), end, ctx.out());
+    }
+};
@@ -5,7 +5,8 @@
 
 
 import unittest
-import os, sys, pathlib, shutil, subprocess
+import os, sys, pathlib, shutil, subprocess, re
+import array
 try:
     import PIL.Image, PIL.ImageChops
 except ModuleNotFoundError:
@@ -22,6 +23,7 @@ icc_dir = source_root / 'icc'
 sys.path.append(str(source_root / 'python'))
 
 noto_fontdir = pathlib.Path('/usr/share/fonts/truetype/noto')
+dejavu_fontdir = pathlib.Path('/usr/share/fonts/truetype/dejavu')
 
 sys.argv = sys.argv[0:1] + sys.argv[2:]
 
@@ -35,6 +37,23 @@ def draw_intersect_shape(ctx):
     ctx.cmd_l(20, 10)
     ctx.cmd_h()
 
+def text_document_options(w, h):
+    opts = capypdf.DocumentMetadata()
+    props = capypdf.PageProperties()
+    props.set_pagebox(capypdf.PageBox.Media, 0, 0, w, h)
+    opts.set_default_page_properties(props)
+    opts.set_language('en-US')
+    return opts
+
+def render_kerning_text(g, ctx):
+    fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+    ctx.render_text('Av, Tv, kerning yo.', fid, 12, 50, 150)
+
+def content_stream(data):
+    # The first uncompressed stream that starts by saving the graphics state.
+    start = data.index(b'stream\nq\n') + len(b'stream\n')
+    return data[start:data.index(b'endstream', start)]
+
 def validate_image(basename, w, h):
     import functools
     def decorator_validate(func):
@@ -109,6 +128,45 @@ class TestPDFCreation(unittest.TestCase):
                 ctx.cmd_re(10, 10, 100, 100)
                 ctx.cmd_f()
 
+    @validate_image('python_simple', 480, 640)
+    def test_streaming(self, ofilename, w, h):
+        opts = capypdf.DocumentMetadata()
+        opts.set_stream_pages(True)
+        with capypdf.Generator(ofilename, opts) as g:
+            with g.page_draw_context() as ctx:
+                ctx.cmd_rg(1.0, 0.0, 0.0)
+                ctx.cmd_re(10, 10, 100, 100)
+                ctx.cmd_f()
+
+    def test_streaming_abandoned(self):
+        ofile = pathlib.Path('abandoned.pdf')
+        tempfile = ofile.with_suffix('.pdf~')
+        opts = capypdf.DocumentMetadata()
+        opts.set_stream_pages(True)
+        g = capypdf.Generator(ofile, opts)
+        with g.page_draw_context() as ctx:
+            ctx.cmd_re(10, 10, 100, 100)
+            ctx.cmd_f()
+        self.assertTrue(tempfile.exists())
+        g = None # Destroy without writing.
+        self.assertFalse(tempfile.exists())
+        self.assertFalse(ofile.exists())
+
+    @validate_image('python_simple', 480, 640)
+    def test_background_writer(self, ofilename, w, h):
+        opts = capypdf.DocumentMetadata()
+        opts.set_write_queue(2, 1024)
+        with self.assertRaises(capypdf.CapyPDFException) as cm:
+            capypdf.Generator(ofilename, opts)
+        self.assertEqual(str(cm.exception), 'Write queue requires streaming pages.')
+        opts.set_stream_pages(True)
+        with capypdf.Generator(ofilename, opts) as g:
+            for i in range(10):
+                with g.page_draw_context() as ctx:
+                    ctx.cmd_rg(1.0, 0.0, 0.0)
+                    ctx.cmd_re(10, 10, 100, 100)
+                    ctx.cmd_f()
+
     @validate_image('python_text', 400, 400)
     def test_text(self, ofilename, w, h):
         opts = capypdf.DocumentMetadata()
@@ -121,6 +179,512 @@ class TestPDFCreation(unittest.TestCase):
             with g.page_draw_context() as ctx:
                 ctx.render_text('Av, Tv, kerning yo.', fid, 12, 50, 150)
 
+    @validate_image('python_simple', 480, 640)
+    def test_write_to_bytes(self, ofilename, w, h):
+        g = capypdf.Generator(ofilename)
+        with g.page_draw_context() as ctx:
+            ctx.cmd_rg(1.0, 0.0, 0.0)
+            ctx.cmd_re(10, 10, 100, 100)
+            ctx.cmd_f()
+        pdf_data = g.write_to_bytes()
+        self.assertTrue(pdf_data.startswith(b'%PDF-'))
+        self.assertFalse(ofilename.exists())
+        ofilename.write_bytes(pdf_data)
+
+    @validate_image('python_simple', 480, 640)
+    def test_compression_probe(self, ofilename, w, h):
+        opts = capypdf.DocumentMetadata()
+        opts.set_write_stats(True)
+        g = capypdf.Generator(ofilename, opts)
+        g.embed_file(image_dir / 'simple.jpg')
+        g.embed_file(image_dir / '../readme.md')
+        with g.page_draw_context() as ctx:
+            ctx.cmd_rg(1.0, 0.0, 0.0)
+            ctx.cmd_re(10, 10, 100, 100)
+            ctx.cmd_f()
+        g.write()
+        stats = g.get_stats()
+        # JPEG data is incompressible, the probe should store it as is.
+        self.assertEqual(stats.get_stream_count(capypdf.StreamClass.EmbeddedFile,
+                                                capypdf.StreamEncoding.Raw), 1)
+        self.assertEqual(stats.get_stream_count(capypdf.StreamClass.EmbeddedFile,
+                                                capypdf.StreamEncoding.Deflate), 1)
+
+    @validate_image('python_simple', 480, 640)
+    def test_deduplication(self, ofilename, w, h):
+        opts = capypdf.DocumentMetadata()
+        opts.set_write_stats(True)
+        g = capypdf.Generator(ofilename, opts)
+        fid1 = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+        fid2 = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+        self.assertEqual(fid1.id, fid2.id)
+        params = capypdf.ImagePdfProperties()
+        image = g.load_image(image_dir / 'gray_alpha.png')
+        iid1 = g.add_image(image, params)
+        iid2 = g.add_image(image, params)
+        self.assertEqual(iid1.id, iid2.id)
+        eid1 = g.embed_file(image_dir / '../readme.md')
+        eid2 = g.embed_file(image_dir / '../readme.md')
+        self.assertEqual(eid1.id, eid2.id)
+        with g.page_draw_context() as ctx:
+            ctx.cmd_rg(1.0, 0.0, 0.0)
+            ctx.cmd_re(10, 10, 100, 100)
+            ctx.cmd_f()
+        g.write()
+        stats = g.get_stats()
+        self.assertEqual(stats.get_stream_count(capypdf.StreamClass.EmbeddedFile,
+                                                capypdf.StreamEncoding.Deflate), 1)
+
+    @validate_image('python_text', 400, 400)
+    def test_threaded_write(self, ofilename, w, h):
+        def generator(num_threads):
+            opts = text_document_options(w, h)
+            opts.set_num_threads(num_threads)
+            g = capypdf.Generator(ofilename, opts)
+            with g.page_draw_context() as ctx:
+                render_kerning_text(g, ctx)
+            return g
+        os.environ['SOURCE_DATE_EPOCH'] = '1700000000'
+        try:
+            serial = generator(1).write_to_bytes()
+            generator(4).write()
+        finally:
+            del os.environ['SOURCE_DATE_EPOCH']
+        data = ofilename.read_bytes()
+        # Streams compressed on the thread pool match serially compressed ones.
+        self.assertEqual(data, serial)
+        self.assertIn(b'/Filter /FlateDecode', data)
+
+    def test_parallel_serialization(self):
+        def generate(num_threads):
+            opts = capypdf.DocumentMetadata()
+            opts.set_num_threads(num_threads)
+            g = capypdf.Generator('unused.pdf', opts)
+            # Subset fonts are built concurrently.
+            fids = [g.load_font(noto_fontdir / f) for f in ('NotoSans-Regular.ttf',
+                                                             'NotoSans-Bold.ttf',
+                                                             'NotoSerif-Regular.ttf')]
+            for i in range(20):
+                with g.page_draw_context() as ctx:
+                    ctx.render_text(f'Page number {i}.', fids[i % len(fids)], 12, 50, 150)
+            return g.write_to_bytes()
+        os.environ['SOURCE_DATE_EPOCH'] = '1700000000'
+        try:
+            serial = generate(1)
+            parallel = generate(4)
+        finally:
+            del os.environ['SOURCE_DATE_EPOCH']
+        self.assertEqual(serial, parallel)
+
+    def test_shared_resources(self):
+        def resource_objects(merge):
+            opts = capypdf.DocumentMetadata()
+            opts.set_merge_resources(merge)
+            g = capypdf.Generator('unused.pdf', opts)
+            gsids = []
+            for i in range(2):
+                gs = capypdf.GraphicsState()
+                gs.set_CA(0.5 + i / 4)
+                gsids.append(g.add_graphics_state(gs))
+            for i in range(10):
+                with g.page_draw_context() as ctx:
+                    ctx.cmd_gs(gsids[i % 2])
+                    ctx.cmd_re(10, 10, 100, 100)
+                    ctx.cmd_S()
+            data = g.write_to_bytes()
+            return set(re.findall(rb'/Resources (\d+) 0 R', data))
+        self.assertEqual(len(resource_objects(False)), 2)
+        self.assertEqual(len(resource_objects(True)), 1)
+
+    def test_reproducible_output(self):
+        def generate():
+            g = capypdf.Generator('unused.pdf')
+            gsids = []
+            for i in range(5):
+                gs = capypdf.GraphicsState()
+                gs.set_CA(i / 5)
+                gsids.append(g.add_graphics_state(gs))
+            fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+            with g.page_draw_context() as ctx:
+                for gsid in reversed(gsids):
+                    ctx.cmd_gs(gsid)
+                ctx.render_text('Reproducible.', fid, 12, 50, 150)
+            return g.write_to_bytes()
+        os.environ['SOURCE_DATE_EPOCH'] = '1700000000'
+        try:
+            first = generate()
+            second = generate()
+        finally:
+            del os.environ['SOURCE_DATE_EPOCH']
+        self.assertEqual(first, second)
+        gs_numbers = [int(x) for x in re.findall(rb'/GS(\d+) \d+ 0 R', first)]
+        self.assertEqual(len(gs_numbers), 5)
+        self.assertEqual(gs_numbers, sorted(gs_numbers))
+
+    def test_reproducible_document_id(self):
+        def generate(x):
+            opts = capypdf.DocumentMetadata()
+            opts.set_compression(capypdf.StreamClass.Content, 0)
+            g = capypdf.Generator('unused.pdf', opts)
+            fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+            with g.page_draw_context() as ctx:
+                ctx.render_text('Invoice total 12.', fid, 12, x, 150)
+            return g.write_to_bytes()
+        def document_id(data):
+            return re.search(rb'/ID \[(<[0-9A-F]+>)', data).group(1)
+        os.environ['SOURCE_DATE_EPOCH'] = '1700000000'
+        try:
+            # Differing by one digit, so every object has the same offset.
+            first = generate(50)
+            second = generate(60)
+            again = generate(50)
+        finally:
+            del os.environ['SOURCE_DATE_EPOCH']
+        self.assertEqual(len(first), len(second))
+        self.assertNotEqual(document_id(first), document_id(second))
+        self.assertEqual(document_id(first), document_id(again))
+
+    @validate_image('python_text', 400, 400)
+    def test_object_streams(self, ofilename, w, h):
+        opts = text_document_options(w, h)
+        opts.set_object_streams(True)
+        with capypdf.Generator(ofilename, opts) as g:
+            with g.page_draw_context() as ctx:
+                render_kerning_text(g, ctx)
+        data = ofilename.read_bytes()
+        self.assertEqual(data.count(b'/Type /ObjStm'), 1)
+        self.assertIn(b'/Type /XRef', data)
+        self.assertNotIn(b'trailer', data)
+        # Dictionaries are only found inside the compressed object stream.
+        self.assertNotIn(b'/Type /Catalog', data)
+        self.assertNotIn(b'/Type /Page\n', data)
+
+    def test_object_streams_intent(self):
+        for intent in (capypdf.PdfAType.A1b, capypdf.PdfXType.X3_2003):
+            opts = capypdf.DocumentMetadata()
+            if isinstance(intent, capypdf.PdfAType):
+                opts.set_pdfa(intent)
+            else:
+                opts.set_pdfx(intent)
+            opts.set_object_streams(True)
+            with self.assertRaises(capypdf.CapyPDFException) as cm:
+                capypdf.Generator('unused.pdf', opts)
+            self.assertEqual(str(cm.exception), 'Operation prohibited by current output intent.')
+
+    @validate_image('python_text', 400, 400)
+    def test_compression_policy(self, ofilename, w, h):
+        opts = text_document_options(w, h)
+        opts.set_write_stats(True)
+        opts.set_compression_preset(capypdf.CompressionPreset.Fast)
+        opts.set_compression(capypdf.StreamClass.Font, 0)
+        with self.assertRaises(capypdf.CapyPDFException) as cm:
+            opts.set_compression(capypdf.StreamClass.Content, 10)
+        self.assertEqual(str(cm.exception), 'Compression level must be between 0 and 9.')
+        with capypdf.Generator(ofilename, opts) as g:
+            with g.page_draw_context() as ctx:
+                render_kerning_text(g, ctx)
+        stats = g.get_stats()
+        # Level zero stores the font as is, content still gets deflated.
+        self.assertEqual(stats.get_stream_count(capypdf.StreamClass.Font,
+                                                capypdf.StreamEncoding.Raw), 1)
+        self.assertEqual(stats.get_stream_count(capypdf.StreamClass.Font,
+                                                capypdf.StreamEncoding.Deflate), 0)
+        raw, encoded = stats.get_stream_bytes(capypdf.StreamClass.Font)
+        self.assertEqual(raw, encoded)
+        self.assertEqual(stats.get_stream_count(capypdf.StreamClass.Content,
+                                                capypdf.StreamEncoding.Deflate), 1)
+
+    @validate_image('python_simple', 480, 640)
+    def test_number_precision(self, ofilename, w, h):
+        opts = capypdf.DocumentMetadata()
+        with self.assertRaises(capypdf.CapyPDFException) as cm:
+            opts.set_number_precision(11)
+        self.assertEqual(str(cm.exception), 'Number precision must be between 0 and 10.')
+        opts.set_number_precision(2)
+        with capypdf.Generator(ofilename, opts) as g:
+            with g.page_draw_context() as ctx:
+                ctx.cmd_rg(1.0, 0.0, 0.0)
+                ctx.cmd_re(10.001, 9.999, 100, 100)
+                ctx.cmd_f()
+
+    @cleanup('number_operands.pdf')
+    def test_number_operands(self, ofilename):
+        opts = capypdf.DocumentMetadata()
+        opts.set_number_precision(2)
+        opts.set_compression(capypdf.StreamClass.Content, 0)
+        with capypdf.Generator(ofilename, opts) as g:
+            fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+            with g.page_draw_context() as ctx:
+                ctx.cmd_d([2.0, 1.0], 0.00001)
+                ctx.render_text('Size', fid, 12.0001, 10, 10)
+                t = ctx.text_new()
+                t.cmd_Tf(fid, 10.0)
+                t.cmd_Tc(0.0000001)
+                t.render_text('Spacing')
+                ctx.render_text_obj(t)
+        data = pathlib.Path(ofilename).read_bytes()
+        start = data.index(b'] 0 d')
+        content = data[start:data.index(b'endstream', start)]
+        self.assertIn(b' 12 Tf', content)
+        self.assertIn(b'0 Tc', content)
+        self.assertNotIn(b'e-', content)
+
+    @validate_image('python_text', 400, 400)
+    def test_compact_content(self, ofilename, w, h):
+        opts = text_document_options(w, h)
+        opts.set_compression(capypdf.StreamClass.Content, 0)
+        opts.set_compact_content_streams(True)
+        with capypdf.Generator(ofilename, opts) as g:
+            with g.page_draw_context() as ctx:
+                with ctx.push_gstate():
+                    render_kerning_text(g, ctx)
+        content = content_stream(ofilename.read_bytes())
+        self.assertTrue(content.startswith(b'q\nBT\n50 150 Td\n/SFont'), content)
+        self.assertTrue(content.endswith(b']TJ\nET\nQ\n\n'), content)
+        # No indentation and no spaces between the elements of the TJ array.
+        self.assertNotIn(b'\n ', content)
+        self.assertNotIn(b'> ', content)
+        self.assertNotIn(b' <', content)
+
+    @validate_image('python_text', 400, 400)
+    def test_display_list(self, ofilename, w, h):
+        def generator(filename, display_lists):
+            opts = text_document_options(w, h)
+            opts.set_compression(capypdf.StreamClass.Content, 0)
+            opts.set_display_lists(display_lists)
+            g = capypdf.Generator(filename, opts)
+            with g.page_draw_context() as ctx:
+                with ctx.push_gstate():
+                    ctx.cmd_g(0.0)
+                    render_kerning_text(g, ctx)
+            return g
+        direct = content_stream(generator('unused.pdf', False).write_to_bytes())
+        generator(ofilename, True).write()
+        content = content_stream(ofilename.read_bytes())
+        # Recorded operators are formatted exactly like directly written ones.
+        self.assertEqual(content, direct)
+        operators = [line.split()[-1] for line in content.splitlines() if line.strip()]
+        self.assertEqual(operators, [b'q', b'g', b'BT', b'Td', b'Tf', b'TJ', b'ET', b'Q'])
+
+    @validate_image('python_simple', 480, 640)
+    def test_optimize_content(self, ofilename, w, h):
+        opts = capypdf.DocumentMetadata()
+        opts.set_write_stats(True)
+        opts.set_optimize_content(True)
+        g = capypdf.Generator(ofilename, opts)
+        with g.page_draw_context() as ctx:
+            with ctx.push_gstate():
+                ctx.cmd_w(2)
+                ctx.cmd_cm(1, 0, 0, 1, 0, 0)
+            ctx.cmd_m(5, 5)
+            ctx.cmd_n()
+            ctx.cmd_rg(1.0, 0.0, 0.0)
+            ctx.cmd_rg(1.0, 0.0, 0.0)
+            ctx.cmd_re(10, 10, 100, 100)
+            ctx.cmd_f()
+        g.write()
+        self.assertEqual(g.get_stats().get_removed_operators(), 7)
+
+    @cleanup('optimize_gstate.pdf')
+    def test_optimize_gstate(self, ofilename):
+        opts = capypdf.DocumentMetadata()
+        opts.set_write_stats(True)
+        opts.set_optimize_content(True)
+        opts.set_compression(capypdf.StreamClass.Content, 0)
+        g = capypdf.Generator(ofilename, opts)
+        gs = capypdf.GraphicsState()
+        gs.set_CA(0.5)
+        gsid = g.add_graphics_state(gs)
+        with g.page_draw_context() as ctx:
+            ctx.cmd_gs(gsid)
+            ctx.cmd_gs(gsid)
+            ctx.cmd_re(10, 10, 100, 100)
+            ctx.cmd_f()
+            # The dictionary might set the line width, so it is kept.
+            ctx.cmd_w(2)
+            ctx.cmd_gs(gsid)
+            ctx.cmd_re(10, 10, 100, 100)
+            ctx.cmd_S()
+        g.write()
+        self.assertEqual(g.get_stats().get_removed_operators(), 1)
+        self.assertEqual(pathlib.Path(ofilename).read_bytes().count(b' gs\n'), 2)
+
+    @validate_image('python_simple', 480, 640)
+    def test_cmd_path(self, ofilename, w, h):
+        ops = bytes([capypdf.PathOp.MoveTo.value] + [capypdf.PathOp.LineTo.value] * 3
+                    + [capypdf.PathOp.ClosePath.value])
+        coords = array.array('d', [10, 10, 110, 10, 110, 110, 10, 110])
+        with capypdf.Generator(ofilename) as g:
+            with g.page_draw_context() as ctx:
+                with self.assertRaises(capypdf.CapyPDFException) as cm:
+                    ctx.cmd_path([capypdf.PathOp.MoveTo], [1.0])
+                self.assertEqual(str(cm.exception),
+                                 'Path coordinate count does not match the path operators.')
+                ctx.cmd_rg(1.0, 0.0, 0.0)
+                ctx.cmd_path(ops, coords)
+                ctx.cmd_f()
+
+    @validate_image('python_simple', 480, 640)
+    def test_command_buffer(self, ofilename, w, h):
+        with capypdf.Generator(ofilename) as g:
+            with g.page_draw_context() as ctx:
+                cmds = capypdf.CommandBuffer()
+                cmds.cmd_rg(1.0, 0.0, 0.0)
+                cmds.cmd_i(200)
+                with self.assertRaises(capypdf.CapyPDFException) as cm:
+                    ctx.execute(cmds)
+                self.assertEqual(str(cm.exception),
+                                 'Command 1 failed: Flatness value out of bounds.')
+                cmds.clear()
+                cmds.cmd_d([2.0, 1.0], 0.5)
+                cmds.cmd_BMC('Box')
+                cmds.cmd_re(10, 10, 100, 100)
+                cmds.cmd_f()
+                cmds.cmd_EMC()
+                ctx.execute(cmds)
+
+    @validate_image('python_simple', 480, 640)
+    def test_content_chunks(self, ofilename, w, h):
+        opts = capypdf.DocumentMetadata()
+        opts.set_write_stats(True)
+        with self.assertRaises(capypdf.CapyPDFException) as cm:
+            opts.set_content_chunk_size(-1)
+        self.assertEqual(str(cm.exception), 'Content chunk size must not be negative.')
+        opts.set_content_chunk_size(1024)
+        g = capypdf.Generator(ofilename, opts)
+        with g.page_draw_context() as ctx:
+            ctx.cmd_rg(1.0, 0.0, 0.0)
+            # Nested rectangles, so the filled area is the outermost one.
+            for i in range(500):
+                ctx.cmd_re(10 + i / 10, 10 + i / 10, 100 - i / 5, 100 - i / 5)
+            ctx.cmd_f()
+        g.write()
+        self.assertIn(b'/Contents [', ofilename.read_bytes())
+        stats = g.get_stats()
+        raw, encoded = stats.get_stream_bytes(capypdf.StreamClass.Content)
+        self.assertGreater(raw, encoded)
+        # The last part is compressed like the chunks before it.
+        self.assertEqual(stats.get_stream_count(capypdf.StreamClass.Content,
+                                                capypdf.StreamEncoding.Raw), 0)
+
+    @cleanup('text_chunks.pdf')
+    def test_text_content_chunks(self, ofilename):
+        opts = capypdf.DocumentMetadata()
+        opts.set_content_chunk_size(1024)
+        with capypdf.Generator(ofilename, opts) as g:
+            fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+            with g.page_draw_context() as ctx:
+                for i in range(100):
+                    ctx.render_text(f'Line number {i}.', fid, 8, 10, 10 + 8 * i)
+        self.assertIn(b'/Contents [', pathlib.Path(ofilename).read_bytes())
+
+    @cleanup('recycle.pdf')
+    def test_recycle_draw_context(self, ofilename):
+        with self.assertRaises(capypdf.CapyPDFException) as cm:
+            g = capypdf.Generator(ofilename)
+            g.recycle_draw_context(capypdf.FormXObjectDrawContext(g, 10, 10))
+        self.assertEqual(str(cm.exception), 'Invalid draw context type for this operation.')
+        g = capypdf.Generator(ofilename)
+        ctx = g.page_draw_context()
+        first_ptr = ctx._as_parameter_.value
+        for i in range(3):
+            with ctx:
+                ctx.cmd_re(10 * i, 10, 10, 10)
+                ctx.cmd_f()
+            g.recycle_draw_context(ctx)
+            ctx = g.page_draw_context()
+            self.assertEqual(ctx._as_parameter_.value, first_ptr)
+        g.write()
+        data = pathlib.Path(ofilename).read_bytes()
+        self.assertEqual(data.count(b'/Type /Page\n'), 3)
+
+    @cleanup('text_widths.pdf')
+    def test_text_widths(self, ofilename):
+        g = capypdf.Generator(ofilename)
+        fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+        texts = ['Av, Tv, kerning yo.', '', 'Lorem ipsum', 'Åäö']
+        widths = g.text_widths(texts, fid, 12)
+        self.assertEqual(widths, [g.text_width(t, fid, 12) for t in texts])
+        self.assertEqual(widths[1], 0)
+        # Widths scale linearly with the point size.
+        self.assertAlmostEqual(g.text_widths(['l'], fid, 24)[0], 2 * g.text_width('l', fid, 12))
+        with g.page_draw_context() as ctx:
+            ctx.render_text(texts[0], fid, 12, 10, 10)
+        g.write()
+
+    def test_kerning_cache(self):
+        def generate(preload):
+            opts = capypdf.DocumentMetadata()
+            opts.set_preload_kerning(preload)
+            g = capypdf.Generator('unused.pdf', opts)
+            # Noto fonts only have GPOS kerning, which is not supported.
+            fid = g.load_font(dejavu_fontdir / 'DejaVuSans.ttf')
+            widths = g.text_widths(['AV', 'A', 'V'], fid, 12)
+            with g.page_draw_context() as ctx:
+                ctx.render_text('AVA To.', fid, 12, 50, 150)
+            return widths, g.write_to_bytes()
+        os.environ['SOURCE_DATE_EPOCH'] = '1700000000'
+        try:
+            lazy_widths, lazy_pdf = generate(False)
+            preloaded_widths, preloaded_pdf = generate(True)
+        finally:
+            del os.environ['SOURCE_DATE_EPOCH']
+        self.assertEqual(lazy_widths, preloaded_widths)
+        self.assertEqual(lazy_pdf, preloaded_pdf)
+        self.assertLess(lazy_widths[0], lazy_widths[1] + lazy_widths[2])
+
+    @cleanup('identity_h.pdf')
+    def test_identity_h_font(self, ofilename):
+        opts = capypdf.DocumentMetadata()
+        opts.set_write_stats(True)
+        g = capypdf.Generator(ofilename, opts)
+        props = capypdf.FontProperties()
+        props.set_encoding(capypdf.FontEncoding.IdentityH)
+        fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf', props)
+        simple_fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+        self.assertNotEqual(fid.id, simple_fid.id)
+        # Both encodings stay cached.
+        self.assertEqual(fid.id, g.load_font(noto_fontdir / 'NotoSans-Regular.ttf', props).id)
+        self.assertEqual(simple_fid.id, g.load_font(noto_fontdir / 'NotoSans-Regular.ttf').id)
+        # More glyphs than fit in one single byte subset.
+        ranges = [(0x21, 0x7f), (0xc0, 0x180), (0x410, 0x450)]
+        text = ''.join(chr(c) for start, end in ranges for c in range(start, end))
+        with g.page_draw_context() as ctx:
+            ctx.render_text(text, fid, 4, 10, 10)
+        g.write()
+        self.assertEqual(g.get_stats().get_object_count(capypdf.ObjectKind.SubsetFontData)[0], 2)
+        data = pathlib.Path(ofilename).read_bytes()
+        self.assertIn(b'/Encoding /Identity-H', data)
+        self.assertIn(b'/Subtype /CIDFontType2', data)
+        self.assertIn(b'<0000> <FFFF>', data)
+
+    @validate_image('python_text', 400, 400)
+    def test_write_stats(self, ofilename, w, h):
+        def write(write_stats):
+            opts = text_document_options(w, h)
+            opts.set_write_stats(write_stats)
+            opts.set_num_threads(4)
+            with capypdf.Generator(ofilename, opts) as g:
+                with g.page_draw_context() as ctx:
+                    render_kerning_text(g, ctx)
+            return g.get_stats()
+        stats = write(True)
+        raw, encoded = stats.get_stream_bytes(capypdf.StreamClass.Font)
+        self.assertGreater(raw, encoded)
+        self.assertGreater(encoded, 0)
+        self.assertEqual(stats.get_stream_count(capypdf.StreamClass.Font,
+                                                capypdf.StreamEncoding.Deflate), 1)
+        self.assertEqual(stats.get_object_count(capypdf.ObjectKind.Page)[0], 1)
+        self.assertEqual(stats.get_object_count(capypdf.ObjectKind.SubsetFontData)[0], 1)
+        self.assertGreater(stats.get_phase_time(capypdf.WritePhase.Objects)[0], 0)
+        self.assertGreater(stats.get_phase_time(capypdf.WritePhase.Output)[0], 0)
+        self.assertGreaterEqual(stats.get_peak_buffered_bytes(), encoded)
+        # Nothing is collected unless requested.
+        stats = write(False)
+        self.assertEqual(stats.get_stream_bytes(capypdf.StreamClass.Font), (0, 0))
+        self.assertEqual(stats.get_object_count(capypdf.ObjectKind.Page)[0], 0)
+        self.assertEqual(stats.get_phase_time(capypdf.WritePhase.Output)[0], 0)
+
     def test_error(self):
         ofile = pathlib.Path('delme.pdf')
         if ofile.exists():
@@ -477,6 +1041,33 @@ class TestPDFCreation(unittest.TestCase):
                     ctx.scale(20, 30)
                     ctx.draw_image(ciid)
 
+    @cleanup('encoded_image.pdf')
+    def test_raw_image_encoding(self, ofilename):
+        w, h = 256, 64
+        pixels = bytes(v for y in range(h) for x in range(w) for v in (x, y, (x + y) // 2))
+        opts = capypdf.DocumentMetadata()
+        opts.set_write_stats(True)
+        g = capypdf.Generator(ofilename, opts)
+        ib = capypdf.RasterImageBuilder()
+        ib.set_size(w, h)
+        ib.set_pixel_data(pixels)
+        ipar = capypdf.ImagePdfProperties()
+        iid = g.add_image(ib.build(), ipar)
+        ib.set_size(w, h)
+        ib.set_pixel_data(pixels)
+        self.assertEqual(g.add_image(ib.build(), ipar).id, iid.id)
+        with g.page_draw_context() as ctx:
+            ctx.scale(w, h)
+            ctx.draw_image(iid)
+        g.write()
+        stats = g.get_stats()
+        self.assertEqual(stats.get_stream_count(capypdf.StreamClass.Image,
+                                                capypdf.StreamEncoding.PngPredictor), 1)
+        raw, encoded = stats.get_stream_bytes(capypdf.StreamClass.Image)
+        self.assertEqual(raw, len(pixels))
+        self.assertLess(encoded, raw)
+        self.assertIn(b'/Predictor 15', pathlib.Path(ofilename).read_bytes())
+
     @validate_image('python_linestyles', 200, 200)
     def test_line_styles(self, ofilename, w, h):
         prop = capypdf.PageProperties()